@@ -5,8 +5,10 @@
 #include <avr/pgmspace.h>
 #include <OneWire.h>
 #include <MemoryFree.h>
-#include <OneWireHub.h>
-#include <DS2401.h>
+#include <utility/twi.h>
+#include <util/twi.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
 
 #define NUM_ROWS 4
 #define OFFSET_X 10
@@ -19,37 +21,299 @@
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
 #define RESET_PIN 4
+#define DISPLAY_ADDRESS 0x3C
+#define DISPLAY_CLOCK 400000
+#define DISPLAY_BUFFER_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT / 8)
+#define DISPLAY_CHUNK 16
 
 #define DEBUG 1
+#define SNIFFER 1       // the S serial command, keyctl sniff
+#define RFID 1          // EM4100 keys, with the 125 kHz front end on RFID_*_PIN
 
-Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, RESET_PIN);
+Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, RESET_PIN, DISPLAY_CLOCK, DISPLAY_CLOCK);
 
 /*
  * Some words about keys: I intend to use this device only as an
  * iButton emulator for now, but later might add Metakom and
  * Cyfral keys. iButton key uses 48 bits of information,
- * Metakom - 28, Cyfral - 16, so dword should be plenty for a
- * key. But we also need to keep key type (1 byte) and key name 
- * (let's say 32 characters 1 byte each), so memory diagram looks
- * like this:
- * 
+ * Metakom - 28, Cyfral - 16, so every key type gets its own
+ * payload length (key_payload_lens) instead of a fixed dword.
+ * Names are length-prefixed, so a short name does not waste
+ * the rest of a 32-byte slot. Memory diagram looks like this:
+ *
+ * Header {
+ *      int  n_keys;
+ *      byte magic;
+ *      byte version;
+ *      int  table_end;     // first byte past the last record
+ *      int  compact_dst;   // record being moved by the compactor
+ *      int  compact_src;
+ *      int  compact_len;
+ *      byte compact_done;  // in chunks
+ *      byte compact_active;
+ *      byte quick_key;     // emulated right from power-on, see quick_emulate
+ *      byte quick_fingerprint;
+ * }
+ *
  * Key {
- *      byte type;
- *      char name[32];
- *      byte key[8];
+ *      byte type;          // bit 7 set - free record
+ *      byte len;           // packed name length
+ *      byte key[payload];  // payload length depends on type, raw keys
+ *                          // keep it in the first byte (see read_raw)
+ *      byte name[len];
  * }
- * 
- * All of these keys are stored in EEPROM and the first two bytes
- * of it are used for the total number of keys.
+ *
+ * Free records have bit 7 of the type set, the rest of it and
+ * len keep the high and low bytes of the free body length.
+ * Neighbouring free records get merged on delete, and a free
+ * record at the end of the table is cut off via table_end.
+ *
+ * Holes left by deleted keys get closed while the device is idle:
+ * compact_key_table_step moves the live record following the first
+ * hole down by at most COMPACT_CHUNK bytes at a time (never more
+ * than the hole, so a repeated chunk still reads intact source
+ * bytes), and the hole moves up until it is cut off at table_end.
+ * Progress is kept in the header and compact_active is written last
+ * (one byte can't be half-written), so a move interrupted by reset
+ * gets finished on boot. Reads don't wait for a move, they see the
+ * record where it is going (see key_table_address).
+ *
+ * Tables written by the original firmware (fixed 41-byte slots with
+ * no header) get migrated once on boot by migrate_key_table.
+ *
+ * Saves, deletes and renames are made atomic with a write-ahead
+ * journal in the last JOURNAL_SIZE bytes of EEPROM:
+ *
+ * Journal {
+ *      byte state;         // JOURNAL_COMMITTED while being applied
+ *      byte n_entries;
+ *      byte crc;           // crc8 of entries
+ *      struct {
+ *          int  address;
+ *          byte value;
+ *      } entries[MAX_JOURNAL_ENTRIES];
+ * }
+ *
+ * Key bodies (payload and name) go straight into free space, which
+ * nothing points to yet, and only header bytes go through the
+ * journal. If state is JOURNAL_COMMITTED on boot, the entries get
+ * applied again, otherwise the operation never happened.
+ *
+ * Right below the journal EVENT_LOG_SIZE bytes hold a ring of events,
+ * each a type byte followed by the seconds since the previous event
+ * (awake ones, millis stops in power-down) and an argument, both as
+ * base 127 varints: low digits first, 0x80 added to all but the last
+ * one. No event byte can be 0xFF, so the free part of the ring is the
+ * only run of 0xFF in it, which is where writing goes on after a reset
+ * without a head pointer to wear out. Room for an event is made by
+ * erasing whole old events in front of it.
+ *
+ * Names are packed into 6-bit symbols (see name_symbols), most
+ * significant bits first, and the last byte is padded with ones,
+ * which is NAME_SYMBOL_END. Letters are uppercase unless switched
+ * by NAME_SYMBOL_TOGGLE (until the next toggle) or NAME_SYMBOL_SHIFT
+ * (one letter). NAME_SYMBOL_WORD is followed by an index in
+ * name_words, NAME_SYMBOL_RAW - by two symbols holding any other
+ * character. So "New key 12" takes 3 bytes instead of 10.
  */
 #define KEY_PIN A3
-
-#define KEY_NAME_OFFSET 1
-#define KEY_NAME_LEN 32
+#define KEY_PIN_DDR DDRC
+#define KEY_PIN_PORT PORTC
+#define KEY_PIN_IN PINC
+#define KEY_PIN_BIT PC3
+#define KEY_ADC_CHANNEL 3
+#define RFID_LOAD_PIN 5
+#define RFID_LOAD_PORT PORTD
+#define RFID_LOAD_BIT PD5
+#define RFID_CARRIER_PIN 11     // OC2A
+#define RFID_DATA_PIN 8         // ICP1, demodulated tag signal
+#define READ_VOTES 3
+#define READ_ATTEMPTS 3
+#define MAX_FOUND_KEYS 8
+#define POLL_GAP_BUCKETS 8
+#define POLL_GAP_FIRST_US 16
+#define POLL_GAP_LIMIT_US 240       // half the shortest reset, longer gaps risk a missed reset
+#define OW_STANDARD 0
+#define OW_OVERDRIVE 1
+#define OW_RESET -1
+#define OW_IDLE -2                  // timeout, or a low too short for a reset
+#define OW_LOOP_CYCLES 6            // one turn of ow_wait_fall
+#define OW_LOOPS(us) ((uint16_t)((us) * (F_CPU / 1000000L) / OW_LOOP_CYCLES))
+#define OW_ELAPSED_US(since) ((uint16_t)(TCNT1 - (since)) / (F_CPU / 1000000L))  // Timer1 at the CPU clock
+#define OW_STUCK_US 4000            // longer lows are a shorted pad, not a reset
+#define OW_SESSION_IDLE_US 1000     // how long the slave waits for the next reset with interrupts off
+#define OW_OVERDRIVE_IDLE_US 10000  // how long one poll waits at overdrive speed, buttons get checked in between
+
+#define SNIFF_TICKS(us) ((uint16_t)((us) * (F_CPU / 1000000L)))
+#define SNIFF_OUT_SIZE DISPLAY_BUFFER_SIZE  // the output goes through the screen buffer, a power of two
+#define SNIFF_BUTTONS (_BV(PD2) | _BV(PD3) | _BV(PD4))     // TOP, MIDDLE and BOTTOM_BUTTON_PIN
+#define SNIFF_END 0
+#define SNIFF_RESET 1               // u16 ticks since the previous reset (saturated), u16 low ticks
+#define SNIFF_PRESENCE 2            // u16 ticks from the end of the reset, u16 low ticks
+#define SNIFF_BYTE 3                // the byte
+#define SNIFF_BITS 4                // count and bits of a byte cut short
+#define SNIFF_LATE 5                // u16 slots whose rise got away, counted as ones
+#define SNIFF_DROPPED 6             // u16 records the serial port couldn't keep up with
+#define SNIFF_START 7               // timer ticks per us
+
+#define KEY_TYPE_DS1990 0
+#define KEY_TYPE_RAW 1
+#define KEY_TYPE_CYFRAL 2
+#define KEY_TYPE_METACOM 3
+#define KEY_TYPE_EM4100 4
+#define KEY_TYPE_DS1992 5
+#define KEY_PAYLOAD_VARIABLE 0
+
+#define RAW_TRACE_SIZE 48
+#define MEMORY_PAGE_SIZE 32
+#define MEMORY_IMAGE_SIZE 128       // all of a DS1992, the first 4 pages of a DS1993 or DS1996
+#define MEMORY_ROM_OFFSET 1         // in the payload, after its length byte
+#define MEMORY_IMAGE_OFFSET 9
+#define MEMORY_PAYLOAD_LEN (MEMORY_IMAGE_OFFSET + MEMORY_IMAGE_SIZE)
+#define MEMORY_CACHE_PAGES 2
+#define MEMORY_NO_ENTRY 0xFF
+#define MEMORY_WRITE_CHUNK 8        // image bytes per M serial command, as they go through the journal
+#define MEMORY_ES_OFFSET 0x1F       // E/S register: ending offset,
+#define MEMORY_ES_PF (1 << 5)       // partial byte written,
+#define MEMORY_ES_AA (1 << 7)       // copy done
+#define RAW_RING_SIZE 16
+#define RAW_UNIT_TICKS 4        // Timer1 ticks at 1 us, so 4 us per unit
+#define RAW_JITTER 1
+#define RAW_MIN_EDGES 8
+#define RAW_WAIT_MS 50
+#define RAW_IDLE_MS 20
+#define RAW_REPLAY_GAP_MS 20
+#define RAW_CODE_REPEAT 0x80
+#define RAW_CODE_DELTA 0xC0
+#define RAW_CODE_LONG 0xE0
+#define RAW_MAX_REPEAT 64
+#define RAW_MAX_INTERVAL 0x0FFF
+
+#define DECODE_FRAMES 3
+#define DECODE_TIMEOUT_MS 250
+#define EMULATE_FRAMES 4
+#define FRAME_BYTES 5
+
+#define CYFRAL_START 0x01
+#define CYFRAL_START_BITS 4
+#define CYFRAL_CODE_BITS 16
+#define CYFRAL_SHORT_TICKS 40
+#define CYFRAL_LONG_TICKS 80
+
+#define METACOM_START 0x02
+#define METACOM_START_BITS 3
+#define METACOM_SHORT_TICKS 70
+#define METACOM_LONG_TICKS 140
+#define METACOM_SYNC_TICKS ((METACOM_SHORT_TICKS + METACOM_LONG_TICKS) * 2)
+
+#define EM4100_FRAME_BITS 64
+#define EM4100_HEADER_BITS 9
+#define EM4100_ROWS 10
+#define EM4100_HALF_BIT_TICKS 32  // Timer2 ticks at 8 us, 256 us is RF/64 at 125 kHz over 2
+#define EM4100_HALF_BIT_US 256
+#define EM4100_FRAMES 2
+#define EM4100_CARRIER_TOP 31       // 8 MHz / 2 / 32 = 125 kHz
+
+#define KEY_COUNT_OFFSET 0
+#define KEY_MAGIC_OFFSET 2
+#define KEY_VERSION_OFFSET 3
+#define KEY_TABLE_END_OFFSET 4
+#define KEY_COMPACT_DST_OFFSET 6
+#define KEY_COMPACT_SRC_OFFSET 8
+#define KEY_COMPACT_LEN_OFFSET 10
+#define KEY_COMPACT_DONE_OFFSET 12
+#define KEY_COMPACT_ACTIVE_OFFSET 13
+#define KEY_QUICK_OFFSET 14
+#define KEY_QUICK_FINGERPRINT_OFFSET 15
+#define KEY_TABLE_OFFSET 16
+#define KEY_TABLE_LIMIT EVENT_LOG_OFFSET
+
+// Can't be the first byte of an old table, as that would be a free run of 37 slots
+#define KEY_MAGIC 0xA5
+#define KEY_FORMAT_VERSION 1
+
+#define KEY_FREE (1 << 7)
+#define QUICK_KEY_NONE 0xFF
+#define QUICK_KEY_ALWAYS (1 << 7)   // on every power-on, not only with the middle button held
+#define QUICK_KEY_INDEX_MASK 0x7F
 #define KEY_TYPE_OFFSET 0
-#define KEY_OFFSET 33
-#define KEY_TABLE_OFFSET 2
-#define KEY_SIZE 41
+#define KEY_LEN_OFFSET 1
+#define KEY_OFFSET 2
+#define KEY_NAME_LEN 32
+
+#define MAX_JOURNAL_ENTRIES 10     // rename (a delete and a save) stages 10 at most, a memory chunk 8
+#define JOURNAL_ENTRY_SIZE 3        // address and value, as they are laid out in EEPROM
+#define JOURNAL_SIZE (JOURNAL_ENTRIES_OFFSET + MAX_JOURNAL_ENTRIES * JOURNAL_ENTRY_SIZE)
+#define JOURNAL_OFFSET (E2END + 1 - JOURNAL_SIZE)
+#define JOURNAL_STATE_OFFSET 0
+#define JOURNAL_LEN_OFFSET 1
+#define JOURNAL_CRC_OFFSET 2
+#define JOURNAL_ENTRIES_OFFSET 3
+#define JOURNAL_COMMITTED KEY_MAGIC
+
+#define EVENT_LOG_SIZE 63
+#define EVENT_LOG_OFFSET (JOURNAL_OFFSET - EVENT_LOG_SIZE - 1)
+#define EVENT_RING_OFFSET (EVENT_LOG_OFFSET + 1)   // after the magic byte
+#define EVENT_LOG_MAGIC 0x5A
+#define EVENT_LOG_CLOSED -1
+#define EVENT_MAX_LEN 11                            // type, then 5 + 5 digits at most
+#define EVENT_QUEUE_SIZE 16
+
+#define NAME_SYMBOL_BITS 6
+#define NAME_SYMBOL_WORD 59
+#define NAME_SYMBOL_RAW 60
+#define NAME_SYMBOL_TOGGLE 61
+#define NAME_SYMBOL_SHIFT 62
+#define NAME_SYMBOL_END 63
+
+/*
+ * Every stored key has a one byte fingerprint (crc8 of its type and
+ * payload) kept in SRAM in key order, so saving can tell whether the
+ * key is already there without reading the whole table. Fingerprints
+ * are rebuilt on boot, keys past MAX_FINGERPRINTS are compared
+ * through EEPROM.
+ */
+#define MAX_FINGERPRINTS 64
+
+#define NAME_CACHE_ROWS (NUM_ROWS * 2)      // the page on screen and half of one on each side of it
+#define NAME_CACHE_LEN ((SCREEN_WIDTH - OFFSET_X * 2 - 1) / FONT_WIDTH)    // as much as fits in a row
+#define NAME_CACHE_EMPTY 0xFF
+
+#define FIND_PREFIX_LEN 12
+#define FIND_BACK '<'
+#define FIND_LIST '>'
+#define FIND_ROWS (NUM_ROWS - 1)    // match rows under the prefix row
+
+#define COMPACT_CHUNK 8
+#define COMPACT_IDLE_MS 2000
+#define IDLE_SLEEP_MS 30000
+
+#define BANDGAP_MV_X1024 1126400L   // 1.1 V bandgap times the full ADC scale
+#define BANDGAP_SETTLE_MS 2
+#define BATTERY_CHECK_MS 5000
+#define BATTERY_FILTER_SHIFT 3
+#define BATTERY_FULL_MV 3300        // regulator output, the cell is above ~3.4 V
+#define BATTERY_LOW_MV 3150
+#define BATTERY_COPY_MV 3050        // a blank write draws a lot more than a read
+#define BATTERY_CRITICAL_MV 2900
+#define POWER_NORMAL 0
+#define POWER_LOW 1
+#define POWER_CRITICAL 2
+#define CONTRAST_NORMAL 0xCF
+#define CONTRAST_LOW 0x10
+#define FRAME_LOW_MS 200
+#define READ_POLL_LOW_MS 50
+
+#define EVENT_BOOT 0        // MCUSR
+#define EVENT_READ 1        // key type << 2 | read result
+#define EVENT_EMULATE 2     // key fingerprint
+#define EVENT_COPY 3        // copy result
+#define EVENT_POWER 4       // power level
+
+#define OLD_KEY_TABLE_OFFSET 2
+#define OLD_KEY_NAME_OFFSET 1
+#define OLD_KEY_OFFSET 33
+#define OLD_KEY_SIZE 41
 
 struct Key {
     uint64_t cur_key;
@@ -57,44 +321,342 @@ struct Key {
     byte key_type;
 };
 
+struct JournalEntry {
+    int address;
+    byte value;
+};
+
+struct NameWriter {
+    int offset;
+    byte n_bytes;
+    byte n_bits;
+    uint16_t bits;
+};
+
+struct NameReader {
+    int offset;
+    byte len;
+    byte n_bits;
+    uint16_t bits;
+};
+
+struct RawWriter {
+    byte n;             // intervals written, up to 2
+    byte run;           // intervals matching the one two back, not written yet
+    uint16_t prev[2];   // the last two intervals, prev[0] is the older one
+};
+
+struct RawReader {
+    byte pos;
+    byte repeat;
+    uint16_t prev[2];
+};
+
+struct KeyDecoder {
+    uint64_t code;
+    uint64_t last_code;
+    uint16_t period;    // running average, Metacom only
+    byte n_bits;
+    byte n_frames;      // frames in a row with the same code
+    byte shift;         // last bits, to find the start
+    bool synced;
+};
+
+struct ManchesterClock {
+    bool level;         // after the last edge
+    bool aligned;       // a long interval has shown where the bits are
+    bool at_mid;        // the last edge was in the middle of a bit
+};
+
+// One for each polarity of the front end
+struct Em4100Decoder {
+    uint64_t code;
+    byte n_bits;
+    byte run;           // ones in a row, before sync
+    byte row;
+    byte parity;
+    byte column;        // column parity so far
+    bool synced;
+};
+
+struct FrameReplay {
+    byte n_bits;
+    byte bit;
+    byte n_frames;      // left in this run
+    bool high;
+    bool sync;          // the first bit is a Metacom sync
+    uint16_t short_ticks;
+    uint16_t long_ticks;
+};
+
+/*
+ * 1-Wire slot timings in microseconds, as template arguments of the
+ * bit-banged master and slave, so every delay is a constant that
+ * compiles to a counted loop. The master part is what the reader
+ * sends, the slave part is how the emulator answers.
+ */
+struct StandardSpeed {
+    static const uint16_t reset_us = 480;
+    static const uint16_t presence_sample_us = 70;
+    static const uint16_t reset_recovery_us = 410;
+    static const uint8_t write1_low_us = 6;
+    static const uint8_t write1_rest_us = 64;
+    static const uint8_t write0_low_us = 60;
+    static const uint8_t write0_rest_us = 10;
+    static const uint8_t read_low_us = 6;
+    static const uint8_t read_sample_us = 9;
+    static const uint8_t read_rest_us = 55;
+
+    static const uint8_t reset_detect_us = 130;     // longer than any slot
+    static const uint8_t presence_wait_us = 20;
+    static const uint8_t presence_us = 120;
+    static const uint8_t sample_us = 30;
+    static const uint8_t hold_us = 30;
+    static const uint16_t slot_timeout_us = 2000;
+
+    static const uint8_t sniff_sample_us = 15;      // where masters sample, shorter lows are ones
+};
+
+struct OverdriveSpeed {
+    static const uint16_t reset_us = 70;
+    static const uint16_t presence_sample_us = 9;
+    static const uint16_t reset_recovery_us = 40;
+    static const uint8_t write1_low_us = 1;
+    static const uint8_t write1_rest_us = 8;
+    static const uint8_t write0_low_us = 8;
+    static const uint8_t write0_rest_us = 3;
+    static const uint8_t read_low_us = 1;
+    static const uint8_t read_sample_us = 1;
+    static const uint8_t read_rest_us = 7;
+
+    static const uint8_t reset_detect_us = 24;      // write 0 slots are up to 16
+    static const uint8_t presence_wait_us = 3;
+    static const uint8_t presence_us = 10;
+    static const uint8_t sample_us = 3;
+    static const uint8_t hold_us = 3;
+    static const uint16_t slot_timeout_us = 500;
+
+    static const uint8_t sniff_sample_us = 2;
+};
+
+/*
+ * A memory iButton being emulated. The image stays in the key table
+ * and pages of it get loaded into a small cache a byte at a time in
+ * the recovery time after each slot, so a page is there before
+ * Read Memory gets to it, whatever the speed.
+ */
+struct MemoryKey {
+    int image;                                          // EEPROM offset, -1 when there is none
+    byte image_len;
+    int page_tags[MEMORY_CACHE_PAGES];                  // page held by each entry, -1 when empty
+    byte filled[MEMORY_CACHE_PAGES];                    // bytes of the page loaded so far
+    byte dirty;                                         // a bit for every entry to be written back
+    uint8_t pages[MEMORY_CACHE_PAGES][MEMORY_PAGE_SIZE];
+    uint8_t scratchpad[MEMORY_PAGE_SIZE];
+    uint16_t target;                                    // TA2:TA1 of the last Write Scratchpad
+    byte status;                                        // E/S
+};
+
 OneWire ibutton(KEY_PIN);
 
+#if SNIFFER
+// The 1-Wire sniffer decoding as it captures, see sniff_onewire
+struct Sniffer {
+    uint8_t *out;
+    uint16_t out_head, out_tail;
+    uint16_t overflows;             // of Timer1 since the last reset
+    uint16_t reset_rose;
+    bool after_reset;               // the next low may be a presence pulse
+    byte bits, n_bits, n_bytes;
+    uint16_t late, dropped;
+};
+#endif
+
 byte read_key(uint64_t *key);
 byte copy_key(uint64_t new_key, Adafruit_SSD1306 *display = NULL);
 void emulate_key(uint64_t key);
-void save_key(bool original_title = false);
+bool save_key(bool original_title = false);
 void delete_key(int index);
 Key get_key_by_index(int index);
 int get_key_offset(int index);
 void update_key_by_index(Key key);
+void write_key(int offset, Key key);
+byte key_payload_len(byte type);
+byte key_data_len(Key key);
+byte key_data_byte(byte index);
+byte record_payload_len(int offset);
+int key_record_size(int offset);
+byte read_key_name(int offset, char *name);
+byte name_symbol(char c);
+void put_name_symbol(NameWriter *writer, byte symbol);
+byte get_name_symbol(NameReader *reader);
+byte encode_key_name(const char *name, int offset = -1);
+byte decode_key_name(int offset, byte len, char *name);
+int migrate_key(int offset, byte type, const uint8_t *key, const char *name, byte name_len, int limit);
+int old_key_slot(const uint8_t *scratch, int slot);
+void write_free_record(int offset, int size);
+void format_key_table();
+void init_key_table(uint8_t *scratch);
+void migrate_key_table(uint8_t *scratch);
+byte key_fingerprint(Key key);
+uint16_t key_record_hash(int index);
+void build_key_fingerprints();
+void build_name_order();
+void name_order_shift(byte index, int delta);
+void name_order_place(byte index);
+byte name_order_bound(const char *prefix, byte len, byte lo, byte hi, bool upper);
+int find_key(Key key);
+bool rename_key(int index);
+void quick_emulate(byte reset_cause);
+bool set_quick_key(int index, bool always);
+void quick_key_shift(int index, int delta);
+bool compact_key_table_step();
+bool finish_key_compaction();
+byte key_table_read(int address);
+int key_table_address(int address);
+int key_table_read_int(int address);
+void key_table_write(int address, byte value);
+void key_table_write_int(int address, int value);
+bool journal_staged(int address);
+void journal_begin();
+bool journal_commit();
+void journal_recover();
+byte journal_crc();
 
 void writeByte(byte data, int pin);
 
 byte read_ds1990(uint64_t *key);
+bool read_rom_voted(uint8_t *rom);
+void search_keys();
+void save_found_keys();
 byte copy_ds1990(uint64_t new_key, Adafruit_SSD1306 *display = NULL);
 void emulate_ds1990(uint64_t key);
+void emulate_ds1992(uint64_t key);
+void emulate_onewire(uint8_t *rom, MemoryKey *memory);
+void record_poll_gap(uint16_t gap);
+#if SNIFFER
+void sniff_onewire();
+void sniff_pulse(Sniffer *sniffer, uint16_t fell, uint16_t rose, bool late);
+bool sniff_record(Sniffer *sniffer, byte len);
+void sniff_put(Sniffer *sniffer, byte value);
+void sniff_put_word(Sniffer *sniffer, uint16_t value);
+void sniff_flush(Sniffer *sniffer);
+#endif
+byte copy_unsupported(uint64_t new_key, Adafruit_SSD1306 *display = NULL);
+byte read_unsupported(uint64_t *key);
+#if !RFID
+void emulate_unsupported(uint64_t key);
+#endif
+
+byte read_raw(uint64_t *key);
+void emulate_raw(uint64_t key);
+bool raw_capture_edge(unsigned int timeout_ms, uint16_t *ticks);
+void raw_replay_rewind();
+uint16_t raw_replay_next();
+void replay_edges(void (*rewind)(void));
+byte read_cyfral(uint64_t *key);
+byte read_metacom(uint64_t *key);
+bool decode_capture(bool (*decode)(uint16_t low, uint16_t high));
+bool cyfral_decode(uint16_t low, uint16_t high);
+bool metacom_decode(uint16_t low, uint16_t high);
+bool frame_decoded(byte n_frames);
+void emulate_cyfral(uint64_t key);
+void emulate_metacom(uint64_t key);
+void set_frame_bit(byte index);
+void frame_replay_rewind();
+uint16_t frame_replay_next();
+#if RFID
+byte read_em4100(uint64_t *key);
+bool em4100_decode(uint16_t ticks);
+bool em4100_decode_bit(Em4100Decoder *d, bool bit);
+void emulate_em4100(uint64_t key);
+void em4100_build_frame(uint64_t key);
+#endif
+void raw_capture_begin();
+void raw_capture_end();
+bool raw_trace_put(RawWriter *writer, uint16_t interval);
+bool raw_trace_flush(RawWriter *writer);
+bool raw_trace_emit(byte code);
+uint16_t raw_trace_next(RawReader *reader);
+uint64_t raw_trace_summary(const uint8_t *trace);
+void load_raw_trace(int index);
 
 const int read_functions[] PROGMEM = {
     (const int)read_ds1990,
+    (const int)read_raw,
+    (const int)read_cyfral,
+    (const int)read_metacom,
+#if RFID
+    (const int)read_em4100,
+#else
+    (const int)read_unsupported,
+#endif
+    (const int)read_unsupported,
 };
 
 const int emulate_functions[] PROGMEM = {
     (const int)emulate_ds1990,
+    (const int)emulate_raw,
+    (const int)emulate_cyfral,
+    (const int)emulate_metacom,
+#if RFID
+    (const int)emulate_em4100,
+#else
+    (const int)emulate_unsupported,
+#endif
+    (const int)emulate_ds1992,
 };
 
 const int copy_functions[] PROGMEM = {
     (const int)copy_ds1990,
+    (const int)copy_unsupported,
+    (const int)copy_unsupported,
+    (const int)copy_unsupported,
+    (const int)copy_unsupported,
+    (const int)copy_unsupported,
+};
+
+const byte key_payload_lens[] PROGMEM = {
+    8,
+    KEY_PAYLOAD_VARIABLE,
+    2,
+    4,
+    5,
+    KEY_PAYLOAD_VARIABLE,
 };
 
+// The only nibbles Cyfral sends, index is the 2 bits they carry
+const byte cyfral_nibbles[] PROGMEM = {0x07, 0x0B, 0x0D, 0x0E};
+
 void top_button ();
 void middle_button ();
 void bottom_button ();
 void check_buttons ();
 bool check_button(int index);
+bool check_repeat(int index);
+bool screen_repeats();
+void display_flush();
+void display_flush_step();
+bool display_twi_busy();
+void display_twi_send(uint8_t *data, byte len);
+bool display_flushed();
+void flush_delay(unsigned long ms);
+void sleep_until_woken();
+unsigned int read_vcc();
+void check_battery();
+bool battery_allows_writes();
+void log_event(byte type, unsigned long arg);
+byte event_put_varint(uint8_t *event, byte pos, unsigned long value);
+void event_log_step();
+void event_log_open();
+byte event_length_at(int pos);
+void event_log_flush();
+void draw_battery_glyph();
 void draw(int offset);
 
 void switch_screen(int offset);
 void redraw();
+void request_redraw();
 
 void list_screen_top_button_pressed(int offset);
 void list_screen_middle_button_pressed(int offset);
@@ -105,7 +667,25 @@ void key_list_top_button_pressed(int offset);
 void key_list_middle_button_pressed(int offset);
 void key_menu_middle_button_pressed(int offset); // TODO
 void key_list_bottom_button_pressed(int offset);
+void key_list_move(int offset, int dir);
+int key_list_letter_jump(int index, int dir);
 void key_list_draw(int offset);
+const char *cached_key_name(byte index);
+bool name_cache_prefetch_step();
+void name_cache_invalidate(byte from);
+void duplicate_menu_middle_button_pressed(int offset);
+void search_list_top_button_pressed(int offset);
+void search_list_middle_button_pressed(int offset);
+void search_list_bottom_button_pressed(int offset);
+void search_list_draw(int offset);
+void find_begin();
+void find_top_button_pressed(int offset);
+void find_middle_button_pressed(int offset);
+void find_bottom_button_pressed(int offset);
+void find_draw(int offset);
+char find_next_char(char c);
+char find_prev_char(char c);
+void find_narrow();
 
 void display_screen_top_button_pressed(int offset);
 void read_screen_middle_button_pressed(int offset);
@@ -202,9 +782,50 @@ const char str18[] PROGMEM = "READ BUT NOT IBUTTON";
 const char str19[] PROGMEM = "READ BUT WRONG CRC";
 const char str20[] PROGMEM = "New key ";
 const char str21[] PROGMEM = "DELETE";
+const char str22[] PROGMEM = "ALREADY STORED";
+const char str23[] PROGMEM = "SAVE AS NEW";
+const char str24[] PROGMEM = "SEARCH BUS";
+const char str25[] PROGMEM = "SAVE ALL";
+const char str26[] PROGMEM = "SEARCH AGAIN";
+const char str27[] PROGMEM = "RAW";
+const char str28[] PROGMEM = "CYFRAL";
+const char str29[] PROGMEM = "METACOM";
+const char str30[] PROGMEM = "EM4100";
+const char str31[] PROGMEM = "BATTERY LOW";
+const char str32[] PROGMEM = "FIND KEY";
+const char str33[] PROGMEM = "FIND ";
 
 const char *const string_arr[] PROGMEM = {str0, str1, str2, str3, str4, str5, str6, str7, str8,
-    str9, str10, str11, str12, str13, str14, str15, str16, str17, str18, str19, str20, str21};
+    str9, str10, str11, str12, str13, str14, str15, str16, str17, str18, str19, str20, str21,
+    str22, str23, str24, str25, str26, str27, str28, str29, str30, str31,
+    str32, str33};
+
+const char name_symbols[] PROGMEM = " ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.,:;/#()+&'!?*@%=<>\"";
+
+const char word1[] PROGMEM = "KEY";
+const char word2[] PROGMEM = "Key";
+const char word3[] PROGMEM = "DOOR";
+const char word4[] PROGMEM = "Door";
+const char word5[] PROGMEM = "HOME";
+const char word6[] PROGMEM = "Home";
+const char word7[] PROGMEM = "WORK";
+const char word8[] PROGMEM = "Work";
+const char word9[] PROGMEM = "OFFICE";
+const char word10[] PROGMEM = "Office";
+const char word11[] PROGMEM = "GATE";
+const char word12[] PROGMEM = "Gate";
+const char word13[] PROGMEM = "ENTRANCE";
+const char word14[] PROGMEM = "Entrance";
+const char word15[] PROGMEM = "GARAGE";
+const char word16[] PROGMEM = "Garage";
+const char word17[] PROGMEM = "FLAT";
+const char word18[] PROGMEM = "Flat";
+
+// Generated names are the most common ones, so "New key " goes first
+const char *const name_words[] PROGMEM = {str20, word1, word2, word3, word4, word5, word6, word7, word8,
+    word9, word10, word11, word12, word13, word14, word15, word16, word17, word18};
+
+#define N_NAME_WORDS (sizeof(name_words) / sizeof(name_words[0]))
 
 #define BUFFER_LEN 64
 
@@ -212,14 +833,18 @@ char buffer[BUFFER_LEN];
 bool new_data = false;
 void check_serial();
 void process_serial();
+void print_key_line(int index);
 
 enum Offset {
     MAIN_MENU = 0,
-    READ_SCREEN = 10,
-    READ_SUCCESSFUL_MENU = 18,
-    KEY_MENU = 31,
-    EMULATE_SCREEN = 44,
-    COPY_SCREEN = 51,
+    READ_SCREEN = 14,
+    READ_SUCCESSFUL_MENU = 26,
+    KEY_MENU = 39,
+    EMULATE_SCREEN = 52,
+    COPY_SCREEN = 59,
+    DUPLICATE_MENU = 66,
+    SEARCH_MENU = 77,
+    FIND_SCREEN = 89,
     NULL_SCREEN
 };
 
@@ -230,10 +855,14 @@ const int screens[] PROGMEM = {
     (const int)key_list_bottom_button_pressed,
     (const int)key_list_draw,
     KEY_MENU,
-    2,
+    4,
     (const int)str0,
+    (const int)str24,
+    (const int)str32,
     (const int)str_blank,
     READ_SCREEN,
+    SEARCH_MENU,
+    FIND_SCREEN,
     NULL_SCREEN,
 
     //Read screen
@@ -243,8 +872,12 @@ const int screens[] PROGMEM = {
     (const int)display_screen_draw,
     (const int)str0,
     (const int)str6,
-    1,
+    5,
     (const int)str7,
+    (const int)str27,
+    (const int)str28,
+    (const int)str29,
+    (const int)str30,
 
     //Read screen menu
     (const int)list_screen_top_button_pressed,
@@ -293,6 +926,39 @@ const int screens[] PROGMEM = {
     (const int)str2,
     (const int)str_blank,
     0,
+
+    //Duplicate key menu
+    (const int)list_screen_top_button_pressed,
+    (const int)duplicate_menu_middle_button_pressed,
+    (const int)list_screen_bottom_button_pressed,
+    (const int)list_screen_draw,
+    3,
+    (const int)str22,
+    (const int)str23,
+    (const int)str13,
+    KEY_MENU,
+    MAIN_MENU,
+    READ_SUCCESSFUL_MENU,
+
+    //Search results
+    (const int)search_list_top_button_pressed,
+    (const int)search_list_middle_button_pressed,
+    (const int)search_list_bottom_button_pressed,
+    (const int)search_list_draw,
+    READ_SUCCESSFUL_MENU,
+    3,
+    (const int)str26,
+    (const int)str25,
+    (const int)str5,
+    SEARCH_MENU,
+    MAIN_MENU,
+    MAIN_MENU,
+
+    //Find by name
+    (const int)find_top_button_pressed,
+    (const int)find_middle_button_pressed,
+    (const int)find_bottom_button_pressed,
+    (const int)find_draw,
 };
 
 int prev_screen = 0;
@@ -301,6 +967,102 @@ int cur_screen = 0;
 int cur_child = 0;
 
 Key global_key = {0, -1, 0};
+int duplicate_index = -1;
+
+byte key_fingerprints[MAX_FINGERPRINTS];
+
+/*
+ * State only one thing needs at a time: the names of the key list on
+ * screen, a capture being decoded, a replay or a memory key being
+ * emulated. read_key and emulate_key drop the cached names first.
+ */
+union Scratch {
+    struct {
+        char name_cache[NAME_CACHE_ROWS][NAME_CACHE_LEN + 1];   // key index i goes to slot i % NAME_CACHE_ROWS
+        byte name_cache_tags[NAME_CACHE_ROWS];
+    };
+    struct {
+        volatile uint16_t raw_ring[RAW_RING_SIZE];
+        volatile byte raw_ring_head;
+        volatile byte raw_ring_tail;
+        volatile bool raw_ring_overflow;
+        uint16_t raw_last_edge;
+        KeyDecoder decoder;
+        #if RFID
+        ManchesterClock em4100_clock;
+        Em4100Decoder em4100[2];
+        #endif
+    };
+    struct {
+        RawReader raw_replay;
+        FrameReplay frame_replay;
+        uint8_t replay_frame[FRAME_BYTES];
+        #if RFID
+        uint8_t em4100_half_bits[EM4100_FRAME_BITS * 2 / 8];    // load levels for every half bit of a frame, the ISR only copies them out
+        #endif
+    };
+    MemoryKey memory_key;
+} scratch;
+
+int name_cache_page = -1;   // first key index of the page on screen, -1 when no key list is shown
+
+// Key indices sorted by name, rebuilt on first use after anything it can't follow incrementally
+byte name_order[MAX_FINGERPRINTS];
+byte name_order_len = 0;
+bool name_order_stale = true;
+
+char find_prefix[FIND_PREFIX_LEN + 1];     // lower case, as strncasecmp compares
+byte find_len = 0;
+char find_candidate = FIND_LIST;
+byte find_lo = 0, find_hi = 0;              // name_order range starting with find_prefix
+
+uint64_t found_keys[MAX_FOUND_KEYS];
+
+// Time the bus went unwatched between slave polls in the last DS1990 emulation, bucket i is below POLL_GAP_FIRST_US << i
+uint16_t poll_gaps[POLL_GAP_BUCKETS + 1];
+uint16_t poll_gap_max = 0;
+byte ow_speed = OW_STANDARD;    // of the emulated key, Overdrive Skip and Match ROM switch it until a standard reset
+byte n_found_keys = 0;
+
+// Length first, then the encoded intervals, same as the payload of a raw key
+uint8_t raw_trace[RAW_TRACE_SIZE];
+
+// Where the image of a memory key about to be saved gets copied from, -1 for a blank one
+int memory_source = -1;
+
+// Called from the compare interrupt for the length of the next phase in ticks, 0 ends the run
+uint16_t (*replay_next)(void);
+volatile bool replay_done = true;
+#if RFID
+volatile byte em4100_pos = 0;
+#endif
+
+bool compaction_active = false;
+
+JournalEntry journal[MAX_JOURNAL_ENTRIES];
+byte journal_len = 0;
+byte journal_depth = 0;
+bool journal_failed = false;        // a write didn't fit or a step failed, the transaction gets rolled back
+unsigned long last_activity = 0;
+
+unsigned int battery_mv_x8 = 0;     // VCC in mV, filtered and scaled by 1 << BATTERY_FILTER_SHIFT
+unsigned long last_battery_check = 0;
+byte power_level = POWER_NORMAL;
+unsigned long display_frame_ms = 0;
+
+// Encoded events waiting for EEPROM, which takes 3.3 ms a byte
+uint8_t event_queue[EVENT_QUEUE_SIZE];
+byte event_queue_len = 0, event_queue_pos = 0;
+unsigned long event_last_ms = 0;
+int event_head = EVENT_LOG_CLOSED;      // first free byte of the ring
+int event_tail = 0;                     // oldest event
+byte event_free = 0;                    // length of the free run
+byte event_erase_left = 0;              // of the old event being erased
+byte event_write_left = 0;              // of the event being written
+
+int display_flush_pos = -1;
+bool display_dirty = false;
+bool display_window_set = false;    // the page and column range went out for this frame
 
 #define TOP_BUTTON_PIN 2
 #define MIDDLE_BUTTON_PIN 3
@@ -308,24 +1070,49 @@ Key global_key = {0, -1, 0};
 #define TOP_BUTTON_INDEX 0
 #define MIDDLE_BUTTON_INDEX 1
 #define BOTTOM_BUTTON_INDEX 2
+#define DEBOUNCE_MS 25
+#define REPEAT_DELAY_MS 400
+#define REPEAT_MS 120
+#define REPEAT_PAGE_AFTER 6         // repeats before a held button moves by pages
+#define REPEAT_LETTER_AFTER 14      // and then by letters
+#define NAV_ROW 0
+#define NAV_PAGE 1
+#define NAV_LETTER 2
 
 struct Button {
     byte pin : 4;
     bool executed : 1;
     bool pressed : 1;
+    bool held_over : 1;     // held through a screen change, doesn't repeat until released
+    byte repeats;
+    unsigned int since;     // millis() when pressed went true, then of the last repeat
     void (*func)(void);
 };
 
 struct Button buttons[3] = {
-    { TOP_BUTTON_PIN, false, false, top_button },
-    { MIDDLE_BUTTON_PIN, false, false, middle_button },
-    { BOTTOM_BUTTON_PIN, false, false, bottom_button }
+    { TOP_BUTTON_PIN, false, false, false, 0, 0, top_button },
+    { MIDDLE_BUTTON_PIN, false, false, false, 0, 0, middle_button },
+    { BOTTOM_BUTTON_PIN, false, false, false, 0, 0, bottom_button }
 };
 
+byte nav_step = NAV_ROW;
+bool redraw_pending = false;
+
 void setup() {
     Serial.begin(9600);
 
-    if(!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) {
+    pinMode(TOP_BUTTON_PIN, INPUT_PULLUP);
+    pinMode(MIDDLE_BUTTON_PIN, INPUT_PULLUP);
+    pinMode(BOTTOM_BUTTON_PIN, INPUT_PULLUP);
+
+    byte reset_cause = MCUSR;
+    log_event(EVENT_BOOT, reset_cause);
+    MCUSR = 0;
+
+    // The rest waits until emulation is left
+    quick_emulate(reset_cause);
+
+    if(!display.begin(SSD1306_SWITCHCAPVCC, DISPLAY_ADDRESS)) {
         Serial.println(F("SSD1306 allocation failed"));
 
         for(;;);
@@ -333,18 +1120,36 @@ void setup() {
 
     display.setRotation(2);
 
-    pinMode(TOP_BUTTON_PIN, INPUT_PULLUP);
-    pinMode(MIDDLE_BUTTON_PIN, INPUT_PULLUP);
-    pinMode(BOTTOM_BUTTON_PIN, INPUT_PULLUP);
+    check_battery();
+    init_key_table(display.getBuffer());
+    build_key_fingerprints();
+    name_cache_invalidate(0);
 
     switch_screen(MAIN_MENU);
     reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[MAIN_MENU + SCREEN_DRAW_FUNC_OFFSET]))(MAIN_MENU);
 }
 
 void loop() {
+    display_flush_step();
+
+    // Moves made while a frame was still going out get drawn once, at the final position
+    if (redraw_pending && display_flush_pos == -1)
+        redraw();
+    else if (!redraw_pending)
+        name_cache_prefetch_step();
+
     check_buttons();
     check_serial();
     process_serial();
+
+    if (millis() - last_battery_check > BATTERY_CHECK_MS)
+        check_battery();
+
+    event_log_step();
+
+    if (millis() - last_activity > COMPACT_IDLE_MS && !compact_key_table_step() &&
+        millis() - last_activity > IDLE_SLEEP_MS && display_flushed() && !Serial.available())
+        sleep_until_woken();
 }
 
 void check_serial() {
@@ -379,213 +1184,873 @@ void check_serial() {
     }
 }
 
+/*
+ * Every command is answered with a line starting with OK or ERR, after
+ * whatever it prints, so a host can keep several commands in flight
+ * as long as they fit in the serial RX buffer. Debug output never
+ * starts with either.
+ */
 void process_serial() {
     if (new_data) {
-        Serial.print("Received: ");
-        Serial.println(buffer);
+        last_activity = millis();
 
         if (buffer[0] == 'K') {
+            // Records can't be dropped by count alone any more, so only "K 0" is left to wipe the table
             int key_num = atoi(buffer + 2);
-            EEPROM.updateInt(0, key_num);
+            if (key_num == 0)
+                format_key_table();
+
+            if (key_num == 0 && EEPROM.readInt(KEY_COUNT_OFFSET) == 0)
+                Serial.println(F("OK"));
+            else
+                Serial.println(F("ERR not wiped"));
         } else if (buffer[0] == 'D') {
             int deleted = atoi(buffer + 2);
+            int n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
             delete_key(deleted);
+
+            if (EEPROM.readInt(KEY_COUNT_OFFSET) < n_keys)
+                Serial.println(F("OK"));
+            else
+                Serial.println(F("ERR not deleted"));
         } else if (buffer[0] == 'W') {
             byte i = 2, j = 0;
-            for (; j < KEY_NAME_LEN && buffer[i] != ' '; i++, j++) {
+            char name_end = ' ';
+
+            // A quoted name may hold spaces
+            if (buffer[i] == '"') {
+                name_end = '"';
+                i++;
+            }
+
+            for (; j < KEY_NAME_LEN && buffer[i] && buffer[i] != name_end; i++, j++) {
                 buffer[j] = buffer[i];
             }
-            if (j < KEY_NAME_LEN)
-                buffer[j] = '\0';
+
+            if (buffer[i] != name_end) {
+                Serial.println(F("ERR name"));
+                new_data = false;
+                return;
+            }
+
+            if (name_end == '"')
+                i++;
+
+            buffer[j] = '\0';      // j is behind i, the rest of the command is still there
 
             char *cur_pointer = buffer + i + 1;
             global_key.key_type = strtol(cur_pointer, &cur_pointer, 10);
 
+            if (global_key.key_type >= sizeof(key_payload_lens) || global_key.key_type == KEY_TYPE_RAW) {
+                Serial.println(F("ERR type"));
+                new_data = false;
+                return;
+            }
+
             global_key.cur_key = 0;
             for (j = 0; j < 7; j++) {
                 ((uint8_t*)&global_key.cur_key)[j] = (byte)strtol(cur_pointer, &cur_pointer,  16);
             }
 
-            ((uint8_t*)&global_key.cur_key)[7] = ibutton.crc8((uint8_t*)&global_key.cur_key, 7);
+            // Only iButtons carry a CRC, other keys are matched on their payload alone
+            if (global_key.key_type == KEY_TYPE_DS1990 || global_key.key_type == KEY_TYPE_DS1992)
+                ((uint8_t*)&global_key.cur_key)[7] = ibutton.crc8((uint8_t*)&global_key.cur_key, 7);
 
-            Serial.print(F("Received "));
-            for (j = 0; j < 8; j++) {
-                if (((uint8_t*)&global_key.cur_key)[j] / 16 == 0)
-                    Serial.print(0);
-                
-                Serial.print(((uint8_t*)&global_key.cur_key)[j], HEX);
-                Serial.print(' ');
+            int index = find_key(global_key);
+            bool saved = true;
+            char name[KEY_NAME_LEN + 1];
+
+            if (index != -1) {
+                read_key_name(get_key_offset(index), name);
+
+                // A key sent again as it is stays untouched, only its index is answered
+                if (strcmp(name, buffer))
+                    saved = rename_key(index);
+                else
+                    global_key.key_index = index;
+            } else {
+                saved = save_key(true);
+            }
+
+            if (saved) {
+                Serial.print(F("OK "));
+                Serial.println(global_key.key_index);
+            } else {
+                Serial.println(F("ERR not saved"));
+            }
+        } else if (buffer[0] == 'M') {
+            // "M address bytes...": memory image of the key W wrote last, MEMORY_WRITE_CHUNK bytes at most
+            char *cur_pointer = buffer + 2;
+            int address = strtol(cur_pointer, &cur_pointer, 10);
+
+            if (global_key.key_type != KEY_TYPE_DS1992 || global_key.key_index == -1) {
+                Serial.println(F("ERR key"));
+                new_data = false;
+                return;
+            }
+
+            if (address < 0 || address >= MEMORY_IMAGE_SIZE) {
+                Serial.println(F("ERR address"));
+                new_data = false;
+                return;
+            }
+
+            if (!battery_allows_writes()) {
+                Serial.println(F("ERR not written"));
+                new_data = false;
+                return;
+            }
+
+            int offset = get_key_offset(global_key.key_index) + KEY_OFFSET + MEMORY_IMAGE_OFFSET;
+            byte written = 0;
+
+            journal_begin();
+
+            for (; written < MEMORY_WRITE_CHUNK && address + written < MEMORY_IMAGE_SIZE; written++) {
+                char *end;
+                byte value = strtol(cur_pointer, &end, 16);
+                if (end == cur_pointer)
+                    break;
+
+                key_table_write(offset + address + written, value);
+                cur_pointer = end;
+            }
+
+            if (!journal_commit()) {
+                Serial.println(F("ERR not written"));
+                new_data = false;
+                return;
             }
-            Serial.println();
 
-            save_key(true);
+            // Anything left over didn't fit
+            while (*cur_pointer == ' ')
+                cur_pointer++;
+
+            if (*cur_pointer)
+                Serial.println(F("ERR address"));
+            else
+                Serial.println(F("OK"));
         } else if (buffer[0] == 'L') {
-            int cur_n_keys = EEPROM.readInt(0);
+            int cur_n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
             Serial.print(F("Number of keys - "));
             Serial.println(cur_n_keys);
 
-            for (int i = 0; i < cur_n_keys; i++) {
-                int cur_key_start = get_key_offset(i);
-
-                Serial.print(i);
-                Serial.print(' ');
+            for (int i = 0; i < cur_n_keys; i++)
+                print_key_line(i);
 
-                for (byte j = 0; j < KEY_NAME_LEN && EEPROM.readByte(cur_key_start + KEY_NAME_OFFSET + j) != '\0'; j++) {
-                    Serial.print((char)EEPROM.readByte(cur_key_start + KEY_NAME_OFFSET + j));
+            Serial.print(F("OK "));
+            Serial.println(cur_n_keys);
+        } else if (buffer[0] == 'R') {
+            // One key as L lists it, for fetching only the keys which changed
+            int index = atoi(buffer + 2);
+
+            if (buffer[1] != ' ' || index < 0 || index >= EEPROM.readInt(KEY_COUNT_OFFSET)) {
+                Serial.println(F("ERR index"));
+            } else {
+                print_key_line(index);
+                Serial.println(F("OK"));
+            }
+        } else if (buffer[0] == 'H') {
+            /*
+             * "H" answers with the key count and the table digest, the sum
+             * of key_record_hash over all keys, so it doesn't depend on the
+             * order of the keys. "H first" lists the hashes from key first
+             * on before that, 16 a line.
+             */
+            int n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
+            int first = buffer[1] == ' ' ? atoi(buffer + 2) : n_keys;
+            uint16_t digest = 0;
+
+            for (int i = 0; i < n_keys; i++) {
+                uint16_t hash = key_record_hash(i);
+                digest += hash;
+
+                if (i < first)
+                    continue;
+
+                for (byte j = 0; j < 2; j++) {
+                    byte value = j ? hash & 0xFF : hash >> 8;
+                    if (value / 16 == 0)
+                        Serial.print(0);
+                    Serial.print(value, HEX);
                 }
+                Serial.print((i - first) % 16 == 15 || i == n_keys - 1 ? '\n' : ' ');
+            }
 
-                Serial.print(' ');
-                Serial.print(EEPROM.readByte(cur_key_start + KEY_TYPE_OFFSET));
-                Serial.print(' ');
+            Serial.print(F("OK "));
+            Serial.print(n_keys);
+            Serial.print(' ');
+            Serial.println(digest, HEX);
+        #if SNIFFER
+        } else if (buffer[0] == 'S') {
+            // The binary trace follows the OK and ends with SNIFF_END, any byte sent stops it
+            Serial.println(F("OK"));
+            sniff_onewire();
+            redraw();
+        #endif
+        } else if (buffer[0] == 'Q') {
+            // "Q index": key emulated at power-on with the middle button held, "Q index 1" on every power-on, "Q -1" none
+            char *cur_pointer = buffer + 2;
+            int index = strtol(cur_pointer, &cur_pointer, 10);
+            bool always = strtol(cur_pointer, NULL, 10) == 1;
+
+            if (buffer[1] != ' ' || index < -1 || index >= min(EEPROM.readInt(KEY_COUNT_OFFSET), QUICK_KEY_INDEX_MASK)) {
+                Serial.println(F("ERR index"));
+            } else if (!battery_allows_writes() || !set_quick_key(index, always)) {
+                Serial.println(F("ERR not written"));
+            } else {
+                Serial.println(F("OK"));
+            }
+        } else if (buffer[0] == 'E') {
+            // The event ring from the oldest event on in hex, decoded on the PC
+            event_log_flush();
+            byte n_bytes = event_head == EVENT_LOG_CLOSED ? 0 : EVENT_LOG_SIZE - event_free;
+
+            for (byte i = 0; i < n_bytes; i++) {
+                byte value = EEPROM.readByte(EVENT_RING_OFFSET + (event_tail + i) % EVENT_LOG_SIZE);
+                if (value < 16)
+                    Serial.print(0);
+                Serial.print(value, HEX);
 
-                for (byte j = 0; j < 8; j++) {
-                    if (EEPROM.readByte(cur_key_start + KEY_OFFSET + j) / 16 == 0)
-                        Serial.print(0);
-                    
-                    Serial.print(EEPROM.readByte(cur_key_start + KEY_OFFSET + j), HEX);
-                    Serial.print(' ');
-                }
+                if (i % 32 == 31)
+                    Serial.println();
+            }
 
+            if (n_bytes % 32)
                 Serial.println();
+
+            Serial.print(F("OK "));
+            Serial.println(n_bytes);
+        } else if (buffer[0] == 'T') {
+            for (byte i = 0; i <= POLL_GAP_BUCKETS; i++) {
+                Serial.print(i < POLL_GAP_BUCKETS ? F("gap < ") : F("gap >= "));
+                Serial.print((unsigned long)POLL_GAP_FIRST_US << min(i, POLL_GAP_BUCKETS - 1));
+                Serial.print(F(" us: "));
+                Serial.println(poll_gaps[i]);
             }
+
+            Serial.print(F("max gap "));
+            Serial.print(poll_gap_max);
+            Serial.println(poll_gap_max < POLL_GAP_LIMIT_US ? F(" us, pass") : F(" us, fail"));
+            Serial.println(F("OK"));
+        } else {
+            Serial.println(F("ERR command"));
         }
 
         new_data = false;
     }
 }
 
-#pragma region BUTTONS
+// "index name type payload", payload bytes in hex
+void print_key_line(int index) {
+    int offset = get_key_offset(index);
 
-void check_buttons () {
-    for (byte i = 0; i < 3; i++) {
-        buttons[i].pressed = !digitalRead(buttons[i].pin);
-    }
-    
-    delay(25);
+    Serial.print(index);
+    Serial.print(' ');
 
-    for (byte i = 0; i < 3; i++) {
-        if (buttons[i].pressed && !digitalRead(buttons[i].pin)) {
-            if (!buttons[i].executed) {
-                buttons[i].executed = true;
-                buttons[i].func();
-            }
-        } else {
-            buttons[i].pressed = false;
-            buttons[i].executed = false;
-        }
+    read_key_name(offset, buffer);
+    Serial.print(buffer);
+
+    Serial.print(' ');
+    Serial.print(key_table_read(offset + KEY_TYPE_OFFSET));
+    Serial.print(' ');
+
+    byte payload_len = record_payload_len(offset);
+    for (byte j = 0; j < payload_len; j++) {
+        if (key_table_read(offset + KEY_OFFSET + j) / 16 == 0)
+            Serial.print(0);
+
+        Serial.print(key_table_read(offset + KEY_OFFSET + j), HEX);
+        Serial.print(' ');
     }
+
+    Serial.println();
 }
 
-bool check_button(int index) {
-    buttons[index].pressed = !digitalRead(buttons[index].pin);
+#pragma region DISPLAY_FLUSH
 
-    delay(25);
+/*
+ * display.display() holds the CPU for the whole frame, as Wire waits
+ * for the end of every transmission. Wire already moves the bytes
+ * from its own TWI interrupt, so here the frame is handed over in
+ * DISPLAY_CHUNK byte pieces without waiting: display_flush_step
+ * queues the next piece once the previous one is out and returns
+ * right away otherwise. It gets called from loop and from flush_delay,
+ * which takes the place of delay() wherever the UI waits, so the
+ * pixels go out while keys get emulated, buttons and serial get
+ * handled.
+ *
+ * twi_writeTo spins until Wire is idle, and Wire keeps that to
+ * itself, so display_twi_busy asks the TWI hardware which its
+ * interrupt drives: a start or a stop still pending, or a status
+ * other than TW_NO_INFO, which only comes back once the stop is out.
+ * The address window of a frame goes out the same way, as one
+ * transfer of commands, and so do the commands sent while the UI
+ * runs, rather than through the blocking ssd1306_command. A command
+ * between two chunks leaves the address pointer where it was.
+ */
 
-    if (buttons[index].pressed && !digitalRead(buttons[index].pin)) {
-        if (!buttons[index].executed) {
-            return true;
-        }
-    } else {
-        buttons[index].pressed = false;
-        buttons[index].executed = false;
-    }
+void display_flush() {
+    draw_battery_glyph();
 
-    return false;
+    if (display_flush_pos == -1)
+        display_flush_pos = 0;
+    else
+        display_dirty = true;   // the frame being sent is stale, send it once more
 }
 
-void top_button () {
-    reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_TOP_BUTTON_OFFSET]))(cur_screen);
+bool display_twi_busy() {
+    return (TWCR & (_BV(TWSTA) | _BV(TWSTO))) || TW_STATUS != TW_NO_INFO;
 }
 
-void middle_button () {
-    reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_MIDDLE_BUTTON_OFFSET]))(cur_screen);
+// Waits for a chunk still going out at most
+void display_twi_send(uint8_t *data, byte len) {
+    while (display_twi_busy());
+    twi_writeTo(DISPLAY_ADDRESS, data, len, false, true);
 }
 
-void bottom_button () {
-    #if DEBUG
-    Serial.println(F("bottom_button"));
-    #endif
+void display_flush_step() {
+    if (display_flush_pos == -1 || display_twi_busy())
+        return;
 
-    reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_BOTTOM_BUTTON_OFFSET]))(cur_screen);
+    if (display_flush_pos == DISPLAY_BUFFER_SIZE) {
+        if (!display_dirty) {
+            display_flush_pos = -1;
+            return;
+        }
+
+        display_dirty = false;
+        display_flush_pos = 0;
+    }
+
+    if (display_flush_pos == 0 && !display_window_set) {
+        // Fewer frames on a low battery, the last one still gets out as display_dirty stays set
+        if (power_level != POWER_NORMAL && millis() - display_frame_ms < FRAME_LOW_MS)
+            return;
+
+        display_frame_ms = millis();
+
+        // Co = 0, D/C = 0: the rest are commands
+        uint8_t window[] = {0x00, SSD1306_PAGEADDR, 0, 0xFF, SSD1306_COLUMNADDR, 0, SCREEN_WIDTH - 1};
+        display_twi_send(window, sizeof(window));
+        display_window_set = true;
+        return;
+    }
+
+    uint8_t chunk[DISPLAY_CHUNK + 1];
+    chunk[0] = 0x40;    // Co = 0, D/C = 1: the rest is data
+    memcpy(chunk + 1, display.getBuffer() + display_flush_pos, DISPLAY_CHUNK);
+
+    display_twi_send(chunk, DISPLAY_CHUNK + 1);
+    display_flush_pos += DISPLAY_CHUNK;
+
+    if (display_flush_pos == DISPLAY_BUFFER_SIZE)
+        display_window_set = false;
 }
 
-#pragma endregion
+bool display_flushed() {
+    display_flush_step();
 
-void switch_screen(int offset) {
-    prev_screen = cur_screen;
-    cur_screen = offset;
-    cur_child = 0;
+    return display_flush_pos == -1 && !display_twi_busy();
 }
 
-void redraw() {
-    reinterpret_cast<decltype(draw)*>(pgm_read_word(&screens[cur_screen + SCREEN_DRAW_FUNC_OFFSET]))(cur_screen);
+void flush_delay(unsigned long ms) {
+    unsigned long start = millis();
+
+    do {
+        display_flush_step();
+    } while (millis() - start < ms);
 }
 
-#pragma region LIST_SCREEN
+#pragma endregion
 
-void list_screen_top_button_pressed(int offset) {
+#pragma region POWER
+
+/*
+ * After IDLE_SLEEP_MS with nothing to do the display gets switched off
+ * and the MCU goes to power-down, where all clocks stop and only the
+ * pin change logic stays awake. A button, the RX line or a reader
+ * pulling KEY_PIN low wakes it up. The display keeps its RAM, so
+ * switching it back on brings the current screen back as it was.
+ * The byte which wakes the UART up is lost, so a host should send
+ * something before the '[' of a command.
+ */
+void sleep_until_woken() {
     #if DEBUG
-    Serial.println(F("list_screen_top_button_pressed"));
+    Serial.println(F("Sleeping"));
     #endif
 
-    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
-    cur_child = (cur_child + n_children - 1) % n_children;
+    Serial.flush();
 
-    redraw();
-}
+    // The frame goes out whole first, and nothing may be on the bus when the TWI clock stops
+    while (!display_flushed());
+    uint8_t off[] = {0x00, SSD1306_DISPLAYOFF};
+    display_twi_send(off, sizeof(off));
+    while (display_twi_busy());
 
-void list_screen_middle_button_pressed(int offset) {
-    #if DEBUG
-    Serial.println(F("list_screen_middle_button_pressed"));
-    #endif
+    byte adcsra = ADCSRA;
+    ADCSRA = 0;
+    ACSR = _BV(ACD);
 
-    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
-    int arr_start = offset + LIST_SCREEN_STRINGS_OFFSET + n_children;
-    int new_offset = (int)pgm_read_word_near(&screens[arr_start + cur_child]);
+    PCMSK1 = _BV(PCINT11);                                                  // KEY_PIN
+    PCMSK2 = _BV(PCINT16) | _BV(PCINT18) | _BV(PCINT19) | _BV(PCINT20);     // RX and buttons
+    PCIFR = _BV(PCIF1) | _BV(PCIF2);
+    PCICR = _BV(PCIE1) | _BV(PCIE2);
 
-    switch_screen(new_offset);
-    redraw();
-}
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    cli();
+    sleep_enable();
+    sleep_bod_disable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
 
-void read_screen_menu_middle_button_pressed(int offset) {
-    #if DEBUG
-    Serial.println(F("read_screen_menu_middle_button_pressed"));
-    #endif
-    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
-    int arr_start = offset + LIST_SCREEN_STRINGS_OFFSET + n_children;
-    int new_offset = (int)pgm_read_word_near(&screens[arr_start + cur_child]);
+    PCICR = 0;
+    ADCSRA = adcsra;
+
+    uint8_t on[] = {0x00, SSD1306_DISPLAYON};
+    display_twi_send(on, sizeof(on));
+
+    // The press which woke us up shouldn't do anything else
+    for (byte i = 0; i < 3; i++) {
+        if (!digitalRead(buttons[i].pin)) {
+            buttons[i].pressed = true;
+            buttons[i].executed = true;
+            buttons[i].since = millis();
+        }
+    }
+
+    last_activity = millis();
 
     #if DEBUG
-    Serial.print(F("Current child "));
-    Serial.println(cur_child);
+    Serial.println(F("Woken up"));
     #endif
+}
 
-    if (cur_child == 0)
-        save_key();
-        
-    switch_screen(new_offset);
-    prev_screen = MAIN_MENU;
-    redraw();
+ISR(PCINT1_vect) {}
+ISR(PCINT2_vect) {}
 
-    if (new_offset == EMULATE_SCREEN) {
-        reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[new_offset + SCREEN_MIDDLE_BUTTON_OFFSET]))(new_offset);
-    } else if (new_offset == COPY_SCREEN) {
-        reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[new_offset + SCREEN_MIDDLE_BUTTON_OFFSET]))(new_offset);
-    }
+#pragma endregion
+
+#pragma region BATTERY
+
+/*
+ * The cell feeds the regulator, so VCC stays at BATTERY_FULL_MV until
+ * the cell drops close to it and follows the cell from there on. VCC
+ * gets measured against the 1.1 V bandgap: with AVcc as the reference
+ * the ADC reads 1.1 V * 1024 / VCC. Every BATTERY_CHECK_MS a sample goes
+ * into a first order IIR filter kept in fixed point, and the power
+ * level picked from it drives the contrast, the frame rate and the
+ * read poll interval. EEPROM and blank writes don't trust the filter,
+ * they take a fresh sample right before writing.
+ */
+unsigned int read_vcc() {
+    byte admux = ADMUX;
+    byte adcsra = ADCSRA;
+
+    ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1);   // 125 kHz ADC clock
+    ADMUX = _BV(REFS0) | 0x0E;                      // AVcc reference, bandgap input
+    delay(BANDGAP_SETTLE_MS);
+
+    ADCSRA |= _BV(ADSC);
+    while (ADCSRA & _BV(ADSC));
+    unsigned int adc = ADC;
+
+    ADMUX = admux;
+    ADCSRA = adcsra;
+
+    return adc ? BANDGAP_MV_X1024 / adc : 0;
 }
 
-void list_screen_bottom_button_pressed(int offset) {
+void check_battery() {
+    unsigned int sample = read_vcc();
+    last_battery_check = millis();
+
+    if (battery_mv_x8 == 0)
+        battery_mv_x8 = sample << BATTERY_FILTER_SHIFT;
+    else
+        battery_mv_x8 += sample - (battery_mv_x8 >> BATTERY_FILTER_SHIFT);
+
+    unsigned int mv = battery_mv_x8 >> BATTERY_FILTER_SHIFT;
+    byte level = mv < BATTERY_CRITICAL_MV ? POWER_CRITICAL : (mv < BATTERY_LOW_MV ? POWER_LOW : POWER_NORMAL);
+
+    if (level == power_level)
+        return;
+
     #if DEBUG
-    Serial.println(F("list_screen_bottom_button_pressed"));
+    Serial.print(F("Battery "));
+    Serial.print(mv);
+    Serial.println(F(" mV"));
     #endif
 
-    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
-    cur_child = (cur_child + 1) % n_children;
+    uint8_t contrast[] = {0x00, SSD1306_SETCONTRAST, (uint8_t)(level == POWER_NORMAL ? CONTRAST_NORMAL : CONTRAST_LOW)};
+    display_twi_send(contrast, sizeof(contrast));
 
-    redraw();
+    power_level = level;
+    log_event(EVENT_POWER, level);
+    draw_battery_glyph();
+    display_flush();
 }
 
-void list_screen_draw(int offset) {
+bool battery_allows_writes() {
+    if (read_vcc() >= BATTERY_CRITICAL_MV)
+        return true;
+
+    #if DEBUG
+    Serial.println(F("Battery too low to write"));
+    #endif
+
+    return false;
+}
+
+// 3 bars between BATTERY_CRITICAL_MV and BATTERY_FULL_MV in the top right corner
+void draw_battery_glyph() {
+    int mv = battery_mv_x8 >> BATTERY_FILTER_SHIFT;
+    int bars = constrain((long)(mv - BATTERY_CRITICAL_MV) * 4 / (BATTERY_FULL_MV - BATTERY_CRITICAL_MV), 0, 3);
+    int x = SCREEN_WIDTH - 13;
+
+    display.fillRect(x, 0, 13, 7, BLACK);
+    display.drawRect(x, 0, 11, 7, WHITE);
+    display.fillRect(x + 11, 2, 2, 3, WHITE);
+
+    for (byte i = 0; i < bars; i++)
+        display.fillRect(x + 2 + i * 3, 2, 2, 3, WHITE);
+}
+
+#pragma endregion
+
+#pragma region EVENT_LOG
+
+/*
+ * Logging only encodes the event into event_queue, event_log_step
+ * moves it to EEPROM a byte at a time from the main loop, starting
+ * a write only when the previous one is done, so nothing waits for
+ * EEPROM. Events which don't fit in the queue get dropped.
+ */
+void log_event(byte type, unsigned long arg) {
+    uint8_t event[EVENT_MAX_LEN];
+    unsigned long seconds = (millis() - event_last_ms) / 1000;
+
+    event[0] = type;
+    byte len = event_put_varint(event, 1, seconds);
+    len = event_put_varint(event, len, arg);
+
+    if (event_queue_len + len > EVENT_QUEUE_SIZE)
+        return;
+
+    memcpy(event_queue + event_queue_len, event, len);
+    event_queue_len += len;
+    event_last_ms += seconds * 1000;
+}
+
+byte event_put_varint(uint8_t *event, byte pos, unsigned long value) {
+    while (value >= 127) {
+        event[pos++] = 0x80 | (value % 127);
+        value /= 127;
+    }
+
+    event[pos++] = value;
+    return pos;
+}
+
+void event_log_step() {
+    if (event_queue_pos == event_queue_len || !EEPROM.isReady())
+        return;
+
+    // Not worth a fresh battery sample a byte, a torn event only spoils itself
+    if (power_level == POWER_CRITICAL)
+        return;
+
+    if (event_head == EVENT_LOG_CLOSED)
+        event_log_open();
+
+    if (!event_write_left) {
+        byte len = 1, varints = 0;
+        while (varints < 2)
+            if (!(event_queue[event_queue_pos + len++] & 0x80))
+                varints++;
+
+        // The free run may not disappear, it marks the end, and an old event goes as a whole
+        if (event_free <= len || event_erase_left) {
+            if (!event_erase_left)
+                event_erase_left = event_length_at(event_tail);
+
+            EEPROM.writeByte(EVENT_RING_OFFSET + event_tail, 0xFF);
+            event_tail = (event_tail + 1) % EVENT_LOG_SIZE;
+            event_free++;
+            event_erase_left--;
+            return;
+        }
+
+        event_write_left = len;
+    }
+
+    EEPROM.writeByte(EVENT_RING_OFFSET + event_head, event_queue[event_queue_pos++]);
+    event_head = (event_head + 1) % EVENT_LOG_SIZE;
+    event_free--;
+    event_write_left--;
+
+    if (event_queue_pos == event_queue_len)
+        event_queue_pos = event_queue_len = 0;
+}
+
+// Finds the free run, a new ring gets erased first
+void event_log_open() {
+    if (EEPROM.readByte(EVENT_LOG_OFFSET) != EVENT_LOG_MAGIC) {
+        for (byte i = 0; i < EVENT_LOG_SIZE; i++)
+            EEPROM.updateByte(EVENT_RING_OFFSET + i, 0xFF);
+
+        EEPROM.updateByte(EVENT_LOG_OFFSET, EVENT_LOG_MAGIC);
+    }
+
+    event_head = 0;
+    event_free = 0;
+
+    for (byte i = 0; i < EVENT_LOG_SIZE; i++) {
+        if (EEPROM.readByte(EVENT_RING_OFFSET + i) != 0xFF)
+            continue;
+
+        event_free++;
+        if (EEPROM.readByte(EVENT_RING_OFFSET + (i + EVENT_LOG_SIZE - 1) % EVENT_LOG_SIZE) != 0xFF)
+            event_head = i;
+    }
+
+    // No free run at all only comes from a torn erase, erasing goes on from the head
+    event_tail = (event_head + event_free) % EVENT_LOG_SIZE;
+    event_erase_left = 0;
+    event_write_left = 0;
+}
+
+byte event_length_at(int pos) {
+    byte len = 1, varints = 0;
+
+    // Bounded, the event may be a leftover of a torn write
+    while (varints < 2 && len < EVENT_MAX_LEN)
+        if (!(EEPROM.readByte(EVENT_RING_OFFSET + (pos + len++) % EVENT_LOG_SIZE) & 0x80))
+            varints++;
+
+    return len;
+}
+
+// For the E serial command, which can wait
+void event_log_flush() {
+    while (event_queue_len && power_level != POWER_CRITICAL)
+        event_log_step();
+}
+
+#pragma endregion
+
+#pragma region BUTTONS
+
+/*
+ * Buttons get debounced without waiting: a press is noticed on the
+ * first poll and reported once it has held for DEBOUNCE_MS, so the
+ * loops polling them don't stall the key reader or emulator.
+ *
+ * Top and bottom repeat while held on list screens, REPEAT_DELAY_MS
+ * after the press and every REPEAT_MS from then on. nav_step tells the
+ * handler how far to move: the longer the hold, the bigger the step.
+ * A button held through a screen change has to be let go first.
+ */
+void check_buttons () {
+    for (byte i = 0; i < 3; i++) {
+        if (check_button(i)) {
+            buttons[i].executed = true;
+            buttons[i].repeats = 0;
+            buttons[i].since = millis();
+            nav_step = NAV_ROW;
+        } else if (i == MIDDLE_BUTTON_INDEX || !screen_repeats() || !check_repeat(i)) {
+            continue;
+        }
+
+        last_activity = millis();
+        buttons[i].func();
+    }
+}
+
+bool check_button(int index) {
+    Button *button = &buttons[index];
+
+    if (digitalRead(button->pin)) {
+        button->pressed = false;
+        button->executed = false;
+        button->held_over = false;
+
+        return false;
+    }
+
+    if (!button->pressed) {
+        button->pressed = true;
+        button->since = millis();
+
+        return false;
+    }
+
+    return !button->executed && (unsigned int)millis() - button->since >= DEBOUNCE_MS;
+}
+
+bool check_repeat(int index) {
+    Button *button = &buttons[index];
+
+    if (!button->pressed || !button->executed || button->held_over)
+        return false;
+
+    if ((unsigned int)millis() - button->since < (button->repeats ? REPEAT_MS : REPEAT_DELAY_MS))
+        return false;
+
+    button->since = millis();
+    if (button->repeats < 255)
+        button->repeats++;
+
+    if (button->repeats > REPEAT_LETTER_AFTER)
+        nav_step = NAV_LETTER;
+    else if (button->repeats > REPEAT_PAGE_AFTER)
+        nav_step = NAV_PAGE;
+    else
+        nav_step = NAV_ROW;
+
+    return true;
+}
+
+// Only lists move their cursor on top and bottom, elsewhere those go back or confirm
+bool screen_repeats() {
+    void (*draw_func)(int) = reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_DRAW_FUNC_OFFSET]));
+
+    return draw_func == list_screen_draw || draw_func == key_list_draw ||
+           draw_func == search_list_draw || draw_func == find_draw;
+}
+
+void top_button () {
+    reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_TOP_BUTTON_OFFSET]))(cur_screen);
+}
+
+void middle_button () {
+    reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_MIDDLE_BUTTON_OFFSET]))(cur_screen);
+}
+
+void bottom_button () {
+    #if DEBUG
+    Serial.println(F("bottom_button"));
+    #endif
+
+    reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[cur_screen + SCREEN_BOTTOM_BUTTON_OFFSET]))(cur_screen);
+}
+
+#pragma endregion
+
+void switch_screen(int offset) {
+    prev_screen = cur_screen;
+    cur_screen = offset;
+    cur_child = 0;
+    name_cache_page = -1;
+
+    for (byte i = 0; i < 3; i++) {
+        buttons[i].repeats = 0;
+        buttons[i].held_over = buttons[i].pressed;
+    }
+}
+
+void redraw() {
+    redraw_pending = false;
+    reinterpret_cast<decltype(draw)*>(pgm_read_word(&screens[cur_screen + SCREEN_DRAW_FUNC_OFFSET]))(cur_screen);
+}
+
+void request_redraw() {
+    redraw_pending = true;
+}
+
+#pragma region LIST_SCREEN
+
+void list_screen_top_button_pressed(int offset) {
+    #if DEBUG
+    Serial.println(F("list_screen_top_button_pressed"));
+    #endif
+
+    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
+    cur_child = (cur_child + n_children - 1) % n_children;
+
+    redraw();
+}
+
+void list_screen_middle_button_pressed(int offset) {
+    #if DEBUG
+    Serial.println(F("list_screen_middle_button_pressed"));
+    #endif
+
+    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
+    int arr_start = offset + LIST_SCREEN_STRINGS_OFFSET + n_children;
+    int new_offset = (int)pgm_read_word_near(&screens[arr_start + cur_child]);
+
+    switch_screen(new_offset);
+    redraw();
+}
+
+void read_screen_menu_middle_button_pressed(int offset) {
+    #if DEBUG
+    Serial.println(F("read_screen_menu_middle_button_pressed"));
+    #endif
+    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
+    int arr_start = offset + LIST_SCREEN_STRINGS_OFFSET + n_children;
+    int new_offset = (int)pgm_read_word_near(&screens[arr_start + cur_child]);
+
+    #if DEBUG
+    Serial.print(F("Current child "));
+    Serial.println(cur_child);
+    #endif
+
+    if (cur_child == 0) {
+        duplicate_index = find_key(global_key);
+
+        if (duplicate_index != -1) {
+            switch_screen(DUPLICATE_MENU);
+            redraw();
+            return;
+        }
+
+        save_key();
+    }
+        
+    switch_screen(new_offset);
+    prev_screen = MAIN_MENU;
+    redraw();
+
+    if (new_offset == EMULATE_SCREEN) {
+        reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[new_offset + SCREEN_MIDDLE_BUTTON_OFFSET]))(new_offset);
+    } else if (new_offset == COPY_SCREEN) {
+        reinterpret_cast<decltype(draw)*>(pgm_read_word_near(&screens[new_offset + SCREEN_MIDDLE_BUTTON_OFFSET]))(new_offset);
+    }
+}
+
+void duplicate_menu_middle_button_pressed(int offset) {
+    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
+    int arr_start = offset + LIST_SCREEN_STRINGS_OFFSET + n_children;
+    int new_offset = (int)pgm_read_word_near(&screens[arr_start + cur_child]);
+
+    // The stored key reads the same as the new one, so it gets opened instead
+    if (cur_child == 0) {
+        global_key = get_key_by_index(duplicate_index);
+    } else if (cur_child == 1) {
+        save_key();
+    }
+
+    switch_screen(new_offset);
+    if (new_offset == READ_SUCCESSFUL_MENU)
+        prev_screen = MAIN_MENU;
+    redraw();
+}
+
+void list_screen_bottom_button_pressed(int offset) {
+    #if DEBUG
+    Serial.println(F("list_screen_bottom_button_pressed"));
+    #endif
+
+    byte n_children = (int)pgm_read_word_near(&screens[offset + LIST_SCREEN_N_OFFSET]);
+    cur_child = (cur_child + 1) % n_children;
+
+    redraw();
+}
+
+void list_screen_draw(int offset) {
     byte width  = SCREEN_WIDTH - OFFSET_X * 2,
          height = (SCREEN_HEIGHT - OFFSET_Y * 2) / NUM_ROWS,
          text_y_offset = (height - FONT_HEIGHT) / 2 + 1;
@@ -610,18 +2075,11 @@ void list_screen_draw(int offset) {
         }
     }
 
-    display.display();
+    display_flush();
 }
 
 void key_list_top_button_pressed(int offset) {
-    byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
-    byte n_keys = EEPROM.readInt(0);
-    cur_child = (cur_child + n_children + n_keys - 1) % (n_children + n_keys);
-
-    if ((int)pgm_read_word_near(&screens[offset + KEY_LIST_STRINGS_OFFSET + n_children + cur_child]) == NULL_SCREEN)
-        cur_child = (cur_child + n_children + n_keys - 1) % (n_children + n_keys);
-    
-    redraw();
+    key_list_move(offset, -1);
 }
 
 void key_list_middle_button_pressed(int offset) {
@@ -633,6 +2091,12 @@ void key_list_middle_button_pressed(int offset) {
 
         if (new_offset != NULL_SCREEN) {
             switch_screen(new_offset);
+
+            if (new_offset == SEARCH_MENU)
+                search_keys();
+            else if (new_offset == FIND_SCREEN)
+                find_begin();
+
             redraw();
         }    
     } else {
@@ -658,14 +2122,68 @@ void key_menu_middle_button_pressed(int offset) {
 }
 
 void key_list_bottom_button_pressed(int offset) {
+    key_list_move(offset, 1);
+}
+
+/*
+ * Moves the cursor by nav_step: a row, a page of NUM_ROWS or to the
+ * next initial letter. Drawing is left to loop, so a held button
+ * doesn't wait for EEPROM reads and frames it will move past anyway.
+ */
+void key_list_move(int offset, int dir) {
     byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
-    byte n_keys = EEPROM.readInt(0);
-    cur_child = (cur_child + 1) % (n_children + n_keys);
+    byte n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
+    int total = n_children + n_keys;
 
-    if ((int)pgm_read_word_near(&screens[offset + KEY_LIST_STRINGS_OFFSET + n_children + cur_child]) == NULL_SCREEN)
-        cur_child = (cur_child + 1) % (n_children + n_keys);
+    if (nav_step == NAV_LETTER && n_keys) {
+        int index = cur_child - n_children;
+        if (index < 0)
+            index = dir > 0 ? -1 : n_keys;
 
-    redraw();
+        cur_child = n_children + key_list_letter_jump(index, dir);
+    } else {
+        int step = nav_step == NAV_PAGE ? NUM_ROWS : 1;
+        cur_child = ((cur_child + dir * step) % total + total) % total;
+
+        if (cur_child < n_children &&
+                (int)pgm_read_word_near(&screens[offset + KEY_LIST_STRINGS_OFFSET + n_children + cur_child]) == NULL_SCREEN)
+            cur_child = (cur_child + dir + total) % total;
+    }
+
+    request_redraw();
+}
+
+/*
+ * Index of the first key, by name, whose name starts with the closest
+ * initial after (dir > 0) or before the one of key index, wrapping
+ * around. index may be -1 or n_keys to start from either end. Takes a
+ * binary search or two in name_order, so keys past MAX_FINGERPRINTS
+ * are only reached by rows and pages.
+ */
+int key_list_letter_jump(int index, int dir) {
+    if (name_order_stale)
+        build_name_order();
+
+    if (!name_order_len)
+        return max(index, 0);
+
+    char initial[2] = {0, 0};
+    byte pos = dir > 0 ? 0 : name_order_len;
+
+    if (index >= 0 && index < EEPROM.readInt(KEY_COUNT_OFFSET)) {
+        read_key_name(get_key_offset(index), buffer);
+        initial[0] = buffer[0];
+        pos = name_order_bound(initial, 1, 0, name_order_len, dir > 0);
+    }
+
+    // Past the current initial comes the first name with the next one
+    if (dir > 0)
+        return name_order[pos < name_order_len ? pos : 0];
+
+    read_key_name(get_key_offset(name_order[(pos ? pos : name_order_len) - 1]), buffer);
+    initial[0] = buffer[0];
+
+    return name_order[name_order_bound(initial, 1, 0, name_order_len, false)];
 }
 
 void key_list_draw(int offset) {
@@ -676,7 +2194,7 @@ void key_list_draw(int offset) {
          text_y_offset = (height - FONT_HEIGHT) / 2 + 1;
     
     byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
-    byte n_keys = EEPROM.readInt(0);
+    byte n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
     byte start = 0, i = 0;
     
     for (start = (cur_child / NUM_ROWS) * NUM_ROWS, i = 0;
@@ -694,45 +2212,310 @@ void key_list_draw(int offset) {
         }
     }
 
-    for (byte j = 0; (start < n_keys + n_children) && (i < NUM_ROWS); start++, i++, j++) {
-        int key_start = get_key_offset(start - n_children);
+    name_cache_page = max((cur_child / NUM_ROWS) * NUM_ROWS - n_children, 0);
 
-        byte k = 0;
-        for (;k < KEY_NAME_LEN && EEPROM.readByte(key_start + KEY_NAME_OFFSET + k) != '\0'; k++)
-            buffer[k] = EEPROM.readByte(key_start + KEY_NAME_OFFSET + k);
-        
-        if (k < BUFFER_LEN)
-            buffer[k] = '\0';
-        
+    for (; (start < n_keys + n_children) && (i < NUM_ROWS); start++, i++) {
         display.fillRect(OFFSET_X, OFFSET_Y + height * i, 
                             width, height, start == cur_child);
         display.setCursor(OFFSET_X + 1, OFFSET_Y + height * i + text_y_offset);
         display.setTextColor(start != cur_child);
-        display.println(buffer);
+        display.println(cached_key_name(start - n_children));
     }
 
-    display.display();
+    display_flush();
 }
 
-#pragma endregion
+/*
+ * Decoding a name takes a walk to its record and up to KEY_NAME_LEN
+ * EEPROM reads, so the key list keeps the names of the page on screen
+ * and of half a page around it. Moving inside the window only reads
+ * rows it hasn't seen, and loop fills the rest of the
+ * window in the background one row at a time. Anything changing key
+ * indices drops the rows from the first changed index on.
+ */
+const char *cached_key_name(byte index) {
+    byte slot = index % NAME_CACHE_ROWS;
+
+    if (scratch.name_cache_tags[slot] != index) {
+        read_key_name(get_key_offset(index), buffer);
+        strncpy(scratch.name_cache[slot], buffer, NAME_CACHE_LEN);
+        scratch.name_cache[slot][NAME_CACHE_LEN] = '\0';
+        scratch.name_cache_tags[slot] = index;
+    }
 
+    return scratch.name_cache[slot];
+}
 
-#pragma region DISPLAY_SCREEN
+// Returns false when the whole window is cached
+bool name_cache_prefetch_step() {
+    if (name_cache_page == -1)
+        return false;
 
-void display_screen_top_button_pressed(int offset) {
-    #if DEBUG
-    Serial.println(F("display_screen_top_button_pressed"));
-    #endif
+    int n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
+    int last = min(name_cache_page + NUM_ROWS + NUM_ROWS / 2, n_keys);
 
-    byte n_options = (int) pgm_read_word_near(&screens[offset + DISPLAY_SCREEN_N_OFFSET]);
+    for (int index = max(name_cache_page - NUM_ROWS / 2, 0); index < last; index++) {
+        if (scratch.name_cache_tags[index % NAME_CACHE_ROWS] != index) {
+            cached_key_name(index);
+            return true;
+        }
+    }
 
-    if (n_options)
-        cur_child = (cur_child + 1) % n_options;
+    return false;
+}
+
+void name_cache_invalidate(byte from) {
+    for (byte i = 0; i < NAME_CACHE_ROWS; i++) {
+        if (scratch.name_cache_tags[i] >= from)
+            scratch.name_cache_tags[i] = NAME_CACHE_EMPTY;
+    }
+}
+
+/*
+ * Search results use the key list layout, with the devices found by
+ * search_keys listed after the fixed children.
+ */
+void search_list_top_button_pressed(int offset) {
+    byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
+    cur_child = (cur_child + n_children + n_found_keys - 1) % (n_children + n_found_keys);
 
     redraw();
 }
 
-void read_screen_middle_button_pressed(int offset) {
+void search_list_middle_button_pressed(int offset) {
+    byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
+    int new_offset;
+
+    if (cur_child < n_children) {
+        new_offset = (int)pgm_read_word_near(&screens[offset + KEY_LIST_STRINGS_OFFSET + n_children + cur_child]);
+
+        if (cur_child == 1)
+            save_found_keys();
+    } else {
+        global_key.cur_key = found_keys[cur_child - n_children];
+        global_key.key_index = -1;
+        global_key.key_type = 0;
+
+        new_offset = (int)pgm_read_word_near(&screens[offset + KEY_LIST_MAIN_OFFSET]);
+    }
+
+    switch_screen(new_offset);
+
+    if (new_offset == SEARCH_MENU)
+        search_keys();
+
+    redraw();
+}
+
+void search_list_bottom_button_pressed(int offset) {
+    byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
+    cur_child = (cur_child + 1) % (n_children + n_found_keys);
+
+    redraw();
+}
+
+void search_list_draw(int offset) {
+    display.clearDisplay();
+
+    byte width  = SCREEN_WIDTH - OFFSET_X * 2,
+         height = (SCREEN_HEIGHT - OFFSET_Y * 2) / NUM_ROWS,
+         text_y_offset = (height - FONT_HEIGHT) / 2 + 1;
+
+    byte n_children = (int)pgm_read_word_near(&screens[offset + KEY_LIST_N_OFFSET]);
+
+    for (byte start = (cur_child / NUM_ROWS) * NUM_ROWS, i = 0;
+            (i < NUM_ROWS) && (start < n_children + n_found_keys); i++, start++) {
+        display.fillRect(OFFSET_X, OFFSET_Y + height * i,
+                            width, height, start == cur_child);
+        display.setCursor(OFFSET_X + 1, OFFSET_Y + height * i + text_y_offset);
+        display.setTextColor(start != cur_child);
+
+        if (start < n_children) {
+            strcpy_P(buffer, (char *)pgm_read_word_near(&screens[offset + KEY_LIST_STRINGS_OFFSET + start]));
+            display.println(buffer);
+            continue;
+        }
+
+        for (byte j = 0; j < 8; j++) {
+            if (((uint8_t *)&found_keys[start - n_children])[j] / 16 == 0)
+                display.print(0);
+            display.print(((uint8_t *)&found_keys[start - n_children])[j], HEX);
+        }
+    }
+
+    display_flush();
+}
+
+/*
+ * Name search: the first row holds the prefix typed so far and a
+ * candidate for the next character, the rows below list the keys
+ * starting with the prefix. Top and bottom only offer characters some
+ * matching name has at that position, found by binary search in
+ * name_order, plus FIND_BACK to erase a character and FIND_LIST to go
+ * down to the matches. cur_child 0 is the prefix row, 1 and on the
+ * matches.
+ */
+void find_begin() {
+    if (name_order_stale)
+        build_name_order();
+
+    find_len = 0;
+    find_narrow();
+}
+
+// Recomputes the match range for find_prefix and picks the first candidate
+void find_narrow() {
+    find_lo = name_order_bound(find_prefix, find_len, 0, name_order_len, false);
+    find_hi = name_order_bound(find_prefix, find_len, find_lo, name_order_len, true);
+
+    find_candidate = find_len < FIND_PREFIX_LEN ? find_next_char(0) : 0;
+    if (!find_candidate)
+        find_candidate = FIND_LIST;
+}
+
+// Smallest character after c at position find_len among the matches, 0 if none
+char find_next_char(char c) {
+    char next = c + 1;
+    if (next >= 'A' && next <= 'Z')     // never there after tolower
+        next = 'Z' + 1;
+
+    find_prefix[find_len] = next;
+    byte pos = name_order_bound(find_prefix, find_len + 1, find_lo, find_hi, false);
+
+    if (pos == find_hi)
+        return 0;
+
+    char name[KEY_NAME_LEN + 1];
+    read_key_name(get_key_offset(name_order[pos]), name);
+
+    return tolower(name[find_len]);
+}
+
+// Largest character before c at position find_len among the matches, 0 if none
+char find_prev_char(char c) {
+    find_prefix[find_len] = c;
+    byte pos = name_order_bound(find_prefix, find_len + 1, find_lo, find_hi, false);
+
+    if (pos == find_lo)
+        return 0;
+
+    char name[KEY_NAME_LEN + 1];
+    read_key_name(get_key_offset(name_order[pos - 1]), name);
+
+    return tolower(name[find_len]);     // 0 for a name that is just the prefix
+}
+
+void find_top_button_pressed(int offset) {
+    if (cur_child > 0) {
+        cur_child--;
+    } else if (find_candidate == FIND_BACK) {
+        find_candidate = FIND_LIST;
+    } else {
+        char c = find_candidate == FIND_LIST ? 0x7F : find_candidate;
+        c = find_len < FIND_PREFIX_LEN ? find_prev_char(c) : 0;
+        find_candidate = c ? c : FIND_BACK;
+    }
+
+    request_redraw();
+}
+
+void find_bottom_button_pressed(int offset) {
+    if (cur_child > 0) {
+        cur_child = (cur_child + 1) % (find_hi - find_lo + 1);
+    } else if (find_candidate == FIND_LIST) {
+        find_candidate = FIND_BACK;
+    } else {
+        char c = find_candidate == FIND_BACK ? 0 : find_candidate;
+        c = find_len < FIND_PREFIX_LEN ? find_next_char(c) : 0;
+        find_candidate = c ? c : FIND_LIST;
+    }
+
+    request_redraw();
+}
+
+void find_middle_button_pressed(int offset) {
+    if (cur_child > 0) {
+        global_key = get_key_by_index(name_order[find_lo + cur_child - 1]);
+        switch_screen(KEY_MENU);
+    } else if (find_candidate == FIND_BACK) {
+        if (find_len == 0) {
+            switch_screen(MAIN_MENU);
+        } else {
+            char erased = find_prefix[--find_len];
+            find_narrow();
+            find_candidate = erased;
+        }
+    } else if (find_candidate == FIND_LIST) {
+        if (find_hi > find_lo)
+            cur_child = 1;
+    } else {
+        find_prefix[find_len++] = find_candidate;
+        find_narrow();
+
+        if (find_hi - find_lo == 1)
+            cur_child = 1;
+    }
+
+    redraw();
+}
+
+void find_draw(int offset) {
+    display.clearDisplay();
+
+    byte width  = SCREEN_WIDTH - OFFSET_X * 2,
+         height = (SCREEN_HEIGHT - OFFSET_Y * 2) / NUM_ROWS,
+         text_y_offset = (height - FONT_HEIGHT) / 2 + 1;
+    byte n_matches = find_hi - find_lo;
+
+    display.fillRect(OFFSET_X, OFFSET_Y, width, height, cur_child == 0);
+    display.setCursor(OFFSET_X + 1, OFFSET_Y + text_y_offset);
+    display.setTextColor(cur_child != 0);
+
+    strcpy_P(buffer, (char *)pgm_read_word_near(&string_arr[33]));
+    display.print(buffer);
+    for (byte i = 0; i < find_len; i++)
+        display.print((char)toupper(find_prefix[i]));
+
+    int x = display.getCursorX();
+    display.print((char)toupper(find_candidate));
+    display.drawFastHLine(x, OFFSET_Y + text_y_offset + FONT_HEIGHT, FONT_WIDTH - 1, cur_child != 0);
+
+    display.setCursor(OFFSET_X + width - 3 * FONT_WIDTH, OFFSET_Y + text_y_offset);
+    display.print(n_matches);
+
+    byte first = cur_child > 0 ? (cur_child - 1) / FIND_ROWS * FIND_ROWS : 0;
+
+    for (byte i = 0; i < FIND_ROWS && first + i < n_matches; i++) {
+        bool selected = cur_child == first + i + 1;
+
+        display.fillRect(OFFSET_X, OFFSET_Y + height * (i + 1), width, height, selected);
+        display.setCursor(OFFSET_X + 1, OFFSET_Y + height * (i + 1) + text_y_offset);
+        display.setTextColor(!selected);
+        display.println(cached_key_name(name_order[find_lo + first + i]));
+    }
+
+    display_flush();
+}
+
+#pragma endregion
+
+
+#pragma region DISPLAY_SCREEN
+
+void display_screen_top_button_pressed(int offset) {
+    #if DEBUG
+    Serial.println(F("display_screen_top_button_pressed"));
+    #endif
+
+    byte n_options = (int) pgm_read_word_near(&screens[offset + DISPLAY_SCREEN_N_OFFSET]);
+
+    if (n_options)
+        cur_child = (cur_child + 1) % n_options;
+
+    redraw();
+}
+
+void read_screen_middle_button_pressed(int offset) {
     #if DEBUG
     Serial.println(F("read_screen_middle_button_pressed"));
     #endif
@@ -749,7 +2532,7 @@ void read_screen_middle_button_pressed(int offset) {
     display.setTextColor(WHITE);
     display.setCursor((SCREEN_WIDTH - msg_len * FONT_SIZE * FONT_WIDTH) / 2, SCREEN_HEIGHT / 2);
     display.println(buffer);
-    display.display();
+    display_flush();
 
     byte exit_code = 1;
 
@@ -768,8 +2551,10 @@ void read_screen_middle_button_pressed(int offset) {
         }
         
         exit_code = read_key(&global_key.cur_key);
-        delay(25);
+        flush_delay(power_level == POWER_NORMAL ? 0 : READ_POLL_LOW_MS);
     }
+
+    log_event(EVENT_READ, global_key.key_type << 2 | exit_code);
     
     display.fillRect(0, SCREEN_HEIGHT / 2, SCREEN_WIDTH, FONT_HEIGHT * FONT_SIZE, BLACK);
 
@@ -794,8 +2579,8 @@ void read_screen_middle_button_pressed(int offset) {
     msg_len = strlen(buffer);
     display.setCursor((SCREEN_WIDTH - msg_len * FONT_SIZE * FONT_WIDTH) / 2, SCREEN_HEIGHT / 2);
     display.println(buffer);
-    display.display();
-    delay(2000);
+    display_flush();
+    flush_delay(2000);
 
     if (exit_code == 0)
         switch_screen(READ_SUCCESSFUL_MENU);
@@ -806,7 +2591,7 @@ void read_screen_middle_button_pressed(int offset) {
 }
 
 void emulate_screen_middle_button_pressed(int offset) {
-    int n_keys = EEPROM.readInt(0);
+    int n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
 
     display.setTextSize(FONT_SIZE);
     display.setTextColor(WHITE);
@@ -816,7 +2601,7 @@ void emulate_screen_middle_button_pressed(int offset) {
     
     display.setCursor((SCREEN_WIDTH - msg_len * FONT_SIZE * FONT_WIDTH) / 2, SCREEN_HEIGHT / 2 + 2 * FONT_SIZE * FONT_HEIGHT);
     display.println(buffer);
-    display.display();
+    display_flush();
 
     for (;; (global_key.key_index != -1) && (global_key.key_index = (global_key.key_index + 1) % n_keys)) {
         if (global_key.key_index != -1)
@@ -831,8 +2616,9 @@ void emulate_screen_middle_button_pressed(int offset) {
             display.print(((uint8_t *)&global_key.cur_key)[i], HEX);
         }
 
-        display.display();
+        display_flush();
 
+        log_event(EVENT_EMULATE, key_fingerprint(global_key));
         emulate_key(global_key.cur_key);
 
         if (check_button(MIDDLE_BUTTON_INDEX)) {
@@ -865,7 +2651,7 @@ void copy_screen_middle_button_pressed(int offset) {
     
     display.setCursor((SCREEN_WIDTH - msg_len * FONT_SIZE * FONT_WIDTH) / 2, SCREEN_HEIGHT / 2 + 2 * FONT_SIZE * FONT_HEIGHT);
     display.println(buffer);
-    display.display();
+    display_flush();
 
     byte exit_code = 1;
 
@@ -884,16 +2670,20 @@ void copy_screen_middle_button_pressed(int offset) {
                 return;
             }
 
-            delay(25);
+            flush_delay(25);
         }
         
         exit_code = copy_key(global_key.cur_key, &display);
     }
+
+    log_event(EVENT_COPY, exit_code);
     
     display.fillRect(0, SCREEN_HEIGHT / 2 + 2 * FONT_SIZE * FONT_HEIGHT, SCREEN_WIDTH, FONT_HEIGHT * FONT_SIZE, BLACK);
 
     if (exit_code == 2) {
         strcpy_P(buffer, (char *)pgm_read_word_near(&string_arr[17]));
+    } else if (exit_code == 3) {
+        strcpy_P(buffer, (char *)pgm_read_word_near(&string_arr[31]));
     } else {
         strcpy_P(buffer, (char *)pgm_read_word_near(&string_arr[16]));
     }
@@ -901,8 +2691,8 @@ void copy_screen_middle_button_pressed(int offset) {
     msg_len = strlen(buffer);
     display.setCursor((SCREEN_WIDTH - msg_len * FONT_SIZE * FONT_WIDTH) / 2, SCREEN_HEIGHT / 2 + 2 * FONT_SIZE * FONT_HEIGHT);
     display.println(buffer);
-    display.display();
-    delay(2000);
+    display_flush();
+    flush_delay(2000);
 
     switch_screen(prev_screen);
     redraw();
@@ -940,7 +2730,7 @@ void display_key_screen_draw(int offset) {
         display.print(((uint8_t *)&global_key.cur_key)[i], HEX);
     }
 
-    display.display();
+    display_flush();
 }
 
 void display_screen_draw(int offset) {
@@ -975,219 +2765,1987 @@ void display_screen_draw(int offset) {
         display.println(buffer);
     }
 
-    display.display();
+    display_flush();
 }
 
 #pragma endregion
 
 
-#pragma region KEYS
+#pragma region ONEWIRE
 
-byte read_key(uint64_t *key) {
-    return reinterpret_cast<decltype(read_key)*>(pgm_read_word_near(&read_functions[global_key.key_type]))(key);
+inline bool key_pin_high() {
+    return KEY_PIN_IN & _BV(KEY_PIN_BIT);
 }
 
-byte copy_key(uint64_t new_key, Adafruit_SSD1306 *display) {
-    return reinterpret_cast<decltype(copy_key)*>(pgm_read_word_near(&copy_functions[global_key.key_type]))(new_key, display);
+// Master side, driving the pad low or letting the pull-up have it
+template <class Speed> bool ow_reset() {
+    KEY_PIN_PORT &= ~_BV(KEY_PIN_BIT);
+
+    cli();
+    KEY_PIN_DDR |= _BV(KEY_PIN_BIT);
+    _delay_us(Speed::reset_us);
+    KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+    _delay_us(Speed::presence_sample_us);
+    bool presence = !key_pin_high();
+    sei();
+
+    _delay_us(Speed::reset_recovery_us);
+    return presence;
 }
 
-void emulate_key(uint64_t key) {
-    reinterpret_cast<decltype(emulate_key)*>(pgm_read_word_near(&emulate_functions[global_key.key_type]))(key);
+template <class Speed> void ow_write_bit(bool bit) {
+    cli();
+    KEY_PIN_DDR |= _BV(KEY_PIN_BIT);
+
+    if (bit) {
+        _delay_us(Speed::write1_low_us);
+        KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+        sei();
+        _delay_us(Speed::write1_rest_us);
+    } else {
+        _delay_us(Speed::write0_low_us);
+        KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+        sei();
+        _delay_us(Speed::write0_rest_us);
+    }
+}
+
+template <class Speed> bool ow_read_bit() {
+    cli();
+    KEY_PIN_DDR |= _BV(KEY_PIN_BIT);
+    _delay_us(Speed::read_low_us);
+    KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+    _delay_us(Speed::read_sample_us);
+    bool bit = key_pin_high();
+    sei();
+
+    _delay_us(Speed::read_rest_us);
+    return bit;
+}
+
+template <class Speed> void ow_write_byte(uint8_t value) {
+    for (byte i = 0; i < 8; i++)
+        ow_write_bit<Speed>((value >> i) & 1);
+}
+
+template <class Speed> void ow_read_bytes(uint8_t *data, byte len) {
+    for (byte i = 0; i < len; i++) {
+        data[i] = 0;
+        for (byte j = 0; j < 8; j++)
+            if (ow_read_bit<Speed>())
+                data[i] |= 1 << j;
+    }
 }
 
-void save_key(bool original_title) {
-    int cur_n_keys = EEPROM.readInt(0);
+/*
+ * Slave side. The slot starts when the master pulls the bus low, so
+ * the slave has to notice the edge within a microsecond or so at
+ * overdrive speed: ow_wait_fall is a bare loop with interrupts off,
+ * and the low gets timed on Timer1 only after the answer is on the
+ * bus. Any low longer than a slot is taken for a reset.
+ */
+inline bool ow_wait_fall(uint16_t loops) {
+    while (key_pin_high())
+        if (!loops--)
+            return false;
+
+    return true;
+}
 
-    int i = 0;
+// Waits out a long low, OW_RESET if it was a reset at the current speed, OW_IDLE otherwise
+int8_t ow_slave_reset_tail(uint16_t fell) {
+    while (!key_pin_high())
+        if (OW_ELAPSED_US(fell) > OW_STUCK_US)
+            return OW_IDLE;
 
-    for (;i < cur_n_keys && !(EEPROM.readByte(KEY_TABLE_OFFSET + i * KEY_SIZE + KEY_TYPE_OFFSET) >> 7); i++);
+    uint16_t low = OW_ELAPSED_US(fell);
 
-    if (i != cur_n_keys && (EEPROM.readByte(KEY_TABLE_OFFSET + i * KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7)) != 1) {
-        byte num_free = EEPROM.readByte(KEY_TABLE_OFFSET + i * KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7);
-        EEPROM.updateByte(KEY_TABLE_OFFSET + (i + 1) * KEY_SIZE + KEY_TYPE_OFFSET, (1 << 7) | (num_free - 1));
-        EEPROM.updateByte(KEY_TABLE_OFFSET + (i + num_free - 1) * KEY_SIZE + KEY_TYPE_OFFSET, (1 << 7) | (num_free - 1));
+    if (low >= StandardSpeed::reset_detect_us) {
+        ow_speed = OW_STANDARD;
+        return OW_RESET;
     }
 
-    global_key.key_index = i;
-    cur_n_keys++;
+    return ow_speed == OW_OVERDRIVE && low >= OverdriveSpeed::reset_detect_us ? OW_RESET : OW_IDLE;
+}
 
-    int key_start = KEY_TABLE_OFFSET + global_key.key_index * KEY_SIZE;
+// 0 once the bus is high again, OW_RESET if the master held it for a reset
+template <class Speed> int8_t ow_slave_wait_high(uint16_t fell) {
+    while (!key_pin_high())
+        if (OW_ELAPSED_US(fell) > Speed::reset_detect_us)
+            return ow_slave_reset_tail(fell);
 
-    EEPROM.updateInt(0, cur_n_keys);
-    update_key_by_index(global_key);
+    return 0;
+}
 
-    if (!original_title) {
-        strcpy_P(buffer, (char *)pgm_read_word(&string_arr[20]));
+template <class Speed> int8_t ow_slave_read_bit() {
+    if (!ow_wait_fall(OW_LOOPS(Speed::slot_timeout_us)))
+        return OW_IDLE;
 
-        if (cur_n_keys >= 10) {
-            buffer[8] = '0' + cur_n_keys / 10;
-            buffer[9] = '0' + cur_n_keys % 10;
-            buffer[10] = '\0';
-        } else {
-            buffer[8] = '0' + cur_n_keys % 10;
-            buffer[9] = '\0';
-        }
+    uint16_t fell = TCNT1;
+    _delay_us(Speed::sample_us);
+    if (key_pin_high())
+        return 1;
+
+    int8_t result = ow_slave_wait_high<Speed>(fell);
+    return result < 0 ? result : 0;
+}
+
+template <class Speed> int8_t ow_slave_write_bit(bool bit) {
+    if (!ow_wait_fall(OW_LOOPS(Speed::slot_timeout_us)))
+        return OW_IDLE;
+
+    if (!bit) {
+        KEY_PIN_DDR |= _BV(KEY_PIN_BIT);
+        _delay_us(Speed::hold_us);
+        KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
     }
 
-    for (byte i = 0; i < KEY_NAME_LEN; i++) {
-        EEPROM.updateByte(key_start + KEY_NAME_OFFSET + i, buffer[i]);
+    return ow_slave_wait_high<Speed>(TCNT1);
+}
+
+template <class Speed> int8_t ow_slave_read_byte(uint8_t *value) {
+    *value = 0;
+
+    for (byte i = 0; i < 8; i++) {
+        int8_t bit = ow_slave_read_bit<Speed>();
+        if (bit < 0)
+            return bit;
+
+        *value |= bit << i;
     }
+
+    return 0;
 }
 
-void delete_key(int index) {
-    int offset = get_key_offset(index);
-    int n_keys = EEPROM.readInt(0);
-    int last_offset = get_key_offset(n_keys - 1);
-    EEPROM.updateInt(0, n_keys - 1);
-
-    EEPROM.updateByte(offset + KEY_TYPE_OFFSET, 1 | (1 << 7));
-
-    if ((offset != last_offset) && (EEPROM.readByte(offset + KEY_SIZE + KEY_TYPE_OFFSET) >> 7) &&
-        (offset != KEY_TABLE_OFFSET) && (EEPROM.readByte(offset - KEY_SIZE + KEY_TYPE_OFFSET) >> 7)) {
-            byte num_free_1 = EEPROM.readByte(offset - KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7),
-                 num_free_2 = EEPROM.readByte(offset + KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7);
-            
-            EEPROM.updateByte(offset - num_free_1 * KEY_SIZE + KEY_TYPE_OFFSET, (num_free_1 + num_free_2 + 1) | (1 << 7));
-            EEPROM.updateByte(offset + num_free_2 * KEY_SIZE + KEY_TYPE_OFFSET, (num_free_1 + num_free_2 + 1) | (1 << 7));
-    } else {
-        if ((offset != last_offset) && (EEPROM.readByte(offset + KEY_SIZE + KEY_TYPE_OFFSET) >> 7)) {
-            byte num_free = EEPROM.readByte(offset + KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7);
-            EEPROM.updateByte(offset + KEY_TYPE_OFFSET, (num_free + 1) | (1 << 7));
-            EEPROM.updateByte(offset + num_free * KEY_SIZE + KEY_TYPE_OFFSET, (num_free + 1) | (1 << 7));
-        } else if ((offset != KEY_TABLE_OFFSET) && (EEPROM.readByte(offset - KEY_SIZE + KEY_TYPE_OFFSET) >> 7)) {
-            byte num_free = EEPROM.readByte(offset - KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7);
-            EEPROM.updateByte(offset + KEY_TYPE_OFFSET, (num_free + 1) | (1 << 7));
-            EEPROM.updateByte(offset - num_free * KEY_SIZE + KEY_TYPE_OFFSET, (num_free + 1) | (1 << 7));
-        }
+template <class Speed> int8_t ow_slave_write_bytes(const uint8_t *data, byte len) {
+    for (byte i = 0; i < len * 8; i++) {
+        int8_t result = ow_slave_write_bit<Speed>((data[i / 8] >> (i % 8)) & 1);
+        if (result < 0)
+            return result;
     }
+
+    return 0;
 }
 
-Key get_key_by_index(int index) {
-    int offset = get_key_offset(index);
+// 1 if the master sent rom
+template <class Speed> int8_t ds1990_match(const uint8_t *rom) {
+    int8_t matched = 1;
 
-    Key key = (struct Key){0, index, EEPROM.readByte(offset + KEY_TYPE_OFFSET)};
-    key.cur_key = EEPROM.readLong(offset + KEY_OFFSET + 4);
-    key.cur_key <<= 32;
-    key.cur_key |= EEPROM.readLong(offset + KEY_OFFSET);
+    for (byte i = 0; i < 64; i++) {
+        int8_t bit = ow_slave_read_bit<Speed>();
+        if (bit < 0)
+            return bit;
 
-    return key;
+        if (bit != ((rom[i / 8] >> (i % 8)) & 1))
+            matched = 0;
+    }
+
+    return matched;
 }
 
-int get_key_offset(int index) {
-    int real_index = 0, i = 0;
+template <class Speed> int8_t ds1990_search(const uint8_t *rom) {
+    for (byte i = 0; i < 64; i++) {
+        bool bit = (rom[i / 8] >> (i % 8)) & 1;
+        int8_t result;
+
+        if ((result = ow_slave_write_bit<Speed>(bit)) < 0 ||
+            (result = ow_slave_write_bit<Speed>(!bit)) < 0 ||
+            (result = ow_slave_read_bit<Speed>()) < 0)
+            return result;
 
-    if (EEPROM.readByte(KEY_TABLE_OFFSET + KEY_TYPE_OFFSET) >> 7) {
-        byte key_offset = EEPROM.readByte(KEY_TABLE_OFFSET + KEY_TYPE_OFFSET) & ~(1 << 7);
-        real_index += key_offset;
-        // Serial.println(F("la"));
+        // The master went the other way, this key is out of the search
+        if (result != bit)
+            return 0;
     }
 
-    for (;i < index; i++) {
-        if (EEPROM.readByte(KEY_TABLE_OFFSET + real_index * KEY_SIZE + KEY_SIZE + KEY_TYPE_OFFSET) >> 7) {
-            byte key_offset = EEPROM.readByte(KEY_TABLE_OFFSET + real_index * KEY_SIZE + KEY_SIZE + KEY_TYPE_OFFSET) & ~(1 << 7);
-            real_index += key_offset;
-        } else {
-            real_index++;
+    return 0;
+}
+
+// Cache entry holding page, one gets claimed if it isn't there, except for keep's and dirty ones
+byte memory_entry(MemoryKey *memory, int page, int keep) {
+    for (byte i = 0; i < MEMORY_CACHE_PAGES; i++)
+        if (memory->page_tags[i] == page)
+            return i;
+
+    for (byte i = 0; i < MEMORY_CACHE_PAGES; i++) {
+        if (memory->page_tags[i] != keep && !(memory->dirty & _BV(i))) {
+            memory->page_tags[i] = page;
+            memory->filled[i] = 0;
+            return i;
         }
     }
 
-    return KEY_TABLE_OFFSET + real_index * KEY_SIZE;
+    return MEMORY_NO_ENTRY;
 }
 
-void update_key_by_index(Key key) {
-    int cur_key_start = KEY_TABLE_OFFSET + key.key_index * KEY_SIZE;
+// Loads one more byte of the page holding address or, once it is there, of the next one
+void memory_prefetch(MemoryKey *memory, uint16_t address) {
+    int page = address / MEMORY_PAGE_SIZE;
 
-    EEPROM.updateByte(cur_key_start + KEY_TYPE_OFFSET, key.key_type);
-    EEPROM.updateLong(cur_key_start + KEY_OFFSET, (uint32_t)key.cur_key);
-    EEPROM.updateLong(cur_key_start + KEY_OFFSET + 4, (uint32_t)(key.cur_key >> 32));
-}
+    for (byte n = 0; n < 2; n++, page++) {
+        if (memory->image == -1 || page * MEMORY_PAGE_SIZE >= memory->image_len)
+            return;
 
-byte read_ds1990(uint64_t *key) {
-    #if DEBUG
-    Serial.println(F("Reading key..."));
-    #endif
+        byte entry = memory_entry(memory, page, n ? page - 1 : page);
+        if (entry == MEMORY_NO_ENTRY)
+            return;
 
-    if(!ibutton.reset()) {
-        #if DEBUG
-        Serial.println(F("No available devices!"));
-        #endif
+        byte i = memory->filled[entry];
+        if (i < MEMORY_PAGE_SIZE) {
+            memory->pages[entry][i] = EEPROM.readByte(memory->image + page * MEMORY_PAGE_SIZE + i);
+            memory->filled[entry]++;
+            return;
+        }
+    }
+}
 
-        return 1;
+// Memory past the image reads as ones, like no answer at all
+uint8_t memory_byte(MemoryKey *memory, uint16_t address) {
+    if (memory->image == -1 || address >= memory->image_len)
+        return 0xFF;
+
+    for (byte i = 0; i < MEMORY_CACHE_PAGES; i++) {
+        if (memory->page_tags[i] == address / MEMORY_PAGE_SIZE && memory->filled[i] > address % MEMORY_PAGE_SIZE)
+            return memory->pages[i][address % MEMORY_PAGE_SIZE];
     }
 
-    ibutton.write(0x33);
-    delay(1);
+    return EEPROM.readByte(memory->image + address);
+}
 
-    ibutton.read_bytes((uint8_t *)key, 8);
+// Copy Scratchpad: the bytes go to the cached page, which stays there until written back
+void memory_copy_scratchpad(MemoryKey *memory) {
+    int page = memory->target / MEMORY_PAGE_SIZE;
 
-    #if DEBUG
-    Serial.print(F("Read key "));
-    for (byte i = 0; i < 8; i++) {
-        if (((uint8_t *)key)[i] / 16 == 0)
-            Serial.print(0);
-        Serial.print(((uint8_t *)key)[i], HEX);
-        Serial.print(' ');
-    }
-    Serial.println();
-    #endif
+    if (memory->image == -1 || page * MEMORY_PAGE_SIZE >= memory->image_len)
+        return;
 
-    if (((uint8_t *)key)[0] != 0x01) {
-        #if DEBUG
-        Serial.println(F("Device is not iButton!"));
-        Serial.println();
-        #endif
+    byte entry = memory_entry(memory, page, page);
+    if (entry == MEMORY_NO_ENTRY)
+        return;
 
-        return 2;
-    }
-    
+    while (memory->filled[entry] < MEMORY_PAGE_SIZE)
+        memory_prefetch(memory, page * MEMORY_PAGE_SIZE);
 
-    if (ibutton.crc8((uint8_t *)key, 7) != ((uint8_t *)key)[7]) {
-        #if DEBUG
-        Serial.println((uint32_t)(*key >> 32), HEX);
-        Serial.print((uint32_t)*key, HEX);
+    for (byte i = memory->target % MEMORY_PAGE_SIZE; i <= (memory->status & MEMORY_ES_OFFSET); i++)
+        memory->pages[entry][i] = memory->scratchpad[i];
 
-        Serial.print(F("Incorrect CRC!\nCorrect CRC:"));
-        Serial.println(ibutton.crc8((uint8_t *)key, 7), HEX);
-        #endif
+    memory->dirty |= _BV(entry);
+}
 
-        return 3;
+// From the main loop with interrupts on, as EEPROM writes take milliseconds
+void memory_write_back(MemoryKey *memory) {
+    for (byte i = 0; i < MEMORY_CACHE_PAGES; i++) {
+        if (!(memory->dirty & _BV(i)))
+            continue;
+
+        int start = memory->page_tags[i] * MEMORY_PAGE_SIZE;
+
+        if (battery_allows_writes()) {
+            for (byte j = 0; j < MEMORY_PAGE_SIZE && start + j < memory->image_len; j++)
+                EEPROM.updateByte(memory->image + start + j, memory->pages[i][j]);
+        }
+
+        memory->dirty &= ~_BV(i);
     }
 
-    ibutton.reset_search();
+    // The next session reads the image with interrupts off, a read would stall on the last write there
+    eeprom_busy_wait();
+}
+
+template <class Speed> int8_t memory_read_target(uint16_t *target) {
+    uint8_t address[2];
+    int8_t result;
+
+    if ((result = ow_slave_read_byte<Speed>(&address[0])) < 0 ||
+        (result = ow_slave_read_byte<Speed>(&address[1])) < 0)
+        return result;
+
+    *target = address[0] | (address[1] << 8);
     return 0;
 }
 
-byte copy_ds1990(uint64_t new_key, Adafruit_SSD1306 *display) {
-    if(!ibutton.reset()) {
-        #if DEBUG
-        Serial.println(F("No available devices!"));
-        #endif
+// Sends bytes until the master stops reading, a byte of the cache gets loaded after every slot
+template <class Speed> int8_t memory_send(MemoryKey *memory, uint16_t address) {
+    for (;; address++) {
+        uint8_t value = memory_byte(memory, address);
 
-        return 1;
+        for (byte i = 0; i < 8; i++) {
+            int8_t result = ow_slave_write_bit<Speed>((value >> i) & 1);
+            if (result < 0)
+                return result;
+
+            memory_prefetch(memory, address + 1);
+        }
     }
+}
 
-    ibutton.write(0x33);
-    delay(1);
+template <class Speed> int8_t memory_write_scratchpad(MemoryKey *memory) {
+    int8_t result = memory_read_target<Speed>(&memory->target);
+    if (result < 0)
+        return result;
 
-    uint64_t prev_key;
-    ibutton.read_bytes((uint8_t *)&prev_key, 8);
+    byte offset = memory->target % MEMORY_PAGE_SIZE;
+    byte value = 0, n_bits = 0;
+    memory->status = offset | MEMORY_ES_PF;
 
-    #if DEBUG
-    for (byte i = 0; i < 8; i++) {
-        if (((uint8_t *)&prev_key)[i] / 16 == 0)
-            Serial.print(0);
-        Serial.print(((uint8_t *)&prev_key)[i], HEX);
-        Serial.print(' ');
-    }
-    Serial.println();
+    // Up to the end of the scratchpad, the rest gets ignored
+    while ((result = ow_slave_read_bit<Speed>()) >= 0) {
+        value |= result << n_bits;
+        if (++n_bits < 8)
+            continue;
 
-    if (((uint8_t *)&prev_key)[0] != 0x01) {
-        Serial.println(F("Device signature is not iButton!"));
-    }
-    
-    if (ibutton.crc8((uint8_t *)&prev_key, 7) != ((uint8_t *)&prev_key)[7]) {
-        Serial.print(F("Incorrect CRC! Correct CRC:"));
-        Serial.println(ibutton.crc8((uint8_t *)&prev_key, 7), HEX);
+        if (offset < MEMORY_PAGE_SIZE) {
+            memory->scratchpad[offset] = value;
+            memory->status = offset++;
+        }
+
+        value = n_bits = 0;
+    }
+
+    if (n_bits)
+        memory->status |= MEMORY_ES_PF;
+
+    return result;
+}
+
+template <class Speed> int8_t memory_read_scratchpad(MemoryKey *memory) {
+    uint8_t header[3] = {(uint8_t)memory->target, (uint8_t)(memory->target >> 8), memory->status};
+    int8_t result = ow_slave_write_bytes<Speed>(header, 3);
+
+    for (byte i = memory->target % MEMORY_PAGE_SIZE; result >= 0 && i <= (memory->status & MEMORY_ES_OFFSET); i++)
+        result = ow_slave_write_bytes<Speed>(&memory->scratchpad[i], 1);
+
+    return result;
+}
+
+template <class Speed> int8_t memory_copy(MemoryKey *memory) {
+    uint16_t target;
+    uint8_t status;
+    int8_t result;
+
+    if ((result = memory_read_target<Speed>(&target)) < 0 ||
+        (result = ow_slave_read_byte<Speed>(&status)) < 0)
+        return result;
+
+    // The authorization pattern is TA1, TA2 and E/S as Read Scratchpad gave them
+    if (target == memory->target && status == memory->status && !(status & MEMORY_ES_PF)) {
+        memory_copy_scratchpad(memory);
+        memory->status |= MEMORY_ES_AA;
+    }
+
+    return 0;
+}
+
+// DS1992, DS1993 and DS1996 share their memory function commands
+template <class Speed> int8_t memory_function(MemoryKey *memory) {
+    uint8_t command;
+    uint16_t address;
+    int8_t result = ow_slave_read_byte<Speed>(&command);
+
+    if (result < 0)
+        return result;
+
+    switch (command) {
+        case 0xF0:
+            if ((result = memory_read_target<Speed>(&address)) < 0)
+                return result;
+
+            memory_prefetch(memory, address);
+            return memory_send<Speed>(memory, address);
+        case 0x0F:
+            return memory_write_scratchpad<Speed>(memory);
+        case 0xAA:
+            return memory_read_scratchpad<Speed>(memory);
+        case 0x55:
+            return memory_copy<Speed>(memory);
+        default:
+            return 0;
+    }
+}
+
+// From the end of a reset to the end of its command, memory keys go on with a function command
+template <class Speed> int8_t ow_session(const uint8_t *rom, MemoryKey *memory) {
+    _delay_us(Speed::presence_wait_us);
+    KEY_PIN_DDR |= _BV(KEY_PIN_BIT);
+    _delay_us(Speed::presence_us);
+    KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+
+    int8_t result = ow_slave_wait_high<Speed>(TCNT1);
+    uint8_t command;
+
+    if (result < 0 || (result = ow_slave_read_byte<Speed>(&command)) < 0)
+        return result;
+
+    switch (command) {
+        case 0x0F:      // Read ROM of the DS1990, only a function command for the others
+            return memory ? 0 : ow_slave_write_bytes<Speed>(rom, 8);
+        case 0x33:
+            return ow_slave_write_bytes<Speed>(rom, 8);
+        case 0x55:
+            result = ds1990_match<Speed>(rom);
+            break;
+        case 0xCC:
+            result = 1;
+            break;
+        case 0xF0:
+            return ds1990_search<Speed>(rom);
+        case 0x3C:
+            ow_speed = OW_OVERDRIVE;
+            return memory ? memory_function<OverdriveSpeed>(memory) : 0;
+        case 0x69:
+            // The ROM already comes at overdrive speed, only the matching key stays there
+            ow_speed = OW_OVERDRIVE;
+            result = ds1990_match<OverdriveSpeed>(rom);
+            if (result == 0)
+                ow_speed = OW_STANDARD;
+            else if (result == 1 && memory)
+                return memory_function<OverdriveSpeed>(memory);
+            return result;
+        default:
+            return 0;
+    }
+
+    return result == 1 && memory ? memory_function<Speed>(memory) : result;
+}
+
+/*
+ * Answers everything from a reset on, waiting idle_loops for it.
+ * A session is followed by the next reset right away as a rule, so
+ * it gets waited for here, as the main loop could miss most of an
+ * overdrive reset.
+ */
+void ow_slave_poll(const uint8_t *rom, MemoryKey *memory, uint16_t idle_loops) {
+    if (!ow_wait_fall(idle_loops))
+        return;
+
+    cli();
+    int8_t result = ow_slave_reset_tail(TCNT1);
+
+    while (result == OW_RESET) {
+        if (ow_speed == OW_OVERDRIVE)
+            result = ow_session<OverdriveSpeed>(rom, memory);
+        else
+            result = ow_session<StandardSpeed>(rom, memory);
+
+        if (result != OW_RESET)
+            result = ow_wait_fall(OW_LOOPS(OW_SESSION_IDLE_US)) ? ow_slave_reset_tail(TCNT1) : OW_IDLE;
+    }
+
+    sei();
+}
+
+#if SNIFFER
+/*
+ * Sniffer for the traffic between a reader and a key on the pad. The
+ * comparator feeds Timer1 input capture like for raw keys, but capture
+ * gets polled with interrupts off, as the serial and millis interrupts
+ * could hold off turning it around for longer than an overdrive slot.
+ * A fall is latched by the timer whenever it comes, then capture gets
+ * switched to the rise and back, so both edges get exact timestamps.
+ * A pulse over before capture got turned around (an overdrive 1 slot
+ * right after a long record) only has an upper bound for its width.
+ *
+ * Pulses get decoded right away into resets, presence pulses and bytes
+ * (least significant bit first), switching to overdrive thresholds after
+ * an Overdrive Skip or Match ROM and back on a standard reset. Records
+ * are a tag and fixed fields, little-endian, cheap enough to build
+ * between two slots; they get queued in the screen buffer and written
+ * to UDR0 between edges. The host decodes them offline (keyctl sniff).
+ */
+void sniff_onewire() {
+    Sniffer sniffer;
+    memset(&sniffer, 0, sizeof(sniffer));
+    sniffer.out = display.getBuffer();
+
+    sniff_put(&sniffer, SNIFF_START);
+    sniff_put(&sniffer, F_CPU / 1000000L);
+
+    raw_capture_begin();
+    TIMSK1 = 0;
+    TCCR1B = _BV(ICNC1) | _BV(ICES1) | _BV(CS10);   // falls first, at the CPU clock
+    TIFR1 = _BV(ICF1) | _BV(TOV1);
+    ow_speed = OW_STANDARD;
+
+    Serial.flush();
+    cli();
+
+    bool missed = false;    // a fall came before capture got switched back to falls
+    uint16_t fell = 0;
+
+    for (;;) {
+        if (missed || (TIFR1 & _BV(ICF1))) {
+            if (!missed)
+                fell = ICR1;
+
+            bool late = missed;
+            missed = false;
+
+            // Changing the edge may set the flag
+            TCCR1B &= ~_BV(ICES1);
+            TIFR1 = _BV(ICF1);
+
+            // The comparator output is high while the pad is low
+            while (!(TIFR1 & _BV(ICF1)) && (ACSR & _BV(ACO)) && (uint16_t)(TCNT1 - fell) < SNIFF_TICKS(OW_STUCK_US));
+
+            uint16_t rose;
+            if (TIFR1 & _BV(ICF1)) {
+                rose = ICR1;
+            } else {
+                rose = TCNT1;
+                late |= !(ACSR & _BV(ACO));
+            }
+
+            TCCR1B |= _BV(ICES1);
+            TIFR1 = _BV(ICF1);
+
+            if (ACSR & _BV(ACO)) {
+                missed = true;
+                fell = TCNT1;
+            }
+
+            sniff_pulse(&sniffer, fell, rose, late);
+        } else if (TIFR1 & _BV(TOV1)) {
+            TIFR1 = _BV(TOV1);
+            if (sniffer.overflows < 0xFFFF)
+                sniffer.overflows++;
+        } else if (sniffer.out_head != sniffer.out_tail && (UCSR0A & _BV(UDRE0))) {
+            UDR0 = sniffer.out[sniffer.out_tail];
+            sniffer.out_tail = (sniffer.out_tail + 1) & (SNIFF_OUT_SIZE - 1);
+        } else if ((UCSR0A & _BV(RXC0)) || (PIND & SNIFF_BUTTONS) != SNIFF_BUTTONS) {
+            break;
+        }
+    }
+
+    sniff_flush(&sniffer);
+    sniff_put(&sniffer, SNIFF_END);
+
+    while (sniffer.out_head != sniffer.out_tail) {
+        while (!(UCSR0A & _BV(UDRE0)));
+        UDR0 = sniffer.out[sniffer.out_tail];
+        sniffer.out_tail = (sniffer.out_tail + 1) & (SNIFF_OUT_SIZE - 1);
+    }
+
+    // The byte which stopped it isn't a command
+    while (UCSR0A & _BV(RXC0))
+        UDR0;
+
+    sei();
+    raw_capture_end();
+    ow_speed = OW_STANDARD;
+
+    // Neither is the press
+    for (byte i = 0; i < 3; i++) {
+        if (!digitalRead(buttons[i].pin)) {
+            buttons[i].pressed = true;
+            buttons[i].executed = true;
+            buttons[i].since = millis();
+        }
+    }
+}
+
+void sniff_pulse(Sniffer *sniffer, uint16_t fell, uint16_t rose, bool late) {
+    uint16_t low = rose - fell;
+    bool overdrive = ow_speed == OW_OVERDRIVE;
+
+    if (low >= SNIFF_TICKS(StandardSpeed::reset_detect_us) ||
+        (overdrive && low >= SNIFF_TICKS(OverdriveSpeed::reset_detect_us))) {
+        if (!overdrive || low >= SNIFF_TICKS(StandardSpeed::reset_detect_us))
+            ow_speed = OW_STANDARD;
+
+        sniff_flush(sniffer);
+
+        // Timer1 wraps every 8 ms at 8 MHz, its overflow count tells the time between resets in those
+        if (sniff_record(sniffer, 5)) {
+            sniff_put(sniffer, SNIFF_RESET);
+            sniff_put_word(sniffer, sniffer->overflows);
+            sniff_put_word(sniffer, low);
+        }
+
+        sniffer->overflows = 0;
+        sniffer->reset_rose = rose;
+        sniffer->after_reset = true;
+        sniffer->n_bytes = 0;
+        return;
+    }
+
+    uint16_t presence_ticks = overdrive ? SNIFF_TICKS(OverdriveSpeed::presence_sample_us)
+                                        : SNIFF_TICKS(StandardSpeed::presence_sample_us);
+
+    if (sniffer->after_reset && (uint16_t)(fell - sniffer->reset_rose) <= presence_ticks) {
+        sniffer->after_reset = false;
+
+        if (sniff_record(sniffer, 5)) {
+            sniff_put(sniffer, SNIFF_PRESENCE);
+            sniff_put_word(sniffer, fell - sniffer->reset_rose);
+            sniff_put_word(sniffer, low);
+        }
+
+        return;
+    }
+
+    sniffer->after_reset = false;
+    uint16_t sample_ticks = overdrive ? SNIFF_TICKS(OverdriveSpeed::sniff_sample_us)
+                                      : SNIFF_TICKS(StandardSpeed::sniff_sample_us);
+
+    // A pulse which got away was a short one, if likely not short enough
+    if (low < sample_ticks || late)
+        sniffer->bits |= 1 << sniffer->n_bits;
+    if (late && low >= sample_ticks && sniffer->late < 0xFFFF)
+        sniffer->late++;
+
+    if (++sniffer->n_bits < 8)
+        return;
+
+    if (sniff_record(sniffer, 2)) {
+        sniff_put(sniffer, SNIFF_BYTE);
+        sniff_put(sniffer, sniffer->bits);
+    }
+
+    // Both overdrive ROM commands switch right after themselves
+    if (sniffer->n_bytes++ == 0 && (sniffer->bits == 0x3C || sniffer->bits == 0x69))
+        ow_speed = OW_OVERDRIVE;
+
+    sniffer->bits = 0;
+    sniffer->n_bits = 0;
+}
+
+// Makes room for a record of len bytes, or counts it as dropped
+bool sniff_record(Sniffer *sniffer, byte len) {
+    uint16_t used = (sniffer->out_head - sniffer->out_tail) & (SNIFF_OUT_SIZE - 1);
+    byte dropped_len = sniffer->dropped ? 3 : 0;
+
+    if (used + dropped_len + len >= SNIFF_OUT_SIZE) {
+        if (sniffer->dropped < 0xFFFF)
+            sniffer->dropped++;
+        return false;
+    }
+
+    if (sniffer->dropped) {
+        sniff_put(sniffer, SNIFF_DROPPED);
+        sniff_put_word(sniffer, sniffer->dropped);
+        sniffer->dropped = 0;
+    }
+
+    return true;
+}
+
+void sniff_put(Sniffer *sniffer, byte value) {
+    sniffer->out[sniffer->out_head] = value;
+    sniffer->out_head = (sniffer->out_head + 1) & (SNIFF_OUT_SIZE - 1);
+}
+
+void sniff_put_word(Sniffer *sniffer, uint16_t value) {
+    sniff_put(sniffer, value & 0xFF);
+    sniff_put(sniffer, value >> 8);
+}
+
+// Bits of a byte cut short and the late count, before a reset and at the end
+void sniff_flush(Sniffer *sniffer) {
+    if (sniffer->n_bits && sniff_record(sniffer, 3)) {
+        sniff_put(sniffer, SNIFF_BITS);
+        sniff_put(sniffer, sniffer->n_bits);
+        sniff_put(sniffer, sniffer->bits);
+    }
+
+    if (sniffer->late && sniff_record(sniffer, 3)) {
+        sniff_put(sniffer, SNIFF_LATE);
+        sniff_put_word(sniffer, sniffer->late);
+        sniffer->late = 0;
+    }
+
+    sniffer->bits = 0;
+    sniffer->n_bits = 0;
+}
+#endif
+
+#pragma endregion
+
+
+#pragma region KEYS
+
+byte read_key(uint64_t *key) {
+    name_cache_invalidate(0);
+    return reinterpret_cast<decltype(read_key)*>(pgm_read_word_near(&read_functions[global_key.key_type]))(key);
+}
+
+byte copy_key(uint64_t new_key, Adafruit_SSD1306 *display) {
+    return reinterpret_cast<decltype(copy_key)*>(pgm_read_word_near(&copy_functions[global_key.key_type]))(new_key, display);
+}
+
+void emulate_key(uint64_t key) {
+    name_cache_invalidate(0);
+    reinterpret_cast<decltype(emulate_key)*>(pgm_read_word_near(&emulate_functions[global_key.key_type]))(key);
+}
+
+byte key_payload_len(byte type) {
+    return pgm_read_byte_near(&key_payload_lens[type]);
+}
+
+// Payload length of a key about to be saved, raw ones take it from raw_trace
+byte key_data_len(Key key) {
+    if (key.key_type == KEY_TYPE_DS1992)
+        return MEMORY_PAYLOAD_LEN;
+
+    byte payload_len = key_payload_len(key.key_type);
+
+    if (payload_len == KEY_PAYLOAD_VARIABLE)
+        payload_len = 1 + raw_trace[0];
+
+    return payload_len;
+}
+
+// Payload byte of global_key about to be saved
+byte key_data_byte(byte index) {
+    if (global_key.key_type == KEY_TYPE_RAW)
+        return raw_trace[index];
+
+    if (global_key.key_type != KEY_TYPE_DS1992)
+        return ((uint8_t *)&global_key.cur_key)[index];
+
+    if (index == 0)
+        return MEMORY_PAYLOAD_LEN - 1;
+    if (index < MEMORY_IMAGE_OFFSET)
+        return ((uint8_t *)&global_key.cur_key)[index - MEMORY_ROM_OFFSET];
+
+    return memory_source == -1 ? 0xFF : EEPROM.readByte(memory_source + index);
+}
+
+// Payload length of a stored key, raw and memory ones keep it in the first payload byte
+byte record_payload_len(int offset) {
+    byte payload_len = key_payload_len(key_table_read(offset + KEY_TYPE_OFFSET));
+
+    if (payload_len == KEY_PAYLOAD_VARIABLE)
+        payload_len = 1 + key_table_read(offset + KEY_OFFSET);
+
+    return payload_len;
+}
+
+int key_record_size(int offset) {
+    byte type = key_table_read(offset + KEY_TYPE_OFFSET);
+    byte len = key_table_read(offset + KEY_LEN_OFFSET);
+
+    if (type & KEY_FREE)
+        return KEY_OFFSET + (((type & ~KEY_FREE) << 8) | len);
+
+    return KEY_OFFSET + record_payload_len(offset) + len;
+}
+
+byte read_key_name(int offset, char *name) {
+    byte len = key_table_read(offset + KEY_LEN_OFFSET);
+
+    return decode_key_name(offset + KEY_OFFSET + record_payload_len(offset), len, name);
+}
+
+byte name_symbol(char c) {
+    if (c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+
+    for (byte i = 0; i < NAME_SYMBOL_WORD; i++) {
+        if ((char)pgm_read_byte_near(&name_symbols[i]) == c)
+            return i;
+    }
+
+    return NAME_SYMBOL_RAW;
+}
+
+void put_name_symbol(NameWriter *writer, byte symbol) {
+    writer->bits = (writer->bits << NAME_SYMBOL_BITS) | symbol;
+    writer->n_bits += NAME_SYMBOL_BITS;
+
+    if (writer->n_bits >= 8) {
+        writer->n_bits -= 8;
+
+        if (writer->offset >= 0)
+            EEPROM.updateByte(writer->offset + writer->n_bytes, writer->bits >> writer->n_bits);
+
+        writer->n_bytes++;
+    }
+}
+
+byte get_name_symbol(NameReader *reader) {
+    if (reader->n_bits < NAME_SYMBOL_BITS) {
+        if (!reader->len)
+            return NAME_SYMBOL_END;
+
+        reader->bits = (reader->bits << 8) | key_table_read(reader->offset++);
+        reader->n_bits += 8;
+        reader->len--;
+    }
+
+    reader->n_bits -= NAME_SYMBOL_BITS;
+    return (reader->bits >> reader->n_bits) & ((1 << NAME_SYMBOL_BITS) - 1);
+}
+
+// Writes packed name at offset and returns its length, offset -1 only counts the length
+byte encode_key_name(const char *name, int offset) {
+    NameWriter writer = {offset, 0, 0, 0};
+    bool lower = false;
+
+    for (byte i = 0; i < KEY_NAME_LEN && name[i] != '\0';) {
+        byte word = 0, word_len = 0;
+
+        for (byte j = 0; j < N_NAME_WORDS; j++) {
+            const char *cur_word = (const char *)pgm_read_word_near(&name_words[j]);
+            byte cur_len = strlen_P(cur_word);
+
+            if (cur_len > word_len && i + cur_len <= KEY_NAME_LEN && !strncmp_P(name + i, cur_word, cur_len)) {
+                word = j;
+                word_len = cur_len;
+            }
+        }
+
+        // A word takes two symbols, so it only pays off from three characters
+        if (word_len >= 3) {
+            put_name_symbol(&writer, NAME_SYMBOL_WORD);
+            put_name_symbol(&writer, word);
+            i += word_len;
+            continue;
+        }
+
+        char c = name[i];
+        byte symbol = name_symbol(c);
+
+        if (symbol == NAME_SYMBOL_RAW) {
+            put_name_symbol(&writer, NAME_SYMBOL_RAW);
+            put_name_symbol(&writer, (byte)c >> NAME_SYMBOL_BITS);
+            put_name_symbol(&writer, c & ((1 << NAME_SYMBOL_BITS) - 1));
+        } else {
+            bool is_letter = symbol >= 1 && symbol <= 26;
+            bool is_lower = c >= 'a' && c <= 'z';
+
+            if (is_letter && is_lower != lower) {
+                char next = name[i + 1];
+                bool next_same = i + 1 < KEY_NAME_LEN && (is_lower ? (next >= 'a' && next <= 'z') : (next >= 'A' && next <= 'Z'));
+
+                if (next_same) {
+                    put_name_symbol(&writer, NAME_SYMBOL_TOGGLE);
+                    lower = is_lower;
+                } else {
+                    put_name_symbol(&writer, NAME_SYMBOL_SHIFT);
+                }
+            }
+
+            put_name_symbol(&writer, symbol);
+        }
+
+        i++;
+    }
+
+    // Pad the last byte with ones, so the decoder sees NAME_SYMBOL_END there
+    if (writer.n_bits) {
+        byte pad = 8 - writer.n_bits;
+
+        if (writer.offset >= 0)
+            EEPROM.updateByte(writer.offset + writer.n_bytes, (writer.bits << pad) | ((1 << pad) - 1));
+
+        writer.n_bytes++;
+    }
+
+    return writer.n_bytes;
+}
+
+byte decode_key_name(int offset, byte len, char *name) {
+    NameReader reader = {offset, len, 0, 0};
+    bool lower = false, shift = false;
+    byte n = 0, symbol;
+
+    while (n < KEY_NAME_LEN && (symbol = get_name_symbol(&reader)) != NAME_SYMBOL_END) {
+        if (symbol == NAME_SYMBOL_WORD) {
+            symbol = get_name_symbol(&reader);
+            if (symbol >= N_NAME_WORDS)
+                break;
+
+            const char *word = (const char *)pgm_read_word_near(&name_words[symbol]);
+            for (char c; n < KEY_NAME_LEN && (c = pgm_read_byte_near(word++)) != '\0';)
+                name[n++] = c;
+        } else if (symbol == NAME_SYMBOL_RAW) {
+            byte high = get_name_symbol(&reader);
+            name[n++] = (high << NAME_SYMBOL_BITS) | get_name_symbol(&reader);
+        } else if (symbol == NAME_SYMBOL_TOGGLE) {
+            lower = !lower;
+        } else if (symbol == NAME_SYMBOL_SHIFT) {
+            shift = true;
+        } else {
+            char c = pgm_read_byte_near(&name_symbols[symbol]);
+
+            if (symbol >= 1 && symbol <= 26 && lower != shift)
+                c += 'a' - 'A';
+
+            shift = false;
+            name[n++] = c;
+        }
+    }
+
+    name[n] = '\0';
+    return n;
+}
+
+void write_free_record(int offset, int size) {
+    size -= KEY_OFFSET;
+    key_table_write(offset + KEY_LEN_OFFSET, size & 0xFF);
+    key_table_write(offset + KEY_TYPE_OFFSET, KEY_FREE | (size >> 8));
+}
+
+bool save_key(bool original_title) {
+    // Inside a transaction the caller has already checked
+    if (!journal_depth && !battery_allows_writes())
+        return false;
+
+    journal_begin();
+
+    // Bodies go straight to EEPROM, into space a half done move may still use
+    if (journal_failed) {
+        journal_commit();
+        return false;
+    }
+
+    int cur_n_keys = key_table_read_int(KEY_COUNT_OFFSET);
+    int table_end = key_table_read_int(KEY_TABLE_END_OFFSET);
+
+    // Space freed earlier in the same transaction still holds live data until commit
+    int stable_end = max(table_end, EEPROM.readInt(KEY_TABLE_END_OFFSET));
+
+    if (!original_title) {
+        strcpy_P(buffer, (char *)pgm_read_word(&string_arr[20]));
+        itoa(cur_n_keys + 1, buffer + 8, 10);
+    }
+
+    byte name_len = encode_key_name(buffer);
+    byte payload_len = key_data_len(global_key);
+    int size = KEY_OFFSET + payload_len + name_len;
+
+    // First fit: a free record is taken whole, or split if the rest can hold a free header
+    int offset = KEY_TABLE_OFFSET, free_size = 0, index = 0;
+
+    for (; offset < table_end; offset += key_record_size(offset)) {
+        if (!(key_table_read(offset + KEY_TYPE_OFFSET) & KEY_FREE)) {
+            index++;
+            continue;
+        }
+
+        free_size = key_record_size(offset);
+        if ((free_size == size || free_size >= size + KEY_OFFSET) &&
+            !journal_staged(offset + KEY_TYPE_OFFSET) && !journal_staged(offset + KEY_LEN_OFFSET))
+            break;
+    }
+
+    if (offset >= table_end) {
+        if (stable_end + size > KEY_TABLE_LIMIT) {
+            #if DEBUG
+            Serial.println(F("Key table is full!"));
+            #endif
+
+            journal_commit();
+            return false;
+        }
+
+        if (stable_end != table_end)
+            write_free_record(table_end, stable_end - table_end);
+
+        offset = stable_end;
+        free_size = size;
+        key_table_write_int(KEY_TABLE_END_OFFSET, stable_end + size);
+    }
+
+    // Nothing points at the body yet, so it doesn't need the journal
+    for (byte i = 0; i < payload_len; i++)
+        EEPROM.updateByte(offset + KEY_OFFSET + i, key_data_byte(i));
+
+    encode_key_name(buffer, offset + KEY_OFFSET + payload_len);
+
+    if (free_size != size)
+        write_free_record(offset + size, free_size - size);
+
+    key_table_write(offset + KEY_LEN_OFFSET, name_len);
+    key_table_write(offset + KEY_TYPE_OFFSET, global_key.key_type);
+    key_table_write_int(KEY_COUNT_OFFSET, cur_n_keys + 1);
+    quick_key_shift(index, 1);
+
+    if (!journal_commit())
+        return false;
+
+    global_key.key_index = index;
+    name_cache_invalidate(index);
+
+    name_order_shift(index, 1);
+    if (journal_depth)
+        name_order_stale = true;    // the table isn't in EEPROM yet, names can't be compared
+    else if (!name_order_stale)
+        name_order_place(index);
+
+    if (index < MAX_FINGERPRINTS) {
+        byte n_moved = min(cur_n_keys, MAX_FINGERPRINTS - 1) - index;
+        memmove(key_fingerprints + index + 1, key_fingerprints + index, n_moved);
+        key_fingerprints[index] = key_fingerprint(global_key);
+    }
+
+    return true;
+}
+
+void delete_key(int index) {
+    if (!journal_depth && !battery_allows_writes())
+        return;
+
+    name_cache_invalidate(index);
+
+    journal_begin();
+
+    int table_end = key_table_read_int(KEY_TABLE_END_OFFSET);
+    int offset = KEY_TABLE_OFFSET, prev_free = -1;
+
+    for (int i = 0; offset < table_end; offset += key_record_size(offset)) {
+        if (key_table_read(offset + KEY_TYPE_OFFSET) & KEY_FREE) {
+            prev_free = offset;
+        } else if (i++ == index) {
+            break;
+        } else {
+            prev_free = -1;
+        }
+    }
+
+    if (offset >= table_end) {
+        journal_commit();
+        return;
+    }
+
+    int n_keys = key_table_read_int(KEY_COUNT_OFFSET);
+
+    name_order_shift(index, -1);
+    quick_key_shift(index, -1);
+    if (n_keys > MAX_FINGERPRINTS)
+        name_order_stale = true;    // key MAX_FINGERPRINTS moves into the indexed range
+
+    if (index < MAX_FINGERPRINTS) {
+        memmove(key_fingerprints + index, key_fingerprints + index + 1, min(n_keys, MAX_FINGERPRINTS) - index - 1);
+
+        if (n_keys > MAX_FINGERPRINTS)
+            key_fingerprints[MAX_FINGERPRINTS - 1] = key_fingerprint(get_key_by_index(MAX_FINGERPRINTS));
+    }
+
+    int size = key_record_size(offset);
+    int next = offset + size;
+
+    if (next < table_end && (key_table_read(next + KEY_TYPE_OFFSET) & KEY_FREE))
+        size += key_record_size(next);
+
+    if (prev_free != -1) {
+        size += offset - prev_free;
+        offset = prev_free;
+    }
+
+    key_table_write_int(KEY_COUNT_OFFSET, n_keys - 1);
+
+    if (offset + size >= table_end)
+        key_table_write_int(KEY_TABLE_END_OFFSET, offset);
+    else
+        write_free_record(offset, size);
+
+    journal_commit();
+}
+
+Key get_key_by_index(int index) {
+    int offset = get_key_offset(index);
+
+    Key key = (struct Key){0, index, key_table_read(offset + KEY_TYPE_OFFSET)};
+    byte payload_len = record_payload_len(offset);
+
+    if (key.key_type == KEY_TYPE_RAW) {
+        uint8_t trace[RAW_TRACE_SIZE];
+
+        for (byte i = 0; i < payload_len && i < RAW_TRACE_SIZE; i++)
+            trace[i] = key_table_read(offset + KEY_OFFSET + i);
+
+        key.cur_key = raw_trace_summary(trace);
+        return key;
+    }
+
+    // A memory key stands for its ROM, the image follows it
+    if (key.key_type == KEY_TYPE_DS1992) {
+        offset += MEMORY_ROM_OFFSET;
+        payload_len = sizeof(key.cur_key);
+    }
+
+    for (byte i = 0; i < payload_len && i < sizeof(key.cur_key); i++)
+        ((uint8_t *)&key.cur_key)[i] = key_table_read(offset + KEY_OFFSET + i);
+
+    return key;
+}
+
+// Offsets it gives during a move are the ones the keys get once it is done, see key_table_address
+int get_key_offset(int index) {
+    int table_end = EEPROM.readInt(KEY_TABLE_END_OFFSET);
+    int offset = KEY_TABLE_OFFSET;
+    int moving = compaction_active ? EEPROM.readInt(KEY_COMPACT_DST_OFFSET) : -1;
+
+    while (offset < table_end) {
+        if (!(key_table_read(offset + KEY_TYPE_OFFSET) & KEY_FREE) && index-- == 0)
+            break;
+
+        // The hole behind the record being moved is still spread over its source
+        if (offset == moving)
+            offset = EEPROM.readInt(KEY_COMPACT_SRC_OFFSET) + EEPROM.readInt(KEY_COMPACT_LEN_OFFSET);
+        else
+            offset += key_record_size(offset);
+    }
+
+    return offset;
+}
+
+void update_key_by_index(Key key) {
+    if (!battery_allows_writes())
+        return;
+
+    int offset = get_key_offset(key.key_index);
+
+    journal_begin();
+    write_key(offset, key);
+    journal_commit();
+}
+
+// Raw keys are matched by their summary, so an update leaves the trace as it is
+void write_key(int offset, Key key) {
+    byte payload_len = key_payload_len(key.key_type);
+
+    for (byte i = 0; i < payload_len && i < sizeof(key.cur_key); i++)
+        key_table_write(offset + KEY_OFFSET + i, ((uint8_t *)&key.cur_key)[i]);
+
+    key_table_write(offset + KEY_TYPE_OFFSET, key.key_type);
+}
+
+/*
+ * CRC8 of the type and what stands for the key in cur_key: up to 7
+ * payload bytes, the ROM of a memory key, the summary of a raw trace.
+ * The ROM CRC is left out, a CRC over data ending with its own CRC is
+ * always 0.
+ */
+byte key_fingerprint(Key key) {
+    byte payload[sizeof(key.cur_key) + 1];
+    byte payload_len = key_payload_len(key.key_type);
+
+    if (key.key_type == KEY_TYPE_RAW)
+        payload_len = sizeof(key.cur_key);
+    else if (payload_len == KEY_PAYLOAD_VARIABLE || payload_len >= sizeof(key.cur_key))
+        payload_len = sizeof(key.cur_key) - 1;
+
+    payload[0] = key.key_type;
+    memcpy(payload + 1, &key.cur_key, payload_len);
+
+    return ibutton.crc8(payload, payload_len + 1);
+}
+
+/*
+ * CRC16 of a key as L lists it: type, payload and the unpacked name,
+ * so the PC gets the same one from a key file without knowing how
+ * names are packed.
+ */
+uint16_t key_record_hash(int index) {
+    int offset = get_key_offset(index);
+    byte type = key_table_read(offset + KEY_TYPE_OFFSET);
+    byte payload_len = record_payload_len(offset);
+    uint16_t crc = ibutton.crc16(&type, 1);
+
+    for (byte i = 0; i < payload_len; i++) {
+        byte value = key_table_read(offset + KEY_OFFSET + i);
+        crc = ibutton.crc16(&value, 1, crc);
+    }
+
+    char name[KEY_NAME_LEN + 1];
+    byte name_len = read_key_name(offset, name);
+
+    return ibutton.crc16((uint8_t *)name, name_len, crc);
+}
+
+void build_key_fingerprints() {
+    int n_keys = min(EEPROM.readInt(KEY_COUNT_OFFSET), MAX_FINGERPRINTS);
+
+    for (int i = 0; i < n_keys; i++)
+        key_fingerprints[i] = key_fingerprint(get_key_by_index(i));
+}
+
+/*
+ * name_order keeps the first MAX_FINGERPRINTS keys sorted by name,
+ * ignoring case. Saving and deleting a key shift the indices and
+ * place the new one with a binary search, everything else, like a
+ * save inside a bigger transaction or a key moving into the indexed
+ * range, marks it stale and it gets rebuilt when the search opens.
+ */
+void build_name_order() {
+    byte n_keys = min(EEPROM.readInt(KEY_COUNT_OFFSET), MAX_FINGERPRINTS);
+
+    name_order_len = 0;
+    for (byte i = 0; i < n_keys; i++)
+        name_order_place(i);
+
+    name_order_stale = false;
+}
+
+// Renumbers indices from index on by delta, dropping index itself when deleting
+void name_order_shift(byte index, int delta) {
+    byte j = 0;
+
+    for (byte i = 0; i < name_order_len; i++) {
+        byte cur = name_order[i];
+
+        if (cur == index && delta < 0)
+            continue;
+
+        if (cur >= index)
+            cur += delta;
+
+        if (cur < MAX_FINGERPRINTS)
+            name_order[j++] = cur;
+    }
+
+    name_order_len = j;
+}
+
+void name_order_place(byte index) {
+    if (index >= MAX_FINGERPRINTS || name_order_len == MAX_FINGERPRINTS)
+        return;
+
+    char name[KEY_NAME_LEN + 1];
+    read_key_name(get_key_offset(index), name);
+
+    byte pos = name_order_bound(name, KEY_NAME_LEN, 0, name_order_len, true);
+    memmove(name_order + pos + 1, name_order + pos, name_order_len - pos);
+    name_order[pos] = index;
+    name_order_len++;
+}
+
+/*
+ * First position in [lo, hi) of name_order whose name is not below
+ * (upper: is above) prefix, comparing len characters. Takes a name
+ * read for every halving.
+ */
+byte name_order_bound(const char *prefix, byte len, byte lo, byte hi, bool upper) {
+    char name[KEY_NAME_LEN + 1];
+
+    while (lo < hi) {
+        byte mid = (lo + hi) / 2;
+        read_key_name(get_key_offset(name_order[mid]), name);
+
+        int cmp = strncasecmp(name, prefix, len);
+
+        if (cmp < 0 || (upper && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Returns index of a stored key with the same type and payload or -1
+int find_key(Key key) {
+    int n_keys = EEPROM.readInt(KEY_COUNT_OFFSET);
+    byte fingerprint = key_fingerprint(key);
+
+    for (int i = 0; i < n_keys; i++) {
+        if (i < MAX_FINGERPRINTS && key_fingerprints[i] != fingerprint)
+            continue;
+
+        Key stored = get_key_by_index(i);
+        if (stored.key_type == key.key_type && stored.cur_key == key.cur_key)
+            return i;
+    }
+
+    return -1;
+}
+
+// Renames a key to the name in buffer: a new copy gets saved and the old one deleted in one transaction
+bool rename_key(int index) {
+    if (!battery_allows_writes())
+        return false;
+
+    global_key = get_key_by_index(index);
+    byte quick = EEPROM.readByte(KEY_QUICK_OFFSET);
+
+    // The old record stays as it is until the commit, so the image is copied from there
+    if (global_key.key_type == KEY_TYPE_DS1992)
+        memory_source = get_key_offset(index) + KEY_OFFSET;
+    else if (key_payload_len(global_key.key_type) == KEY_PAYLOAD_VARIABLE)
+        load_raw_trace(index);
+
+    journal_begin();
+    delete_key(index);
+    bool saved = save_key(true);
+
+    // Without the new copy the old one has to stay
+    if (!saved)
+        journal_failed = true;
+
+    // Deleting the old copy dropped it as the quick key, the new one is still only staged
+    if (saved && quick != QUICK_KEY_NONE && (quick & QUICK_KEY_INDEX_MASK) == index) {
+        key_table_write(KEY_QUICK_FINGERPRINT_OFFSET, key_fingerprint(global_key));
+        key_table_write(KEY_QUICK_OFFSET, global_key.key_index | (quick & QUICK_KEY_ALWAYS));
+    }
+
+    journal_commit();
+
+    memory_source = -1;
+    return saved;
+}
+
+/*
+ * Power-on fast path: with the middle button held, or on every power-on
+ * with QUICK_KEY_ALWAYS, the quick key gets emulated before the display,
+ * the battery and the menus are set up, which happens once a button
+ * ends emulation. A reset from the serial port (external) doesn't count
+ * as power-on, so a host can always get through.
+ *
+ * The table is only trusted as it stands, without a journal to replay
+ * or a compaction to finish, and the key has to match the fingerprint
+ * saved along with its index. Both go through the journal with the
+ * table, the fingerprint still catches a table written by firmware
+ * which didn't keep them.
+ */
+void quick_emulate(byte reset_cause) {
+    byte quick = EEPROM.readByte(KEY_QUICK_OFFSET);
+    byte index = quick & QUICK_KEY_INDEX_MASK;
+    bool held = !digitalRead(MIDDLE_BUTTON_PIN);
+    bool power_on = reset_cause & (_BV(PORF) | _BV(BORF));
+
+    if (quick == QUICK_KEY_NONE || !(held || (power_on && (quick & QUICK_KEY_ALWAYS))))
+        return;
+
+    if (EEPROM.readByte(KEY_MAGIC_OFFSET) != KEY_MAGIC || EEPROM.readByte(KEY_VERSION_OFFSET) != KEY_FORMAT_VERSION ||
+        EEPROM.readByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET) == JOURNAL_COMMITTED ||
+        EEPROM.readByte(KEY_COMPACT_ACTIVE_OFFSET) == KEY_MAGIC || index >= EEPROM.readInt(KEY_COUNT_OFFSET))
+        return;
+
+    Key key = get_key_by_index(index);
+    byte fingerprint = key_fingerprint(key);
+
+    if (fingerprint != EEPROM.readByte(KEY_QUICK_FINGERPRINT_OFFSET))
+        return;
+
+    // Holding the button on shouldn't end emulation right away
+    if (held) {
+        buttons[MIDDLE_BUTTON_INDEX].pressed = true;
+        buttons[MIDDLE_BUTTON_INDEX].executed = true;
+    }
+
+    global_key = key;
+    log_event(EVENT_EMULATE, fingerprint);
+    emulate_key(global_key.cur_key);
+
+    // Nor should the press which ended it act on the menu
+    for (byte i = 0; i < 3; i++) {
+        if (check_button(i))
+            buttons[i].executed = true;
+    }
+}
+
+bool set_quick_key(int index, bool always) {
+    journal_begin();
+
+    if (index == -1) {
+        key_table_write(KEY_QUICK_OFFSET, QUICK_KEY_NONE);
+    } else {
+        key_table_write(KEY_QUICK_FINGERPRINT_OFFSET, key_fingerprint(get_key_by_index(index)));
+        key_table_write(KEY_QUICK_OFFSET, index | (always ? QUICK_KEY_ALWAYS : 0));
+    }
+
+    return journal_commit();
+}
+
+// Keeps the quick key on the same key while keys in front of it come and go, in the same transaction
+void quick_key_shift(int index, int delta) {
+    byte quick = key_table_read(KEY_QUICK_OFFSET);
+    int quick_index = quick & QUICK_KEY_INDEX_MASK;
+
+    if (quick == QUICK_KEY_NONE || quick_index < index)
+        return;
+
+    if ((delta < 0 && quick_index == index) || quick_index + delta >= QUICK_KEY_INDEX_MASK)
+        quick = QUICK_KEY_NONE;
+    else
+        quick += delta;
+
+    key_table_write(KEY_QUICK_OFFSET, quick);
+}
+
+byte key_table_read(int address) {
+    for (byte i = 0; i < journal_len; i++) {
+        if (journal[i].address == address)
+            return journal[i].value;
+    }
+
+    return EEPROM.readByte(key_table_address(address));
+}
+
+/*
+ * Midway through a move the record reads as if it were at compact_dst
+ * already: the chunks copied so far from there, the rest from the
+ * source. So nothing needs to wait for a move to be finished to read
+ * the table, only writes do.
+ */
+int key_table_address(int address) {
+    if (!compaction_active)
+        return address;
+
+    int dst = EEPROM.readInt(KEY_COMPACT_DST_OFFSET);
+    int src = EEPROM.readInt(KEY_COMPACT_SRC_OFFSET);
+
+    if (address < dst || address >= dst + EEPROM.readInt(KEY_COMPACT_LEN_OFFSET))
+        return address;
+
+    int copied = EEPROM.readByte(KEY_COMPACT_DONE_OFFSET) * min(COMPACT_CHUNK, src - dst);
+
+    return address - dst < copied ? address : address + src - dst;
+}
+
+int key_table_read_int(int address) {
+    return key_table_read(address) | (key_table_read(address + 1) << 8);
+}
+
+/*
+ * Outside of a transaction writes go straight to EEPROM. Inside one
+ * they are staged, repeated writes to the same byte are merged and
+ * bytes which already hold the value are dropped. A write the journal
+ * has no room for fails the whole transaction.
+ */
+void key_table_write(int address, byte value) {
+    if (!journal_depth) {
+        EEPROM.updateByte(address, value);
+        return;
+    }
+
+    for (byte i = 0; i < journal_len; i++) {
+        if (journal[i].address == address) {
+            journal[i].value = value;
+            return;
+        }
+    }
+
+    if (EEPROM.readByte(address) == value)
+        return;
+
+    if (journal_len == MAX_JOURNAL_ENTRIES) {
+        #if DEBUG
+        Serial.println(F("Journal is full!"));
+        #endif
+
+        journal_failed = true;
+        return;
+    }
+
+    journal[journal_len++] = (struct JournalEntry){address, value};
+}
+
+void key_table_write_int(int address, int value) {
+    key_table_write(address, value & 0xFF);
+    key_table_write(address + 1, value >> 8);
+}
+
+bool journal_staged(int address) {
+    for (byte i = 0; i < journal_len; i++) {
+        if (journal[i].address == address)
+            return true;
+    }
+
+    return false;
+}
+
+// Transactions nest, only the outermost commit writes anything
+void journal_begin() {
+    // A move left halfway by a low battery fails the transaction, its commit writes nothing
+    if (!journal_depth) {
+        journal_len = 0;
+        journal_failed = !finish_key_compaction();
+    }
+
+    journal_depth++;
+}
+
+/*
+ * Returns false once the transaction failed, as when a write didn't
+ * fit. The outermost commit then drops everything staged, so EEPROM
+ * keeps the table as it was before the transaction, and the RAM
+ * indices which followed it get rebuilt.
+ */
+bool journal_commit() {
+    if (--journal_depth)
+        return !journal_failed;
+
+    if (journal_failed) {
+        journal_len = 0;
+        journal_failed = false;
+
+        build_key_fingerprints();
+        name_order_stale = true;
+        name_cache_invalidate(0);
+
+        return false;
+    }
+
+    if (!journal_len)
+        return true;
+
+    byte crc = journal_crc();
+
+    for (byte i = 0; i < journal_len; i++) {
+        int entry = JOURNAL_OFFSET + JOURNAL_ENTRIES_OFFSET + i * JOURNAL_ENTRY_SIZE;
+        EEPROM.updateInt(entry, journal[i].address);
+        EEPROM.updateByte(entry + 2, journal[i].value);
+    }
+
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_LEN_OFFSET, journal_len);
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_CRC_OFFSET, crc);
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET, JOURNAL_COMMITTED);
+
+    for (byte i = 0; i < journal_len; i++)
+        EEPROM.updateByte(journal[i].address, journal[i].value);
+
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET, 0);
+    journal_len = 0;
+
+    return true;
+}
+
+// CRC8 of the entries as they are laid out in EEPROM, whatever padding JournalEntry gets
+byte journal_crc() {
+    uint8_t entries[MAX_JOURNAL_ENTRIES * JOURNAL_ENTRY_SIZE];
+
+    for (byte i = 0; i < journal_len; i++) {
+        entries[i * JOURNAL_ENTRY_SIZE] = journal[i].address & 0xFF;
+        entries[i * JOURNAL_ENTRY_SIZE + 1] = journal[i].address >> 8;
+        entries[i * JOURNAL_ENTRY_SIZE + 2] = journal[i].value;
+    }
+
+    return ibutton.crc8(entries, journal_len * JOURNAL_ENTRY_SIZE);
+}
+
+void journal_recover() {
+    if (EEPROM.readByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET) != JOURNAL_COMMITTED)
+        return;
+
+    journal_len = EEPROM.readByte(JOURNAL_OFFSET + JOURNAL_LEN_OFFSET);
+
+    if (journal_len <= MAX_JOURNAL_ENTRIES) {
+        for (byte i = 0; i < journal_len; i++) {
+            int entry = JOURNAL_OFFSET + JOURNAL_ENTRIES_OFFSET + i * JOURNAL_ENTRY_SIZE;
+            journal[i].address = EEPROM.readInt(entry);
+            journal[i].value = EEPROM.readByte(entry + 2);
+        }
+
+        if (journal_crc() == EEPROM.readByte(JOURNAL_OFFSET + JOURNAL_CRC_OFFSET)) {
+            #if DEBUG
+            Serial.println(F("Replaying journal"));
+            #endif
+
+            for (byte i = 0; i < journal_len; i++)
+                EEPROM.updateByte(journal[i].address, journal[i].value);
+        }
+    }
+
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET, 0);
+    journal_len = 0;
+}
+
+/*
+ * Does one step of compaction: picks the record to move, copies a
+ * chunk of it or puts the hole behind the moved record. Returns
+ * false when there are no holes left, or when the battery is too
+ * low to write: the filtered level is checked before anything else
+ * and a fresh sample right before writing, like every other write.
+ */
+bool compact_key_table_step() {
+    if (power_level == POWER_CRITICAL)
+        return false;
+
+    int table_end = EEPROM.readInt(KEY_TABLE_END_OFFSET);
+
+    if (!compaction_active) {
+        int offset = KEY_TABLE_OFFSET;
+
+        for (; offset < table_end; offset += key_record_size(offset)) {
+            if (EEPROM.readByte(offset + KEY_TYPE_OFFSET) & KEY_FREE)
+                break;
+        }
+
+        if (offset >= table_end)
+            return false;
+
+        // delete_key merges holes and cuts them off the end, so a live record follows
+        int src = offset + key_record_size(offset);
+
+        if (!battery_allows_writes())
+            return false;
+
+        EEPROM.updateByte(KEY_COMPACT_DONE_OFFSET, 0);
+        EEPROM.updateInt(KEY_COMPACT_LEN_OFFSET, key_record_size(src));
+        EEPROM.updateInt(KEY_COMPACT_SRC_OFFSET, src);
+        EEPROM.updateInt(KEY_COMPACT_DST_OFFSET, offset);
+        EEPROM.updateByte(KEY_COMPACT_ACTIVE_OFFSET, KEY_MAGIC);
+        compaction_active = true;
+
+        return true;
+    }
+
+    if (!battery_allows_writes())
+        return false;
+
+    int dst = EEPROM.readInt(KEY_COMPACT_DST_OFFSET);
+    int src = EEPROM.readInt(KEY_COMPACT_SRC_OFFSET);
+    int len = EEPROM.readInt(KEY_COMPACT_LEN_OFFSET);
+
+    // Chunk size stays the same for the whole move, so progress fits a byte
+    int chunk = min(COMPACT_CHUNK, src - dst);
+    byte n_chunks = EEPROM.readByte(KEY_COMPACT_DONE_OFFSET);
+    int done = n_chunks * chunk;
+
+    if (done < len) {
+        for (int i = done; i < done + chunk && i < len; i++)
+            EEPROM.updateByte(dst + i, EEPROM.readByte(src + i));
+
+        EEPROM.updateByte(KEY_COMPACT_DONE_OFFSET, n_chunks + 1);
+        return true;
+    }
+
+    // Bytes behind the hole are untouched by the move, so this part can be repeated after reset
+    int hole = src - dst, next = src + len;
+
+    if (next < table_end && (EEPROM.readByte(next + KEY_TYPE_OFFSET) & KEY_FREE)) {
+        hole += key_record_size(next);
+        next += key_record_size(next);
+    }
+
+    if (next >= table_end)
+        EEPROM.updateInt(KEY_TABLE_END_OFFSET, dst + len);
+    else
+        write_free_record(dst + len, hole);
+
+    EEPROM.updateByte(KEY_COMPACT_ACTIVE_OFFSET, 0);
+    compaction_active = false;
+
+    return true;
+}
+
+// Writes can't go into the table in the middle of a move, so it gets finished first. False if the battery stops it
+bool finish_key_compaction() {
+    while (compaction_active) {
+        if (!compact_key_table_step())
+            return false;
+    }
+
+    return true;
+}
+
+void format_key_table() {
+    if (!battery_allows_writes())
+        return;
+
+    name_cache_invalidate(0);
+    name_order_len = 0;
+
+    compaction_active = false;
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET, 0);
+    EEPROM.updateByte(KEY_COMPACT_ACTIVE_OFFSET, 0);
+    EEPROM.updateByte(KEY_QUICK_OFFSET, QUICK_KEY_NONE);
+    EEPROM.updateInt(KEY_COUNT_OFFSET, 0);
+    EEPROM.updateInt(KEY_TABLE_END_OFFSET, KEY_TABLE_OFFSET);
+    EEPROM.updateByte(KEY_VERSION_OFFSET, KEY_FORMAT_VERSION);
+    EEPROM.updateByte(KEY_MAGIC_OFFSET, KEY_MAGIC);
+}
+
+void init_key_table(uint8_t *scratch) {
+    if (EEPROM.readByte(KEY_MAGIC_OFFSET) != KEY_MAGIC || EEPROM.readByte(KEY_VERSION_OFFSET) != KEY_FORMAT_VERSION) {
+        #if DEBUG
+        Serial.println(F("Migrating key table"));
+        #endif
+
+        migrate_key_table(scratch);
+        return;
+    }
+
+    journal_recover();
+
+    int dst = EEPROM.readInt(KEY_COMPACT_DST_OFFSET), src = EEPROM.readInt(KEY_COMPACT_SRC_OFFSET);
+
+    // A cursor which makes no sense is left alone rather than trusted
+    compaction_active = EEPROM.readByte(KEY_COMPACT_ACTIVE_OFFSET) == KEY_MAGIC &&
+                        dst >= KEY_TABLE_OFFSET && dst < src && src < EEPROM.readInt(KEY_TABLE_END_OFFSET);
+
+    if (compaction_active) {
+        #if DEBUG
+        Serial.println(F("Finishing interrupted compaction"));
+        #endif
+
+        finish_key_compaction();
+    }
+}
+
+/*
+ * Converts the table of the original firmware: fixed 41-byte slots
+ * of DS1990 keys, the only type it had, with runs of free slots
+ * marked in the type byte. It is copied into scratch (screen buffer
+ * is big enough to hold the whole EEPROM) first, as new records may
+ * start further and overlap old ones which are not read yet. No key
+ * gets left behind: room for every key without a name is put aside
+ * first, and names get cut when what's left can't hold them whole.
+ */
+void migrate_key_table(uint8_t *scratch) {
+    for (int i = 0; i <= E2END; i++)
+        scratch[i] = EEPROM.readByte(i);
+
+    int n_keys = scratch[KEY_COUNT_OFFSET] | (scratch[KEY_COUNT_OFFSET + 1] << 8);
+    int offset = KEY_TABLE_OFFSET, n_migrated = 0, slot = -1;
+
+    // Blank EEPROM or something which is not a key table at all ends up empty
+    if (n_keys < 0 || n_keys > (E2END + 1 - OLD_KEY_TABLE_OFFSET) / OLD_KEY_SIZE)
+        n_keys = 0;
+
+    int reserve = n_keys * (KEY_OFFSET + key_payload_len(KEY_TYPE_DS1990));
+
+    for (; n_migrated < n_keys && (slot = old_key_slot(scratch, slot + 1)) != -1; n_migrated++) {
+        uint8_t *old_key = scratch + OLD_KEY_TABLE_OFFSET + slot * OLD_KEY_SIZE;
+
+        reserve -= KEY_OFFSET + key_payload_len(KEY_TYPE_DS1990);
+        offset = migrate_key(offset, KEY_TYPE_DS1990, old_key + OLD_KEY_OFFSET, (char *)old_key + OLD_KEY_NAME_OFFSET,
+                             strnlen((char *)old_key + OLD_KEY_NAME_OFFSET, KEY_NAME_LEN), KEY_TABLE_LIMIT - reserve);
+    }
+
+    compaction_active = false;
+    EEPROM.updateByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET, 0);
+    EEPROM.updateByte(KEY_COMPACT_ACTIVE_OFFSET, 0);
+    EEPROM.updateByte(KEY_QUICK_OFFSET, QUICK_KEY_NONE);
+
+    EEPROM.updateInt(KEY_COUNT_OFFSET, n_migrated);
+    EEPROM.updateInt(KEY_TABLE_END_OFFSET, offset);
+    EEPROM.updateByte(KEY_VERSION_OFFSET, KEY_FORMAT_VERSION);
+    EEPROM.updateByte(KEY_MAGIC_OFFSET, KEY_MAGIC);
+
+    memset(scratch, 0, E2END + 1);
+}
+
+// First slot from slot on holding a key in an old table, -1 past its end
+int old_key_slot(const uint8_t *scratch, int slot) {
+    while (OLD_KEY_TABLE_OFFSET + (slot + 1) * OLD_KEY_SIZE <= E2END + 1) {
+        byte type = scratch[OLD_KEY_TABLE_OFFSET + slot * OLD_KEY_SIZE + KEY_TYPE_OFFSET];
+
+        if (!(type & KEY_FREE))
+            return slot;
+
+        slot += (type & ~KEY_FREE) ? (type & ~KEY_FREE) : 1;
+    }
+
+    return -1;
+}
+
+// Returns offset past the written key, its name cut so that it ends by limit
+int migrate_key(int offset, byte type, const uint8_t *key, const char *name, byte name_len, int limit) {
+    byte payload_len = key_payload_len(type);
+
+    memcpy(buffer, name, name_len);
+    buffer[name_len] = '\0';
+
+    byte packed_len = encode_key_name(buffer);
+
+    while (packed_len && offset + KEY_OFFSET + payload_len + packed_len > limit) {
+        buffer[--name_len] = '\0';
+        packed_len = encode_key_name(buffer);
+    }
+
+    #if DEBUG
+    if (name_len < strnlen(name, KEY_NAME_LEN)) {
+        Serial.print(F("Name cut to fit: "));
+        Serial.println(buffer);
+    }
+    #endif
+
+    for (byte i = 0; i < payload_len; i++)
+        EEPROM.updateByte(offset + KEY_OFFSET + i, key[i]);
+
+    encode_key_name(buffer, offset + KEY_OFFSET + payload_len);
+    EEPROM.updateByte(offset + KEY_LEN_OFFSET, packed_len);
+    EEPROM.updateByte(offset + KEY_TYPE_OFFSET, type);
+
+    return offset + KEY_OFFSET + payload_len + packed_len;
+}
+
+/*
+ * A reset doubles as a cheap presence probe: it takes about a
+ * millisecond and nothing else happens until a device answers it.
+ * Then READ_VOTES Read ROMs are taken back to back and every bit of
+ * the ID goes by majority, so a contact bouncing during one of them
+ * doesn't spoil the result. A bad CRC of the voted ID gets another
+ * READ_ATTEMPTS - 1 tries before it is reported.
+ */
+byte read_ds1990(uint64_t *key) {
+    if (!ibutton.reset())
+        return 1;
+
+    #if DEBUG
+    Serial.println(F("Reading key..."));
+    #endif
+
+    for (byte attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        if (!read_rom_voted((uint8_t *)key)) {
+            #if DEBUG
+            Serial.println(F("Device is gone!"));
+            #endif
+
+            return 1;
+        }
+
+        #if DEBUG
+        Serial.print(F("Read key "));
+        for (byte i = 0; i < 8; i++) {
+            if (((uint8_t *)key)[i] / 16 == 0)
+                Serial.print(0);
+            Serial.print(((uint8_t *)key)[i], HEX);
+            Serial.print(' ');
+        }
+        Serial.println();
+        #endif
+
+        if (ibutton.crc8((uint8_t *)key, 7) == ((uint8_t *)key)[7])
+            break;
+
+        #if DEBUG
+        Serial.print(F("Incorrect CRC!\nCorrect CRC:"));
+        Serial.println(ibutton.crc8((uint8_t *)key, 7), HEX);
+        #endif
+
+        if (attempt == READ_ATTEMPTS - 1)
+            return 3;
+
+        if (!ibutton.reset())
+            return 1;
+    }
+
+    if (((uint8_t *)key)[0] != 0x01) {
+        #if DEBUG
+        Serial.println(F("Device is not iButton!"));
+        Serial.println();
+        #endif
+
+        return 2;
+    }
+
+    return 0;
+}
+
+// Expects the bus to be just reset
+bool read_rom_voted(uint8_t *rom) {
+    uint8_t votes[READ_VOTES][8];
+
+    // Keys taking Overdrive Skip ROM answer an overdrive reset, the rest wait for a standard one
+    ow_write_byte<StandardSpeed>(0x3C);
+    bool overdrive = ow_reset<OverdriveSpeed>();
+
+    for (byte i = 0; i < READ_VOTES; i++) {
+        if (overdrive) {
+            if (i != 0 && !ow_reset<OverdriveSpeed>())
+                return false;
+
+            ow_write_byte<OverdriveSpeed>(0x33);
+            ow_read_bytes<OverdriveSpeed>(votes[i], 8);
+        } else {
+            if (!ibutton.reset())
+                return false;
+
+            ibutton.write(0x33);
+            ibutton.read_bytes(votes[i], 8);
+        }
+    }
+
+    if (overdrive)
+        ow_reset<StandardSpeed>();      // back to standard speed
+
+    for (byte i = 0; i < 8; i++) {
+        rom[i] = 0;
+
+        for (byte j = 0; j < 8; j++) {
+            byte ones = 0;
+            for (byte k = 0; k < READ_VOTES; k++)
+                ones += (votes[k][i] >> j) & 1;
+
+            if (ones > READ_VOTES / 2)
+                rom[i] |= 1 << j;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Runs Search ROM over the whole bus, so every device touching the
+ * pad gets listed at once, not only the one Read ROM happens to win.
+ */
+void search_keys() {
+    uint8_t rom[8];
+
+    n_found_keys = 0;
+    ibutton.reset_search();
+
+    while (n_found_keys < MAX_FOUND_KEYS && ibutton.search(rom)) {
+        if (ibutton.crc8(rom, 7) != rom[7])
+            continue;
+
+        memcpy(&found_keys[n_found_keys++], rom, 8);
+    }
+
+    #if DEBUG
+    Serial.print(F("Found devices: "));
+    Serial.println(n_found_keys);
+    #endif
+}
+
+void save_found_keys() {
+    for (byte i = 0; i < n_found_keys; i++) {
+        global_key.cur_key = found_keys[i];
+        global_key.key_index = -1;
+        global_key.key_type = 0;
+
+        if (find_key(global_key) != -1)
+            continue;
+
+        if (!save_key())
+            break;
+    }
+}
+
+byte copy_ds1990(uint64_t new_key, Adafruit_SSD1306 *display) {
+    if (read_vcc() < BATTERY_COPY_MV) {
+        #if DEBUG
+        Serial.println(F("Battery too low to copy"));
+        #endif
+
+        return 3;
+    }
+
+    if(!ibutton.reset()) {
+        #if DEBUG
+        Serial.println(F("No available devices!"));
+        #endif
+
+        return 1;
+    }
+
+    ibutton.write(0x33);
+    delay(1);
+
+    uint64_t prev_key;
+    ibutton.read_bytes((uint8_t *)&prev_key, 8);
+
+    #if DEBUG
+    for (byte i = 0; i < 8; i++) {
+        if (((uint8_t *)&prev_key)[i] / 16 == 0)
+            Serial.print(0);
+        Serial.print(((uint8_t *)&prev_key)[i], HEX);
+        Serial.print(' ');
+    }
+    Serial.println();
+
+    if (((uint8_t *)&prev_key)[0] != 0x01) {
+        Serial.println(F("Device signature is not iButton!"));
+    }
+    
+    if (ibutton.crc8((uint8_t *)&prev_key, 7) != ((uint8_t *)&prev_key)[7]) {
+        Serial.print(F("Incorrect CRC! Correct CRC:"));
+        Serial.println(ibutton.crc8((uint8_t *)&prev_key, 7), HEX);
     }
     
     
@@ -1198,113 +4756,971 @@ byte copy_ds1990(uint64_t new_key, Adafruit_SSD1306 *display) {
         Serial.print(((uint8_t *)&new_key)[i], HEX);
         Serial.print(' ');
     }
-    Serial.println();
-    #endif
+    Serial.println();
+    #endif
+
+    if (display != NULL) {
+        display->fillRect(display->width() / 2 - FONT_SIZE * FONT_WIDTH * 4, display->height() / 2, FONT_SIZE * FONT_WIDTH * 8, FONT_SIZE * FONT_HEIGHT, BLACK);
+        display_flush();
+        display->setTextColor(WHITE);
+        display->setTextSize(FONT_SIZE);
+        display->setCursor(display->width() / 2 - FONT_SIZE * FONT_WIDTH * 4, display->height() / 2);
+    }
+    
+    ibutton.skip();
+    ibutton.reset();
+    ibutton.write(0xD1);
+    digitalWrite(KEY_PIN, LOW); pinMode(KEY_PIN, OUTPUT); delayMicroseconds(60);
+    pinMode(KEY_PIN, INPUT); digitalWrite(KEY_PIN, HIGH); flush_delay(10);
+                        
+    ibutton.skip();
+    ibutton.reset();
+    ibutton.write(0xD5);
+    
+    for (byte i = 0; i < 7; i++){
+        writeByte(((uint8_t *)&new_key)[i], KEY_PIN);
+
+        #if DEBUG
+        Serial.print(F("*"));
+        #endif
+
+        if (display != NULL) {
+            display->print(F("*"));
+            display_flush();
+        }
+    }
+    
+    writeByte(ibutton.crc8((uint8_t *)&new_key, 7), KEY_PIN);
+
+    #if DEBUG
+    Serial.println(F("*"));
+    #endif
+
+    if (display != NULL) {
+        display->print(F("*"));
+        display_flush();
+    }
+    
+    ibutton.reset();
+    ibutton.write(0xD1);
+    digitalWrite(KEY_PIN, LOW); pinMode(KEY_PIN, OUTPUT); delayMicroseconds(10);
+    pinMode(KEY_PIN, INPUT); digitalWrite(KEY_PIN, HIGH); flush_delay(10);
+
+    ibutton.skip();
+    ibutton.reset();
+    ibutton.write(0x33);
+
+    uint64_t read_key;
+    ibutton.read_bytes((uint8_t*)&read_key, 8);
+    if (read_key != new_key)
+        return 2;
+
+    #if DEBUG
+    Serial.print(F("ID after write:"));
+
+    for (byte i = 0; i < 8; i++) {
+        if (((uint8_t *)&read_key)[i] / 16 == 0)
+            Serial.print(0);
+        Serial.print(((uint8_t *)&read_key)[i], HEX);
+        Serial.print(' ');
+    }
+    #endif
+
+    return 0;
+}
+
+void writeByte(byte data, int pin){
+    for(byte data_bit = 0; data_bit < 8; data_bit++){
+        if (data & 1){
+            digitalWrite(pin, LOW);
+            pinMode(pin, OUTPUT);
+            delayMicroseconds(60);
+            pinMode(pin, INPUT);
+            digitalWrite(pin, HIGH);
+            flush_delay(10);
+        } else {
+            digitalWrite(pin, LOW);
+            pinMode(pin, OUTPUT);
+            pinMode(pin, INPUT);
+            digitalWrite(pin, HIGH);
+            flush_delay(10);
+        }
+    
+    data = data >> 1;
+  }
+}
+
+void emulate_ds1990(uint64_t key) {
+    emulate_onewire((uint8_t *)&key, NULL);
+}
+
+void emulate_ds1992(uint64_t key) {
+    MemoryKey *memory = &scratch.memory_key;
+
+    memset(memory, 0, sizeof(*memory));
+    memory->image = -1;
+    memory->page_tags[0] = memory->page_tags[1] = -1;
+
+    // The image is read straight from EEPROM while answering, so it has to be in place, or else it reads as ones
+    if (global_key.key_index != -1 && finish_key_compaction()) {
+        int offset = get_key_offset(global_key.key_index);
+
+        memory->image = offset + KEY_OFFSET + MEMORY_IMAGE_OFFSET;
+        memory->image_len = record_payload_len(offset) - MEMORY_IMAGE_OFFSET;
+    }
+
+    emulate_onewire((uint8_t *)&key, memory);
+}
+
+void emulate_onewire(uint8_t *rom, MemoryKey *memory) {
+    rom[7] = ibutton.crc8(rom, 7);
+
+    KEY_PIN_PORT &= ~_BV(KEY_PIN_BIT);
+    KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+    ow_speed = OW_STANDARD;
+
+    memset(poll_gaps, 0, sizeof(poll_gaps));
+    poll_gap_max = 0;
+    unsigned long polled = micros();
+    
+    while (1) {
+        if (check_button(MIDDLE_BUTTON_INDEX) || check_button(BOTTOM_BUTTON_INDEX) || check_button(TOP_BUTTON_INDEX)) {
+            TCCR1B = 0;
+            if (memory)
+                memory_write_back(memory);
+            return;
+        }
+
+        // A frame takes longer than an overdrive reset, the screen and the log wait for a standard one.
+        // A memory key gets no log writes at all, the next session couldn't read its image until one is done
+        if (ow_speed == OW_STANDARD) {
+            display_flush_step();
+            if (!memory)
+                event_log_step();
+        }
+
+        if (memory && memory->dirty)
+            memory_write_back(memory);
+
+        // Same for a write started anywhere else
+        if (memory && !EEPROM.isReady())
+            continue;
+
+        record_poll_gap(micros() - polled);
+        ow_slave_poll(rom, memory, ow_speed == OW_OVERDRIVE ? OW_LOOPS(OW_OVERDRIVE_IDLE_US) : 0);
+        polled = micros();
+    }
+}
+
+/*
+ * The slave only sees the bus inside its poll, so everything the loop
+ * does in between delays its answer to a reset. Gaps get counted in
+ * power of two buckets and read out with the T serial command, to be
+ * compared against POLL_GAP_LIMIT_US and the bench in tools.
+ */
+void record_poll_gap(uint16_t gap) {
+    byte bucket = 0;
+
+    for (uint16_t limit = POLL_GAP_FIRST_US; bucket < POLL_GAP_BUCKETS && gap >= limit; limit <<= 1)
+        bucket++;
+
+    if (poll_gaps[bucket] != 0xFFFF)
+        poll_gaps[bucket]++;
+
+    if (gap > poll_gap_max)
+        poll_gap_max = gap;
+}
+
+byte copy_unsupported(uint64_t new_key, Adafruit_SSD1306 *display) {
+    return 2;
+}
+
+// Memory keys only come from a PC, see the M serial command
+byte read_unsupported(uint64_t *key) {
+    return 1;
+}
+
+#if !RFID
+// Waits for a button like the other emulators, for keys this build can't send
+void emulate_unsupported(uint64_t key) {
+    while (!check_button(MIDDLE_BUTTON_INDEX) && !check_button(BOTTOM_BUTTON_INDEX) && !check_button(TOP_BUTTON_INDEX));
+}
+#endif
+
+/*
+ * Raw keys are edge timings taken from KEY_PIN, for anything no
+ * decoder knows about. The analog comparator compares the pin (through
+ * the ADC mux) with the bandgap and triggers Timer1 input capture, so
+ * timestamps are exact to a tick and the interrupt only stores them in
+ * raw_ring. The main loop turns them into intervals of RAW_UNIT_TICKS
+ * and packs them into raw_trace:
+ *
+ *      0vvvvvvv            - interval of v units
+ *      10nnnnnn            - last two intervals repeat n + 1 more times
+ *      110ddddd            - interval two back plus d (-16..15)
+ *      1110hhhh llllllll   - interval of h << 8 | l units
+ *
+ * Intervals within RAW_JITTER of the one two back get stored as that
+ * one, so a key sending its code over and over packs into a few bytes.
+ * The first interval starts at the first falling edge and levels
+ * alternate from there. Replay pulls the pin low and releases it from
+ * the Timer1 compare interrupt, decoding the trace as it goes.
+ */
+byte read_raw(uint64_t *key) {
+    raw_capture_begin();
+
+    if (!raw_capture_edge(RAW_WAIT_MS, NULL)) {
+        raw_capture_end();
+        return 1;
+    }
+
+    RawWriter writer = {0, 0, {0, 0}};
+    uint16_t ticks;
+    byte n_edges = 1;
+    raw_trace[0] = 0;
+
+    while (raw_capture_edge(RAW_IDLE_MS, &ticks)) {
+        uint16_t interval = (ticks + RAW_UNIT_TICKS / 2) / RAW_UNIT_TICKS;
+        if (!raw_trace_put(&writer, constrain(interval, 1, RAW_MAX_INTERVAL)))
+            break;
+
+        if (n_edges < 255)
+            n_edges++;
+    }
+
+    raw_capture_end();
+    raw_trace_flush(&writer);
+
+    #if DEBUG
+    Serial.print(F("Raw edges: "));
+    Serial.print(n_edges);
+    Serial.print(F(", bytes: "));
+    Serial.println(raw_trace[0]);
+    #endif
+
+    if (n_edges < RAW_MIN_EDGES)
+        return 1;
+
+    *key = raw_trace_summary(raw_trace);
+    return 0;
+}
+
+/*
+ * Waits up to timeout_ms for the next captured edge and gives the
+ * ticks since the previous one. Returns false on timeout or once
+ * edges got lost.
+ */
+bool raw_capture_edge(unsigned int timeout_ms, uint16_t *ticks) {
+    unsigned long start = millis();
+
+    while (scratch.raw_ring_head == scratch.raw_ring_tail) {
+        if (scratch.raw_ring_overflow || millis() - start >= timeout_ms)
+            return false;
+    }
+
+    uint16_t now = scratch.raw_ring[scratch.raw_ring_tail];
+    scratch.raw_ring_tail = (scratch.raw_ring_tail + 1) & (RAW_RING_SIZE - 1);
+
+    if (ticks != NULL)
+        *ticks = now - scratch.raw_last_edge;
+
+    scratch.raw_last_edge = now;
+    return true;
+}
+
+void raw_capture_begin() {
+    pinMode(KEY_PIN, INPUT);
+
+    scratch.raw_ring_head = scratch.raw_ring_tail = 0;
+    scratch.raw_ring_overflow = false;
+
+    ADCSRA &= ~_BV(ADEN);           // the comparator gets the ADC mux only while the ADC is off
+    ADCSRB |= _BV(ACME);
+    ADMUX = KEY_ADC_CHANNEL;
+    ACSR = _BV(ACBG) | _BV(ACIC);   // bandgap on AIN+, so the output is high while the pin is low
+
+    TCCR1A = 0;
+    TCCR1B = _BV(ICNC1) | _BV(ICES1) | _BV(CS11);
+    TIFR1 = _BV(ICF1);
+    TIMSK1 = _BV(ICIE1);
+}
+
+void raw_capture_end() {
+    TIMSK1 = 0;
+    TCCR1B = 0;
+
+    ACSR = _BV(ACD);
+    ADCSRB &= ~_BV(ACME);
+    ADCSRA |= _BV(ADEN);
+}
+
+ISR(TIMER1_CAPT_vect) {
+    uint16_t now = ICR1;
+
+    TCCR1B ^= _BV(ICES1);
+    TIFR1 = _BV(ICF1);      // changing the edge may set the flag again
+
+    byte next = (scratch.raw_ring_head + 1) & (RAW_RING_SIZE - 1);
+
+    if (next == scratch.raw_ring_tail) {
+        scratch.raw_ring_overflow = true;
+        TIMSK1 = 0;         // the levels can't be told apart after a lost edge
+        return;
+    }
+
+    scratch.raw_ring[scratch.raw_ring_head] = now;
+    scratch.raw_ring_head = next;
+}
+
+// Returns false once raw_trace is full
+bool raw_trace_put(RawWriter *writer, uint16_t interval) {
+    if (writer->n == 2 && abs((int)interval - (int)writer->prev[0]) <= RAW_JITTER) {
+        interval = writer->prev[0];
+        writer->run++;
+
+        if (writer->run == RAW_MAX_REPEAT * 2 && !raw_trace_flush(writer))
+            return false;
+    } else {
+        if (!raw_trace_flush(writer))
+            return false;
+
+        int delta = (int)interval - (int)writer->prev[0];
+
+        if (writer->n == 2 && delta >= -16 && delta < 16) {
+            if (!raw_trace_emit(RAW_CODE_DELTA | (delta & 0x1F)))
+                return false;
+        } else if (interval < RAW_CODE_REPEAT) {
+            if (!raw_trace_emit(interval))
+                return false;
+        } else {
+            if (raw_trace[0] + 2 >= RAW_TRACE_SIZE)
+                return false;
+
+            raw_trace_emit(RAW_CODE_LONG | (interval >> 8));
+            raw_trace_emit(interval & 0xFF);
+        }
+
+        if (writer->n < 2)
+            writer->n++;
+    }
+
+    writer->prev[0] = writer->prev[1];
+    writer->prev[1] = interval;
+
+    return true;
+}
+
+// Writes out pending repeats, a lone one becomes a zero delta
+bool raw_trace_flush(RawWriter *writer) {
+    while (writer->run >= 2) {
+        byte n_pairs = min(writer->run / 2, RAW_MAX_REPEAT);
+
+        if (!raw_trace_emit(RAW_CODE_REPEAT | (n_pairs - 1)))
+            return false;
+
+        writer->run -= n_pairs * 2;
+    }
+
+    if (writer->run) {
+        if (!raw_trace_emit(RAW_CODE_DELTA))
+            return false;
+
+        writer->run = 0;
+    }
+
+    return true;
+}
+
+bool raw_trace_emit(byte code) {
+    if (raw_trace[0] + 1 >= RAW_TRACE_SIZE)
+        return false;
+
+    raw_trace[++raw_trace[0]] = code;
+    return true;
+}
+
+// Returns the next interval in units or 0 at the end of the trace
+uint16_t raw_trace_next(RawReader *reader) {
+    uint16_t interval;
+
+    if (reader->repeat) {
+        reader->repeat--;
+        interval = reader->prev[0];
+    } else {
+        if (reader->pos > raw_trace[0])
+            return 0;
+
+        byte code = raw_trace[reader->pos++];
+
+        if (!(code & RAW_CODE_REPEAT)) {
+            interval = code;
+        } else if ((code & 0xC0) == RAW_CODE_REPEAT) {
+            reader->repeat = ((code & 0x3F) + 1) * 2 - 1;
+            interval = reader->prev[0];
+        } else if ((code & 0xE0) == RAW_CODE_DELTA) {
+            interval = reader->prev[0] + ((int8_t)(code << 3) >> 3);
+        } else {
+            interval = ((code & 0x0F) << 8) | raw_trace[reader->pos++];
+        }
+    }
 
-    if (display != NULL) {
-        display->fillRect(display->width() / 2 - FONT_SIZE * FONT_WIDTH * 4, display->height() / 2, FONT_SIZE * FONT_WIDTH * 8, FONT_SIZE * FONT_HEIGHT, BLACK);
-        display->display();
-        display->setTextColor(WHITE);
-        display->setTextSize(FONT_SIZE);
-        display->setCursor(display->width() / 2 - FONT_SIZE * FONT_WIDTH * 4, display->height() / 2);
+    reader->prev[0] = reader->prev[1];
+    reader->prev[1] = interval;
+
+    return interval;
+}
+
+// What stands for a raw key in Key.cur_key: length, crc8 and the first 6 bytes of the trace
+uint64_t raw_trace_summary(const uint8_t *trace) {
+    uint64_t summary = 0;
+    byte len = min(trace[0], RAW_TRACE_SIZE - 1);
+
+    ((uint8_t *)&summary)[0] = len;
+    ((uint8_t *)&summary)[1] = ibutton.crc8(trace + 1, len);
+    memcpy((uint8_t *)&summary + 2, trace + 1, min(len, 6));
+
+    return summary;
+}
+
+void load_raw_trace(int index) {
+    int offset = get_key_offset(index);
+    byte payload_len = min(record_payload_len(offset), RAW_TRACE_SIZE);
+
+    for (byte i = 0; i < payload_len; i++)
+        raw_trace[i] = key_table_read(offset + KEY_OFFSET + i);
+
+    raw_trace[0] = payload_len - 1;
+}
+
+void emulate_raw(uint64_t key) {
+    if (global_key.key_index != -1)
+        load_raw_trace(global_key.key_index);
+
+    replay_next = raw_replay_next;
+    replay_edges(raw_replay_rewind);
+}
+
+void raw_replay_rewind() {
+    scratch.raw_replay = (struct RawReader){1, 0, {0, 0}};
+}
+
+uint16_t raw_replay_next() {
+    return raw_trace_next(&scratch.raw_replay) * RAW_UNIT_TICKS;
+}
+
+/*
+ * Plays the edges given by replay_next until a button is pressed,
+ * starting over after a RAW_REPLAY_GAP_MS pause. rewind is called
+ * before every run.
+ */
+void replay_edges(void (*rewind)(void)) {
+    // PORT stays low, so switching DDR either pulls the pin low or releases it
+    digitalWrite(KEY_PIN, LOW);
+    pinMode(KEY_PIN, INPUT);
+
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11);
+
+    unsigned long gap_start = millis();
+    replay_done = true;
+
+    while (1) {
+        if (check_button(MIDDLE_BUTTON_INDEX) || check_button(BOTTOM_BUTTON_INDEX) || check_button(TOP_BUTTON_INDEX))
+            break;
+
+        display_flush_step();
+
+        if (!replay_done) {
+            gap_start = millis();
+            continue;
+        }
+
+        if (millis() - gap_start < RAW_REPLAY_GAP_MS)
+            continue;
+
+        rewind();
+        uint16_t ticks = replay_next();
+        if (!ticks)
+            break;
+
+        replay_done = false;
+        KEY_PIN_DDR |= _BV(KEY_PIN_BIT);
+
+        OCR1A = TCNT1 + ticks;
+        TIFR1 = _BV(OCF1A);
+        TIMSK1 = _BV(OCIE1A);
     }
-    
-    ibutton.skip();
-    ibutton.reset();
-    ibutton.write(0xD1);
-    digitalWrite(KEY_PIN, LOW); pinMode(KEY_PIN, OUTPUT); delayMicroseconds(60);
-    pinMode(KEY_PIN, INPUT); digitalWrite(KEY_PIN, HIGH); delay(10);
-                        
-    ibutton.skip();
-    ibutton.reset();
-    ibutton.write(0xD5);
-    
-    for (byte i = 0; i < 7; i++){
-        writeByte(((uint8_t *)&new_key)[i], KEY_PIN);
 
-        #if DEBUG
-        Serial.print(F("*"));
-        #endif
+    TIMSK1 = 0;
+    TCCR1B = 0;
+    pinMode(KEY_PIN, INPUT);
+}
 
-        if (display != NULL) {
-            display->print(F("*"));
-            display->display();
+ISR(TIMER1_COMPA_vect) {
+    KEY_PIN_DDR ^= _BV(KEY_PIN_BIT);
+
+    uint16_t ticks = replay_next();
+
+    if (!ticks) {
+        KEY_PIN_DDR &= ~_BV(KEY_PIN_BIT);
+        TIMSK1 = 0;
+        replay_done = true;
+        return;
+    }
+
+    OCR1A += ticks;
+}
+
+/*
+ * Cyfral and Metacom keys get powered through the pad and send their
+ * code over and over, every bit as a low and a high phase: a longer
+ * low phase is 1, a longer high phase is 0. Both get read through the
+ * same input capture as raw keys, each (low, high) pair is handed to
+ * a streaming decoder, and a code is taken once DECODE_FRAMES frames
+ * in a row agree.
+ *
+ * Cyfral: start nibble 0001, then 8 nibbles with a single zero
+ * (cyfral_nibbles), 2 bits each, so 16 bits of code.
+ *
+ * Metacom: a sync bit with a period well above the rest, start bits
+ * 010, then 4 bytes of 7 bits with even parity each.
+ */
+byte read_cyfral(uint64_t *key) {
+    scratch.decoder = (struct KeyDecoder){0, 0, 0, 0, 0, 0, false};
+
+    if (!decode_capture(cyfral_decode))
+        return 1;
+
+    *key = scratch.decoder.code;
+    return 0;
+}
+
+byte read_metacom(uint64_t *key) {
+    scratch.decoder = (struct KeyDecoder){0, 0, 0, 0, 0, 0, false};
+
+    if (!decode_capture(metacom_decode))
+        return 1;
+
+    *key = scratch.decoder.code;
+    return 0;
+}
+
+bool decode_capture(bool (*decode)(uint16_t low, uint16_t high)) {
+    bool decoded = false;
+    uint16_t low, high;
+
+    raw_capture_begin();
+
+    if (raw_capture_edge(RAW_WAIT_MS, NULL)) {
+        unsigned long start = millis();
+
+        while (millis() - start < DECODE_TIMEOUT_MS &&
+               raw_capture_edge(RAW_IDLE_MS, &low) && raw_capture_edge(RAW_IDLE_MS, &high)) {
+            if (decode(low, high)) {
+                decoded = true;
+                break;
+            }
         }
     }
-    
-    writeByte(ibutton.crc8((uint8_t *)&new_key, 7), KEY_PIN);
 
-    #if DEBUG
-    Serial.println(F("*"));
-    #endif
+    raw_capture_end();
+    return decoded;
+}
 
-    if (display != NULL) {
-        display->print(F("*"));
-        display->display();
+bool cyfral_decode(uint16_t low, uint16_t high) {
+    scratch.decoder.shift = (scratch.decoder.shift << 1) | (low > high);
+
+    if (!scratch.decoder.synced) {
+        if ((scratch.decoder.shift & 0x0F) == CYFRAL_START) {
+            scratch.decoder.synced = true;
+            scratch.decoder.n_bits = 0;
+            scratch.decoder.code = 0;
+        }
+
+        return false;
     }
-    
-    ibutton.reset();
-    ibutton.write(0xD1);
-    digitalWrite(KEY_PIN, LOW); pinMode(KEY_PIN, OUTPUT); delayMicroseconds(10);
-    pinMode(KEY_PIN, INPUT); digitalWrite(KEY_PIN, HIGH); delay(10);
 
-    ibutton.skip();
-    ibutton.reset();
-    ibutton.write(0x33);
+    if (++scratch.decoder.n_bits % 4)
+        return false;
 
-    uint64_t read_key;
-    ibutton.read_bytes((uint8_t*)&read_key, 8);
-    if (read_key != new_key)
-        return 2;
+    byte value = 0;
+    while (value < 4 && pgm_read_byte_near(&cyfral_nibbles[value]) != (scratch.decoder.shift & 0x0F))
+        value++;
 
-    #if DEBUG
-    Serial.print(F("ID after write:"));
+    if (value == 4) {
+        scratch.decoder.synced = (scratch.decoder.shift & 0x0F) == CYFRAL_START;
+        scratch.decoder.n_bits = 0;
+        scratch.decoder.code = 0;
+        return false;
+    }
 
-    for (byte i = 0; i < 8; i++) {
-        if (((uint8_t *)&read_key)[i] / 16 == 0)
-            Serial.print(0);
-        Serial.print(((uint8_t *)&read_key)[i], HEX);
-        Serial.print(' ');
+    scratch.decoder.code = (scratch.decoder.code << 2) | value;
+
+    if (scratch.decoder.n_bits < CYFRAL_CODE_BITS * 2)
+        return false;
+
+    scratch.decoder.synced = false;
+    return frame_decoded(DECODE_FRAMES);
+}
+
+bool metacom_decode(uint16_t low, uint16_t high) {
+    uint16_t period = low + high;
+    bool sync = scratch.decoder.period && period > scratch.decoder.period + scratch.decoder.period / 2;
+
+    // Syncs go into the average too, or one left low by noise would take every bit for a sync
+    scratch.decoder.period = scratch.decoder.period ? (scratch.decoder.period * 3 + period) / 4 : period;
+
+    if (sync) {
+        scratch.decoder.synced = true;
+        scratch.decoder.n_bits = 0;
+        scratch.decoder.shift = 0;
+        scratch.decoder.code = 0;
+        return false;
     }
-    #endif
 
-    return 0;
+    if (!scratch.decoder.synced)
+        return false;
+
+    byte bit = low > high;
+
+    if (++scratch.decoder.n_bits <= METACOM_START_BITS) {
+        scratch.decoder.shift = (scratch.decoder.shift << 1) | bit;
+
+        if (scratch.decoder.n_bits == METACOM_START_BITS && scratch.decoder.shift != METACOM_START)
+            scratch.decoder.synced = false;
+
+        return false;
+    }
+
+    scratch.decoder.code = (scratch.decoder.code << 1) | bit;
+
+    if ((scratch.decoder.n_bits - METACOM_START_BITS) % 8)
+        return false;
+
+    byte parity = scratch.decoder.code;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+
+    if (parity & 1) {
+        scratch.decoder.synced = false;
+        return false;
+    }
+
+    if (scratch.decoder.n_bits < METACOM_START_BITS + 32)
+        return false;
+
+    scratch.decoder.synced = false;
+    return frame_decoded(DECODE_FRAMES);
 }
 
-void writeByte(byte data, int pin){
-    for(byte data_bit = 0; data_bit < 8; data_bit++){
-        if (data & 1){
-            digitalWrite(pin, LOW);
-            pinMode(pin, OUTPUT);
-            delayMicroseconds(60);
-            pinMode(pin, INPUT);
-            digitalWrite(pin, HIGH);
-            delay(10);
-        } else {
-            digitalWrite(pin, LOW);
-            pinMode(pin, OUTPUT);
-            pinMode(pin, INPUT);
-            digitalWrite(pin, HIGH);
-            delay(10);
+bool frame_decoded(byte n_frames) {
+    if (scratch.decoder.n_frames && scratch.decoder.code == scratch.decoder.last_code) {
+        scratch.decoder.n_frames++;
+    } else {
+        scratch.decoder.n_frames = 1;
+        scratch.decoder.last_code = scratch.decoder.code;
+    }
+
+    return scratch.decoder.n_frames >= n_frames;
+}
+
+void emulate_cyfral(uint64_t key) {
+    memset(scratch.replay_frame, 0, sizeof(scratch.replay_frame));
+    set_frame_bit(CYFRAL_START_BITS - 1);
+
+    for (byte i = 0; i < CYFRAL_CODE_BITS / 2; i++) {
+        byte nibble = pgm_read_byte_near(&cyfral_nibbles[(uint16_t)key >> (CYFRAL_CODE_BITS - 2 - i * 2) & 3]);
+
+        for (byte j = 0; j < 4; j++) {
+            if (nibble & (8 >> j))
+                set_frame_bit(CYFRAL_START_BITS + i * 4 + j);
         }
-    
-    data = data >> 1;
-  }
+    }
+
+    scratch.frame_replay = (struct FrameReplay){CYFRAL_START_BITS + CYFRAL_CODE_BITS * 2, 0, 0, false, false,
+                                        CYFRAL_SHORT_TICKS, CYFRAL_LONG_TICKS};
+    replay_next = frame_replay_next;
+    replay_edges(frame_replay_rewind);
 }
 
-void emulate_ds1990(uint64_t key) {
-    auto hub = OneWireHub(KEY_PIN);
-    auto ds1990 = DS2401(DS2401::family_code, ((uint8_t*)&key)[1], ((uint8_t*)&key)[2], ((uint8_t*)&key)[3],
-                                ((uint8_t*)&key)[4], ((uint8_t*)&key)[5], ((uint8_t*)&key)[6]);
-    hub.attach(ds1990);
-    
+void emulate_metacom(uint64_t key) {
+    memset(scratch.replay_frame, 0, sizeof(scratch.replay_frame));
+    set_frame_bit(2);   // start bits 010 follow the sync bit
+
+    for (byte i = 0; i < 32; i++) {
+        if ((uint32_t)key & ((uint32_t)1 << (31 - i)))
+            set_frame_bit(1 + METACOM_START_BITS + i);
+    }
+
+    scratch.frame_replay = (struct FrameReplay){1 + METACOM_START_BITS + 32, 0, 0, false, true,
+                                        METACOM_SHORT_TICKS, METACOM_LONG_TICKS};
+    replay_next = frame_replay_next;
+    replay_edges(frame_replay_rewind);
+}
+
+void set_frame_bit(byte index) {
+    scratch.replay_frame[index >> 3] |= 0x80 >> (index & 7);
+}
+
+void frame_replay_rewind() {
+    scratch.frame_replay.bit = 0;
+    scratch.frame_replay.high = false;
+    scratch.frame_replay.n_frames = EMULATE_FRAMES;
+}
+
+uint16_t frame_replay_next() {
+    if (!scratch.frame_replay.n_frames)
+        return 0;
+
+    bool bit = scratch.replay_frame[scratch.frame_replay.bit >> 3] & (0x80 >> (scratch.frame_replay.bit & 7));
+    uint16_t ticks = bit != scratch.frame_replay.high ? scratch.frame_replay.long_ticks : scratch.frame_replay.short_ticks;
+
+    if (scratch.frame_replay.sync && scratch.frame_replay.bit == 0)
+        ticks = scratch.frame_replay.high ? METACOM_SYNC_TICKS : scratch.frame_replay.short_ticks;
+
+    if (scratch.frame_replay.high && ++scratch.frame_replay.bit == scratch.frame_replay.n_bits) {
+        scratch.frame_replay.bit = 0;
+        scratch.frame_replay.n_frames--;
+    }
+
+    scratch.frame_replay.high = !scratch.frame_replay.high;
+    return ticks;
+}
+
+#if RFID
+/*
+ * EM4100 sends 64 bits over and over: 9 ones, then 10 rows of 4 data
+ * bits with even parity, 4 column parity bits and a 0. Every bit is
+ * Manchester coded at RF/64, so 1 loads the coil for the first half
+ * of the bit and 0 for the second. The whole frame is turned into
+ * half bit levels once, and Timer2 just copies one of them to
+ * RFID_LOAD_PIN every 256 us.
+ *
+ * The payload is 5 bytes: the version (customer) byte and the 32-bit
+ * ID, most significant nibble first on air.
+ */
+void emulate_em4100(uint64_t key) {
+    em4100_build_frame(key);
+
+    digitalWrite(RFID_LOAD_PIN, LOW);
+    pinMode(RFID_LOAD_PIN, OUTPUT);
+
+    em4100_pos = 0;
+    TCCR2A = _BV(WGM21);
+    TCCR2B = _BV(CS22);     // clk / 64, 8 us
+    OCR2A = EM4100_HALF_BIT_TICKS - 1;
+    TCNT2 = 0;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 = _BV(OCIE2A);
+
     while (1) {
-        if (check_button(MIDDLE_BUTTON_INDEX) || check_button(BOTTOM_BUTTON_INDEX) || check_button(TOP_BUTTON_INDEX)) {
-            return;
+        if (check_button(MIDDLE_BUTTON_INDEX) || check_button(BOTTOM_BUTTON_INDEX) || check_button(TOP_BUTTON_INDEX))
+            break;
+
+        display_flush_step();
+    }
+
+    TIMSK2 = 0;
+    TCCR2B = 0;
+    digitalWrite(RFID_LOAD_PIN, LOW);
+}
+
+void em4100_build_frame(uint64_t key) {
+    byte bits[EM4100_FRAME_BITS / 8] = {0};
+    byte column_parity = 0, pos = 0;
+
+    for (; pos < EM4100_HEADER_BITS; pos++)
+        bits[pos >> 3] |= 0x80 >> (pos & 7);
+
+    for (byte row = 0; row < EM4100_ROWS; row++) {
+        byte nibble = ((uint8_t *)&key)[row / 2] >> (row % 2 ? 0 : 4) & 0x0F;
+        byte row_parity = 0;
+
+        column_parity ^= nibble;
+
+        for (byte i = 0; i < 5; i++, pos++) {
+            byte bit = i < 4 ? nibble >> (3 - i) & 1 : row_parity;
+            row_parity ^= bit;
+
+            if (bit)
+                bits[pos >> 3] |= 0x80 >> (pos & 7);
+        }
+    }
+
+    for (byte i = 0; i < 4; i++, pos++) {
+        if (column_parity >> (3 - i) & 1)
+            bits[pos >> 3] |= 0x80 >> (pos & 7);
+    }
+
+    // The stop bit is the 0 left at the end
+    for (byte i = 0; i < EM4100_FRAME_BITS; i++) {
+        byte bit = bits[i >> 3] >> (7 - (i & 7)) & 1;
+        byte half = i * 2;
+
+        // 10 for 1 and 01 for 0, a pair never crosses a byte
+        scratch.em4100_half_bits[half >> 3] &= ~(0xC0 >> (half & 7));
+        scratch.em4100_half_bits[half >> 3] |= (bit ? 0x80 : 0x40) >> (half & 7);
+    }
+}
+
+ISR(TIMER2_COMPA_vect) {
+    if (scratch.em4100_half_bits[em4100_pos >> 3] & (0x80 >> (em4100_pos & 7)))
+        RFID_LOAD_PORT |= _BV(RFID_LOAD_BIT);
+    else
+        RFID_LOAD_PORT &= ~_BV(RFID_LOAD_BIT);
+
+    em4100_pos = (em4100_pos + 1) & (EM4100_FRAME_BITS * 2 - 1);
+}
+
+/*
+ * Reading needs a front end on the coil: Timer2 puts the 125 kHz
+ * carrier out on RFID_CARRIER_PIN and the demodulated signal comes
+ * back on ICP1 (RFID_DATA_PIN), where Timer1 captures its edges into
+ * raw_ring. Every interval between edges is a half bit or a whole bit,
+ * the first whole one shows where bit middles are, and the direction
+ * of the edge in the middle gives the bit. The polarity of the front
+ * end isn't known, so the bits go to two frame decoders, one of them
+ * inverting. Rows and columns get checked on the fly, and a tag is
+ * taken after EM4100_FRAMES matching frames, about 70 ms.
+ */
+byte read_em4100(uint64_t *key) {
+    pinMode(RFID_DATA_PIN, INPUT);
+    pinMode(RFID_CARRIER_PIN, OUTPUT);
+    TCCR2A = _BV(COM2A0) | _BV(WGM21);
+    TCCR2B = _BV(CS20);
+    OCR2A = EM4100_CARRIER_TOP;
+
+    scratch.raw_ring_head = scratch.raw_ring_tail = 0;
+    scratch.raw_ring_overflow = false;
+
+    ACSR = _BV(ACD);
+    TCCR1A = 0;
+    TCCR1B = _BV(ICNC1) | _BV(ICES1) | _BV(CS11);
+    TIFR1 = _BV(ICF1);
+    TIMSK1 = _BV(ICIE1);
+
+    scratch.decoder = (struct KeyDecoder){0, 0, 0, 0, 0, 0, false};
+    scratch.em4100_clock = (struct ManchesterClock){true, false, false};
+    memset(scratch.em4100, 0, sizeof(scratch.em4100));
+
+    bool decoded = false;
+    uint16_t ticks;
+
+    if (raw_capture_edge(RAW_WAIT_MS, NULL)) {
+        unsigned long start = millis();
+
+        while (millis() - start < DECODE_TIMEOUT_MS && raw_capture_edge(RAW_IDLE_MS, &ticks)) {
+            if (em4100_decode(ticks)) {
+                decoded = true;
+                break;
+            }
+        }
+    }
+
+    TIMSK1 = 0;
+    TCCR1B = 0;
+    TCCR2A = 0;
+    TCCR2B = 0;
+    digitalWrite(RFID_CARRIER_PIN, LOW);
+
+    if (!decoded)
+        return 1;
+
+    *key = 0;
+    for (byte i = 0; i < 5; i++)
+        ((uint8_t *)key)[i] = scratch.decoder.code >> (8 * (4 - i));
+
+    return 0;
+}
+
+// Takes the ticks before an edge, returns true once a tag is read
+bool em4100_decode(uint16_t ticks) {
+    scratch.em4100_clock.level = !scratch.em4100_clock.level;
+
+    if (ticks < EM4100_HALF_BIT_US / 2 || ticks >= EM4100_HALF_BIT_US * 5 / 2) {
+        scratch.em4100_clock.aligned = false;
+        scratch.em4100[0].synced = scratch.em4100[1].synced = false;
+        return false;
+    }
+
+    if (ticks >= EM4100_HALF_BIT_US * 3 / 2) {
+        scratch.em4100_clock.aligned = true;
+        scratch.em4100_clock.at_mid = true;
+    } else if (scratch.em4100_clock.aligned) {
+        scratch.em4100_clock.at_mid = !scratch.em4100_clock.at_mid;
+    }
+
+    if (!scratch.em4100_clock.aligned || !scratch.em4100_clock.at_mid)
+        return false;
+
+    for (byte i = 0; i < 2; i++) {
+        if (em4100_decode_bit(&scratch.em4100[i], scratch.em4100_clock.level ^ i)) {
+            scratch.decoder.code = scratch.em4100[i].code;
+
+            if (frame_decoded(EM4100_FRAMES))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns true when a whole frame checks out
+bool em4100_decode_bit(Em4100Decoder *d, bool bit) {
+    if (!d->synced) {
+        d->run = bit ? d->run + 1 : 0;
+
+        // Rows have even parity, so nine ones in a row can only be the header
+        if (d->run == EM4100_HEADER_BITS) {
+            d->synced = true;
+            d->n_bits = 0;
+            d->code = 0;
+            d->row = 0;
+            d->parity = 0;
+            d->column = 0;
+        }
+
+        return false;
+    }
+
+    byte index = d->n_bits++;
+
+    if (index < EM4100_ROWS * 5) {
+        if (index % 5 < 4) {
+            d->row = (d->row << 1) | bit;
+            d->parity ^= bit;
+            d->column ^= bit << (3 - index % 5);
+            return false;
         }
 
-        hub.poll();
+        if (bit != d->parity) {
+            d->synced = false;
+            d->run = 0;
+            return false;
+        }
+
+        d->code = (d->code << 4) | (d->row & 0x0F);
+        d->parity = 0;
+        return false;
+    }
+
+    if (index < EM4100_ROWS * 5 + 4) {
+        if (bit != ((d->column >> (3 - (index - EM4100_ROWS * 5))) & 1)) {
+            d->synced = false;
+            d->run = 0;
+        }
+
+        return false;
     }
+
+    d->synced = false;
+    d->run = 0;
+
+    return !bit;
 }
+#endif
 
 #pragma endregion
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+#include <Arduino.h>
+#include <Wire.h>
+
+#define BLACK 0
+#define WHITE 1
+#define INVERSE 2
+#define SSD1306_SWITCHCAPVCC 2
+#define SSD1306_DISPLAYOFF 0xAE
+#define SSD1306_DISPLAYON 0xAF
+#define SSD1306_SETCONTRAST 0x81
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_COLUMNADDR 0x21
+
+// Draws nothing, the buffer is there for the code sharing it and on for the power model
+struct Adafruit_SSD1306 {
+    uint8_t buffer[128 * 64 / 8];
+    bool on = true;
+
+    Adafruit_SSD1306(uint8_t, uint8_t, TwoWire *, int8_t, uint32_t = 400000, uint32_t = 100000) {}
+    bool begin(uint8_t, uint8_t) { return true; }
+    void display() {}
+    void clearDisplay() {}
+    void setRotation(uint8_t) {}
+    void fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+    void drawPixel(int16_t, int16_t, uint16_t) {}
+    void drawRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+    void drawFastHLine(int16_t, int16_t, int16_t, uint16_t) {}
+    void drawFastVLine(int16_t, int16_t, int16_t, uint16_t) {}
+    int16_t getCursorX() const { return 0; }
+    void setCursor(int16_t, int16_t) {}
+    void setTextSize(uint8_t) {}
+    void setTextColor(uint16_t) {}
+    void setTextColor(uint16_t, uint16_t) {}
+    int16_t width() { return 128; }
+    int16_t height() { return 64; }
+    uint8_t *getBuffer() { return buffer; }
+    void ssd1306_command(uint8_t command) {
+        if (command == SSD1306_DISPLAYOFF || command == SSD1306_DISPLAYON)
+            on = command == SSD1306_DISPLAYON;
+    }
+    void dim(bool) {}
+    template<class T> size_t print(T, int = DEC) { return 0; }
+    template<class T> size_t println(T, int = DEC) { return 0; }
+    size_t println() { return 0; }
+    size_t write(uint8_t) { return 1; }
+};
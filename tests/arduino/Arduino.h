@@ -0,0 +1,90 @@
+/*
+ * Just enough of the Arduino core for main.cpp to build on a PC, so
+ * the tests can call its functions. Nothing here does any I/O: pins
+ * and registers are plain variables and time only moves with delay.
+ */
+#pragma once
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <type_traits>
+
+#define F_CPU 8000000L
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A3 17
+#define HEX 16
+#define DEC 10
+
+struct __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define PSTR(s) (s)
+
+// Goes nowhere, unless fd is set: then it talks to it with a 64 byte RX buffer like the UART's
+struct HardwareSerial {
+    int fd = -1;
+    unsigned long overruns = 0;     // bytes dropped as the RX buffer was full
+
+    void begin(long) {}
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *data, size_t n);
+    void flush() {}
+    size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t print(const __FlashStringHelper *text) { return print((const char *)text); }
+    size_t print(char c) { return write(c); }
+    template<class T> typename std::enable_if<std::is_integral<T>::value, size_t>::type print(T value, int base = DEC) {
+        return print_number(value, base);
+    }
+    template<class T> size_t println(T value) { return print(value) + println(); }
+    template<class T> size_t println(T value, int base) { return print(value, base) + println(); }
+    size_t println() { return print("\r\n"); }
+    operator bool() { return true; }
+
+private:
+    uint8_t rx[64];
+    byte rx_len = 0;
+
+    void receive();
+    size_t print_number(long long value, int base);
+};
+
+extern HardwareSerial Serial;
+
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void pinMode(uint8_t pin, uint8_t mode);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+void cli();
+void sei();
+char *itoa(int value, char *str, int radix);
+
+#define ISR(vector) extern "C" void vector(void)
+#define _BV(bit) (1 << (bit))
+
+template<class A, class B> auto min(A a, B b) -> decltype(a < b ? a : b) { return a < b ? a : b; }
+template<class A, class B> auto max(A a, B b) -> decltype(a < b ? a : b) { return a > b ? a : b; }
+template<class A, class B, class C> A constrain(A x, B low, C high) { return x < low ? low : (x > high ? high : x); }
+
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+
+#include <avr/io.h>
@@ -0,0 +1,20 @@
+#pragma once
+#include <Arduino.h>
+
+// Backed by eeprom_image, which the tests can fill and check
+struct EEPROMClassEx {
+    uint8_t readByte(int address);
+    int16_t readInt(int address);
+    bool writeByte(int address, uint8_t value);
+    bool writeInt(int address, uint16_t value);
+    bool updateByte(int address, uint8_t value);
+    bool updateInt(int address, uint16_t value);
+    bool isReady() { return true; }
+    void setMemPool(int, int) {}
+    void setMaxAllowedWrites(int) {}
+};
+
+extern EEPROMClassEx EEPROM;
+extern uint8_t eeprom_image[];
+
+static inline void eeprom_busy_wait() {}
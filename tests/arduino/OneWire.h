@@ -0,0 +1,44 @@
+#pragma once
+#include <Arduino.h>
+
+// No bus, only the CRCs are real
+struct OneWire {
+    OneWire(uint8_t) {}
+    uint8_t reset() { return 0; }
+    void write(uint8_t, uint8_t = 0) {}
+    uint8_t read() { return 0; }
+    void read_bytes(uint8_t *buf, uint16_t count) { memset(buf, 0xFF, count); }
+    void write_bytes(const uint8_t *, uint16_t, bool = false) {}
+    void select(const uint8_t *) {}
+    void write_bit(uint8_t) {}
+    uint8_t read_bit() { return 0; }
+    void skip() {}
+    void depower() {}
+    void reset_search() {}
+    void target_search(uint8_t) {}
+    bool search(uint8_t *, bool = true) { return false; }
+
+    static uint8_t crc8(const uint8_t *addr, uint8_t len) {
+        uint8_t crc = 0;
+
+        while (len--) {
+            uint8_t data = *addr++;
+
+            for (byte i = 0; i < 8; i++, data >>= 1)
+                crc = ((crc ^ data) & 1) ? (crc >> 1) ^ 0x8C : crc >> 1;
+        }
+
+        return crc;
+    }
+
+    static uint16_t crc16(const uint8_t *input, uint16_t len, uint16_t crc = 0) {
+        while (len--) {
+            crc ^= *input++;
+
+            for (byte i = 0; i < 8; i++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+
+        return crc;
+    }
+};
@@ -0,0 +1,13 @@
+#pragma once
+#include <Arduino.h>
+
+struct TwoWire {
+    void begin() {}
+    void setClock(uint32_t) {}
+    void beginTransmission(uint8_t) {}
+    uint8_t endTransmission(bool = true) { return 0; }
+    size_t write(uint8_t) { return 1; }
+    size_t write(const uint8_t *, size_t n) { return n; }
+};
+
+extern TwoWire Wire;
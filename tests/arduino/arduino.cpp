@@ -0,0 +1,164 @@
+// Definitions for the stand-ins in this directory
+#include <Arduino.h>
+#include <EEPROMex.h>
+#include <MemoryFree.h>
+#include <Wire.h>
+#include <avr/sleep.h>
+#include <util/twi.h>
+#include <utility/twi.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+TwoWire Wire;
+EEPROMClassEx EEPROM;
+
+uint8_t eeprom_image[E2END + 1];
+
+uint8_t EEPROMClassEx::readByte(int address) {
+    if (address < 0 || address > E2END) {
+        fprintf(stderr, "EEPROM read out of range: %d\n", address);
+        abort();
+    }
+
+    return eeprom_image[address];
+}
+
+int16_t EEPROMClassEx::readInt(int address) {
+    return readByte(address) | readByte(address + 1) << 8;
+}
+
+bool EEPROMClassEx::writeByte(int address, uint8_t value) {
+    if (address < 0 || address > E2END) {
+        fprintf(stderr, "EEPROM write out of range: %d\n", address);
+        abort();
+    }
+
+    eeprom_image[address] = value;
+    return true;
+}
+
+bool EEPROMClassEx::writeInt(int address, uint16_t value) {
+    return writeByte(address, value & 0xFF) && writeByte(address + 1, value >> 8);
+}
+
+bool EEPROMClassEx::updateByte(int address, uint8_t value) {
+    return readByte(address) == value || writeByte(address, value);
+}
+
+bool EEPROMClassEx::updateInt(int address, uint16_t value) {
+    return updateByte(address, value & 0xFF) && updateByte(address + 1, value >> 8);
+}
+
+// Takes in what the other end sent, dropping what doesn't fit
+void HardwareSerial::receive() {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    uint8_t c;
+
+    while (fd >= 0 && poll(&pfd, 1, 0) > 0 && ::read(fd, &c, 1) == 1) {
+        if (rx_len < sizeof(rx))
+            rx[rx_len++] = c;
+        else
+            overruns++;
+    }
+}
+
+int HardwareSerial::available() {
+    receive();
+    return rx_len;
+}
+
+int HardwareSerial::read() {
+    int c = peek();
+
+    if (c >= 0)
+        memmove(rx, rx + 1, --rx_len);
+
+    return c;
+}
+
+int HardwareSerial::peek() {
+    receive();
+    return rx_len ? rx[0] : -1;
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t n) {
+    size_t sent = 0;
+
+    while (fd >= 0 && sent < n) {
+        ssize_t written = ::write(fd, data + sent, n - sent);
+
+        if (written <= 0)
+            break;
+        sent += written;
+    }
+
+    return n;
+}
+
+size_t HardwareSerial::print_number(long long value, int base) {
+    char text[24];
+
+    // Like on the AVR, where long is 32 bits, negative numbers go out in hex as two's complement
+    if (base == HEX)
+        sprintf(text, "%lX", (unsigned long)(uint32_t)value);
+    else
+        sprintf(text, "%lld", value);
+
+    return print(text);
+}
+
+unsigned long fake_us = 0;
+
+int digitalRead(uint8_t pin) { return HIGH; }
+void digitalWrite(uint8_t pin, uint8_t value) {}
+void pinMode(uint8_t pin, uint8_t mode) {}
+void delay(unsigned long ms) { fake_us += ms * 1000; }
+void delayMicroseconds(unsigned int us) { fake_us += us; }
+unsigned long millis() { return fake_us / 1000; }
+unsigned long micros() { return fake_us; }
+void cli() {}
+void sei() {}
+int freeMemory() { return 0; }
+
+char *itoa(int value, char *str, int radix) {
+    sprintf(str, radix == HEX ? "%x" : "%d", value);
+    return str;
+}
+
+void set_sleep_mode(int mode) {}
+void sleep_enable() {}
+void sleep_disable() {}
+
+void (*fake_twi)(uint8_t address, uint8_t *data, uint8_t len) = 0;
+
+uint8_t twi_writeTo(uint8_t address, uint8_t *data, uint8_t len, uint8_t, uint8_t) {
+    if (fake_twi)
+        fake_twi(address, data, len);
+
+    return 0;
+}
+
+void (*fake_delay_us)(double us) = 0;
+
+void (*fake_sleep)() = 0;
+void sleep_cpu() {
+    if (fake_sleep)
+        fake_sleep();
+}
+
+void sleep_mode() {}
+void sleep_bod_disable() {}
+
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1, TCCR2A, TCCR2B, TIMSK2, OCR2A, OCR2B,
+                 TCNT2, TIFR2, ADMUX, ADCSRB, ADCL, ADCH, ACSR, DIDR0, DIDR1, PCICR, PCMSK0,
+                 PCMSK1, PCMSK2, PCIFR, EIMSK, EICRA, EIFR, TWBR, TWCR, TWDR, TWAR, MCUSR,
+                 SMCR, PRR, SREG, UCSR0A, UDR0, PORTC, PIND, PORTD, DDRD, PINB, PORTB,
+                 DDRB;
+volatile uint16_t ICR1, OCR1A, OCR1B;
+FakeRegister<uint8_t> PINC, DDRC;
+FakeRegister<uint16_t> TCNT1;
+volatile uint8_t TWSR = TW_NO_INFO;   // idle bus, as after reset
+volatile uint16_t ADC = 341;   // 1.1 V of 3.3 V
+Adcsra ADCSRA;
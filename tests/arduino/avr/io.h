@@ -0,0 +1,185 @@
+/*
+ * ATmega328P registers as plain variables, defined in arduino.cpp.
+ * ADCSRA never reads back ADSC, so conversions are done right away.
+ * The key pin and Timer1 can be hooked by a test (see FakeRegister)
+ * to put something on the other end of the 1-Wire bus.
+ */
+#pragma once
+#include <stdint.h>
+
+// Reads go through on_read and writes get shown to on_written if they are set
+template <class T> struct FakeRegister {
+    T value;
+    T (*on_read)(T value);
+    void (*on_written)(T value);
+
+    operator T() const { return on_read ? on_read(value) : value; }
+    FakeRegister &operator=(T x) {
+        value = x;
+        if (on_written)
+            on_written(x);
+        return *this;
+    }
+    FakeRegister &operator|=(int x) { return *this = value | x; }
+    FakeRegister &operator&=(int x) { return *this = value & x; }
+    FakeRegister &operator^=(int x) { return *this = value ^ x; }
+};
+
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TCCR1C;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TIFR1;
+extern volatile uint8_t TCCR2A;
+extern volatile uint8_t TCCR2B;
+extern volatile uint8_t TIMSK2;
+extern volatile uint8_t OCR2A;
+extern volatile uint8_t OCR2B;
+extern volatile uint8_t TCNT2;
+extern volatile uint8_t TIFR2;
+extern volatile uint8_t ADMUX;
+extern volatile uint8_t ADCSRB;
+extern volatile uint8_t ADCL;
+extern volatile uint8_t ADCH;
+extern volatile uint8_t ACSR;
+extern volatile uint8_t DIDR0;
+extern volatile uint8_t DIDR1;
+extern volatile uint8_t PCICR;
+extern volatile uint8_t PCMSK0;
+extern volatile uint8_t PCMSK1;
+extern volatile uint8_t PCMSK2;
+extern volatile uint8_t PCIFR;
+extern volatile uint8_t EIMSK;
+extern volatile uint8_t EICRA;
+extern volatile uint8_t EIFR;
+extern volatile uint8_t TWBR;
+extern volatile uint8_t TWSR;
+extern volatile uint8_t TWCR;
+extern volatile uint8_t TWDR;
+extern volatile uint8_t TWAR;
+extern volatile uint8_t MCUSR;
+extern volatile uint8_t SMCR;
+extern volatile uint8_t PRR;
+extern volatile uint8_t SREG;
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UDR0;
+extern FakeRegister<uint8_t> PINC;
+extern volatile uint8_t PORTC;
+extern FakeRegister<uint8_t> DDRC;
+extern volatile uint8_t PIND;
+extern volatile uint8_t PORTD;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PINB;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+extern volatile uint16_t ICR1;
+extern FakeRegister<uint16_t> TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint16_t ADC;
+
+#define UDRE0 5
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define ICNC1 7
+#define ICES1 6
+#define ICIE1 5
+#define ICF1 5
+#define TOIE1 0
+#define TOV1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define WGM10 0
+#define WGM11 1
+#define COM1A0 6
+#define COM1B0 4
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADLAR 5
+#define ACIE 3
+#define ACIS0 0
+#define ACIS1 1
+#define ACBG 6
+#define ACO 5
+#define ACD 7
+#define ACIC 2
+#define ACME 6
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCINT2 2
+#define PCINT11 3
+#define PCINT18 2
+#define PCINT19 3
+#define PCINT20 4
+#define PCINT16 0
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWEN 2
+#define TWIE 0
+#define TWPS0 0
+#define TWPS1 1
+#define INT0 0
+#define INT1 1
+#define ISC00 0
+#define ISC10 2
+#define PC3 3
+#define PINC3 3
+#define PD0 0
+#define BODS 6
+#define BODSE 5
+#define SE 0
+#define SM1 2
+#define PRADC 0
+#define PRTWI 7
+#define TOIE2 0
+#define OCIE2A 1
+#define WGM21 1
+#define CS21 1
+#define CS20 0
+#define CS22 2
+#define E2END 1023
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PB0 0
+#define PB1 1
+#define PINB0 0
+#define OCF2A 1
+#define COM2A0 6
+#define PCIF1 1
+#define PCIF2 2
+#define PB2 2
+#define RXC0 7
+#define REFS0 6
+#define REFS1 7
+
+struct Adcsra {
+    uint8_t value;
+
+    operator uint8_t() const { return value & ~(1 << 6); }
+    Adcsra &operator=(uint8_t x) { value = x; return *this; }
+    Adcsra &operator|=(uint8_t x) { value |= x; return *this; }
+    Adcsra &operator&=(int x) { value &= x; return *this; }      // int, like the register arithmetic it stands for
+};
+
+extern Adcsra ADCSRA;
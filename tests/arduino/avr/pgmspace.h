@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_word_near(address) ((uintptr_t)*(address))
+#define pgm_read_word(address) ((uintptr_t)*(address))
+#define pgm_read_byte_near(address) (*(const uint8_t *)(address))
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define strcpy_P strcpy
+#define strlen_P strlen
+#define strncpy_P strncpy
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
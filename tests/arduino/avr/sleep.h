@@ -0,0 +1,14 @@
+#pragma once
+
+#define SLEEP_MODE_PWR_DOWN 2
+#define SLEEP_MODE_IDLE 0
+
+void set_sleep_mode(int mode);
+void sleep_enable();
+void sleep_disable();
+void sleep_cpu();
+void sleep_mode();
+void sleep_bod_disable();
+
+// Called by sleep_cpu if set, to pass the time asleep
+extern void (*fake_sleep)();
@@ -0,0 +1,10 @@
+#pragma once
+
+// Called by _delay_us if set, to pass the time
+extern void (*fake_delay_us)(double us);
+
+inline void _delay_us(double us) {
+    if (fake_delay_us)
+        fake_delay_us(us);
+}
+inline void _delay_ms(double) {}
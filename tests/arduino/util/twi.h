@@ -0,0 +1,4 @@
+#pragma once
+
+#define TW_NO_INFO 0xF8
+#define TW_STATUS (TWSR & 0xF8)
@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+
+// Called by twi_writeTo if set, with every transfer
+extern void (*fake_twi)(uint8_t address, uint8_t *data, uint8_t len);
+
+uint8_t twi_writeTo(uint8_t address, uint8_t *data, uint8_t len, uint8_t wait, uint8_t send_stop);
@@ -0,0 +1,105 @@
+/*
+ * Feeds em4100_decode the edges of capture files, the way read_em4100
+ * gets them: capture starts on a rising edge, and every edge after it
+ * gives the Timer1 ticks (us) since the one before.
+ *
+ * A capture is a text file with an edge per line, its time in us and
+ * the level after it. Lines starting with # are comments, and
+ * "# tag 0123456789" (or "# tag none") says what should be read.
+ *
+ *   em4100_decode              runs the captures in data/
+ *   em4100_decode FILE...      prints what each capture reads as, and
+ *                              checks it if the file has a tag line
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o em4100_decode em4100_decode.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+// Returns false if the file can't be read, tag gets what was read or "none"
+bool decode_file(const char *path, char *tag, char *expected) {
+    FILE *file = fopen(path, "r");
+    char line[128];
+    bool started = false, decoded = false;
+    double prev = 0;
+
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    scratch.decoder = (struct KeyDecoder){0, 0, 0, 0, 0, 0, false};
+    scratch.em4100_clock = (struct ManchesterClock){true, false, false};
+    memset(scratch.em4100, 0, sizeof(scratch.em4100));
+    strcpy(expected, "");
+
+    while (!decoded && fgets(line, sizeof(line), file)) {
+        double time;
+        int level;
+
+        if (line[0] == '#') {
+            sscanf(line, "# tag %11s", expected);
+            continue;
+        }
+
+        if (sscanf(line, "%lf %d", &time, &level) != 2)
+            continue;
+
+        if (started)
+            decoded = em4100_decode((uint16_t)(time - prev + 0.5));
+        else
+            started = level == 1;
+
+        prev = time;
+    }
+
+    fclose(file);
+
+    if (!decoded) {
+        strcpy(tag, "none");
+        return true;
+    }
+
+    for (byte i = 0; i < 5; i++)
+        sprintf(tag + i * 2, "%02X", (uint8_t)(scratch.decoder.code >> (8 * (4 - i))));
+
+    return true;
+}
+
+void check_file(const char *path, bool verbose) {
+    char tag[12], expected[12];
+
+    if (!decode_file(path, tag, expected)) {
+        failures++;
+        return;
+    }
+
+    if (verbose)
+        printf("%s: %s\n", path, tag);
+
+    if (expected[0] && strcasecmp(tag, expected)) {
+        printf("%s: read %s, not %s\n", path, tag, expected);
+        failures++;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *captures[] = {
+        "data/em4100_plain.txt",
+        "data/em4100_inverted.txt",
+        "data/em4100_mid_frame.txt",
+        "data/em4100_bad_parity.txt",
+    };
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            check_file(argv[i], true);
+
+        return failures != 0;
+    }
+
+    for (byte i = 0; i < sizeof(captures) / sizeof(captures[0]); i++)
+        check_file(captures[i], false);
+
+    return test_result("em4100_decode");
+}
@@ -0,0 +1,135 @@
+/*
+ * EM4100 frames from em4100_build_frame: the bits against a tag worked
+ * out by hand, header, parity and stop bit for random tags, and the
+ * half bits the Timer2 interrupt puts out on RFID_LOAD_PIN.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o em4100_frame em4100_frame.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+uint64_t tag_key(const uint8_t *tag) {
+    uint64_t key = 0;
+    memcpy(&key, tag, 5);
+    return key;
+}
+
+// Level of half bit i, as the interrupt sends them
+bool half_bit(byte i) {
+    return scratch.em4100_half_bits[i >> 3] & (0x80 >> (i & 7));
+}
+
+// Manchester: 1 is high then low, 0 low then high. Returns -1 for anything else
+int frame_bit(byte i) {
+    bool first = half_bit(i * 2), second = half_bit(i * 2 + 1);
+    return first == second ? -1 : first;
+}
+
+void test_known_tag() {
+    // Version 01, ID 23456789: nibbles 0 to 9, each row with its even parity
+    const uint8_t tag[] = {0x01, 0x23, 0x45, 0x67, 0x89};
+    const char *expected =
+        "111111111"
+        "00000" "00011" "00101" "00110" "01001"
+        "01010" "01100" "01111" "10001" "10010"
+        "0001"  // column parity, the XOR of 0 to 9
+        "0";    // stop
+
+    em4100_build_frame(tag_key(tag));
+
+    for (byte i = 0; i < EM4100_FRAME_BITS; i++) {
+        if (frame_bit(i) != expected[i] - '0') {
+            printf("bit %d is %d, not %c\n", i, frame_bit(i), expected[i]);
+            failures++;
+        }
+    }
+}
+
+void test_random_tags() {
+    int before = failures;
+
+    srand(1);
+
+    for (int run = 0; run < 1000; run++) {
+        uint8_t tag[5];
+        for (byte i = 0; i < 5; i++)
+            tag[i] = rand();
+
+        em4100_build_frame(tag_key(tag));
+
+        byte bits[EM4100_FRAME_BITS];
+        for (byte i = 0; i < EM4100_FRAME_BITS; i++) {
+            bits[i] = frame_bit(i);
+            CHECK(bits[i] == 0 || bits[i] == 1);
+        }
+
+        for (byte i = 0; i < EM4100_HEADER_BITS; i++)
+            CHECK_EQ(bits[i], 1);
+
+        byte columns[4] = {0};
+
+        for (byte row = 0; row < EM4100_ROWS; row++) {
+            const byte *cells = bits + EM4100_HEADER_BITS + row * 5;
+            byte nibble = 0, parity = 0;
+
+            for (byte i = 0; i < 5; i++)
+                parity ^= cells[i];
+            for (byte i = 0; i < 4; i++) {
+                nibble = nibble << 1 | cells[i];
+                columns[i] ^= cells[i];
+            }
+
+            CHECK_EQ(parity, 0);
+            CHECK_EQ(nibble, tag[row / 2] >> (row % 2 ? 0 : 4) & 0x0F);
+        }
+
+        for (byte i = 0; i < 4; i++)
+            CHECK_EQ(bits[EM4100_HEADER_BITS + EM4100_ROWS * 5 + i], columns[i]);
+
+        CHECK_EQ(bits[EM4100_FRAME_BITS - 1], 0);
+
+        if (failures != before) {
+            printf("tag %02X%02X%02X%02X%02X\n", tag[0], tag[1], tag[2], tag[3], tag[4]);
+            return;
+        }
+    }
+}
+
+// Nothing of the last frame is left behind, whatever was there before
+void test_rebuild() {
+    const uint8_t ones[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF}, zeros[] = {0, 0, 0, 0, 0};
+    uint8_t first[sizeof(scratch.em4100_half_bits)];
+
+    em4100_build_frame(tag_key(zeros));
+    memcpy(first, scratch.em4100_half_bits, sizeof(first));
+
+    memset(scratch.em4100_half_bits, 0xA5, sizeof(first));
+    em4100_build_frame(tag_key(ones));
+    em4100_build_frame(tag_key(zeros));
+
+    CHECK(memcmp(first, scratch.em4100_half_bits, sizeof(first)) == 0);
+}
+
+// The interrupt puts half bit em4100_pos out and wraps after the frame
+void test_interrupt() {
+    const uint8_t tag[] = {0x12, 0x34, 0x56, 0x78, 0x9A};
+
+    em4100_build_frame(tag_key(tag));
+    em4100_pos = 0;
+
+    for (int i = 0; i < EM4100_FRAME_BITS * 2 * 2; i++) {
+        TIMER2_COMPA_vect();
+        CHECK_EQ((bool)(RFID_LOAD_PORT & _BV(RFID_LOAD_BIT)), half_bit(i % (EM4100_FRAME_BITS * 2)));
+    }
+
+    CHECK_EQ(em4100_pos, 0);
+}
+
+int main() {
+    test_known_tag();
+    test_random_tags();
+    test_rebuild();
+    test_interrupt();
+
+    return test_result("em4100_frame");
+}
@@ -0,0 +1,234 @@
+/*
+ * Cyfral and Metacom decoders fed (low, high) pairs built here from
+ * the frame formats, with jitter, noise and glitches, starting
+ * anywhere in a frame.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o frame_decode frame_decode.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+#define MAX_PAIRS 2048
+
+struct Pairs {
+    uint16_t low[MAX_PAIRS], high[MAX_PAIRS];
+    int n;
+};
+
+Pairs pairs;
+
+void put_bit(bool bit, uint16_t short_ticks, uint16_t long_ticks) {
+    pairs.low[pairs.n] = bit ? long_ticks : short_ticks;
+    pairs.high[pairs.n] = bit ? short_ticks : long_ticks;
+    pairs.n++;
+}
+
+// Start nibble 0001, then every 2 bits of code as a nibble with a single zero, most significant first
+void put_cyfral_frame(uint16_t code) {
+    const byte nibbles[] = {0x07, 0x0B, 0x0D, 0x0E};
+
+    for (byte i = 0; i < 4; i++)
+        put_bit(i == 3, CYFRAL_SHORT_TICKS, CYFRAL_LONG_TICKS);
+
+    for (byte i = 0; i < 8; i++) {
+        byte nibble = nibbles[code >> (14 - i * 2) & 3];
+
+        for (byte j = 0; j < 4; j++)
+            put_bit(nibble & (8 >> j), CYFRAL_SHORT_TICKS, CYFRAL_LONG_TICKS);
+    }
+}
+
+// A sync bit with a long high, start bits 010, then the bytes most significant bit first
+void put_metacom_frame(uint32_t code) {
+    pairs.low[pairs.n] = METACOM_SHORT_TICKS;
+    pairs.high[pairs.n] = METACOM_SYNC_TICKS;
+    pairs.n++;
+
+    for (byte i = 0; i < 3; i++)
+        put_bit(i == 1, METACOM_SHORT_TICKS, METACOM_LONG_TICKS);
+
+    for (byte i = 0; i < 32; i++)
+        put_bit(code >> (31 - i) & 1, METACOM_SHORT_TICKS, METACOM_LONG_TICKS);
+}
+
+// 7 random bits and even parity in each byte
+uint32_t metacom_code() {
+    uint32_t code = 0;
+
+    for (byte i = 0; i < 4; i++) {
+        byte value = rand() & 0x7F;
+        code = code << 8 | value << 1 | __builtin_parity(value);
+    }
+
+    return code;
+}
+
+void jitter(int from, int max_ticks) {
+    for (int i = from; i < pairs.n; i++) {
+        int shift = rand() % (max_ticks * 2 + 1) - max_ticks;
+        pairs.low[i] += shift;
+        pairs.high[i] -= shift;
+    }
+}
+
+void put_noise(int n) {
+    for (int i = 0; i < n; i++) {
+        pairs.low[pairs.n] = 20 + rand() % 400;
+        pairs.high[pairs.n] = 20 + rand() % 400;
+        pairs.n++;
+    }
+}
+
+// Index of the pair after which the decoder took a code, -1 if it never did
+int feed(bool (*decode)(uint16_t low, uint16_t high), int from) {
+    scratch.decoder = (struct KeyDecoder){0, 0, 0, 0, 0, 0, false};
+
+    for (int i = from; i < pairs.n; i++) {
+        if (decode(pairs.low[i], pairs.high[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+void test_cyfral() {
+    int before = failures;
+
+    for (int run = 0; run < 1000; run++) {
+        uint16_t code = rand();
+        pairs.n = 0;
+
+        for (byte i = 0; i < DECODE_FRAMES + 2; i++)
+            put_cyfral_frame(code);
+        jitter(0, (CYFRAL_LONG_TICKS - CYFRAL_SHORT_TICKS) / 2 - 1);
+
+        // Anywhere in the first frame, the next DECODE_FRAMES whole ones give the code.
+        // Past the first bit of the start nibble, the zeros the decoder starts with stand in for it
+        int start = rand() % 36;
+        int end = feed(cyfral_decode, start);
+
+        CHECK_EQ(end, (start < 4 ? 0 : 36) + DECODE_FRAMES * 36 - 1);
+        CHECK_EQ(scratch.decoder.code, code);
+
+        if (failures != before) {
+            printf("code %04X from %d\n", code, start);
+            return;
+        }
+    }
+}
+
+void test_metacom() {
+    int before = failures;
+
+    for (int run = 0; run < 1000; run++) {
+        uint32_t code = metacom_code();
+        pairs.n = 0;
+
+        // The sync bit only stands out once the period average has settled
+        for (byte i = 0; i < DECODE_FRAMES + 2; i++)
+            put_metacom_frame(code);
+        jitter(0, (METACOM_LONG_TICKS - METACOM_SHORT_TICKS) / 2 - 1);
+
+        int start = 1 + rand() % 35;
+        int end = feed(metacom_decode, start);
+
+        CHECK_EQ(end, 36 + DECODE_FRAMES * 36 - 1);
+        CHECK_EQ(scratch.decoder.code, code);
+
+        if (failures != before) {
+            printf("code %08X from %d\n", code, start);
+            return;
+        }
+    }
+}
+
+void test_noise() {
+    int before = failures;
+
+    for (int run = 0; run < 500; run++) {
+        pairs.n = 0;
+        put_noise(MAX_PAIRS);
+
+        CHECK_EQ(feed(cyfral_decode, 0), -1);
+        CHECK_EQ(feed(metacom_decode, 0), -1);
+
+        if (failures != before)
+            return;
+    }
+}
+
+void flip_bit(int index) {
+    uint16_t low = pairs.low[index];
+    pairs.low[index] = pairs.high[index];
+    pairs.high[index] = low;
+}
+
+/*
+ * A flipped data bit drops the frame it's in, and noise before the
+ * frames may take the first one. The frames around them still count.
+ */
+void test_resync() {
+    int before = failures;
+
+    for (int run = 0; run < 500; run++) {
+        uint16_t cyfral_code = rand();
+        pairs.n = 0;
+        put_noise(rand() % 100);
+
+        int first = pairs.n;
+        for (byte i = 0; i < DECODE_FRAMES + 3; i++)
+            put_cyfral_frame(cyfral_code);
+
+        flip_bit(first + 36 + 4 + rand() % 32);   // in the second frame
+
+        int end = feed(cyfral_decode, 0);
+        CHECK(end >= first + (DECODE_FRAMES + 1) * 36 - 1 && end <= first + (DECODE_FRAMES + 2) * 36 - 1);
+        CHECK_EQ(scratch.decoder.code, cyfral_code);
+
+        uint32_t metacom = metacom_code();
+        pairs.n = 0;
+        put_noise(rand() % 100);
+
+        first = pairs.n;
+        for (byte i = 0; i < DECODE_FRAMES + 3; i++)
+            put_metacom_frame(metacom);
+
+        flip_bit(first + 36 + 4 + rand() % 32);   // parity catches it
+
+        end = feed(metacom_decode, 0);
+        CHECK(end >= first + (DECODE_FRAMES + 1) * 36 - 1 && end <= first + (DECODE_FRAMES + 2) * 36 - 1);
+        CHECK_EQ(scratch.decoder.code, metacom);
+
+        if (failures != before) {
+            printf("run %d\n", run);
+            return;
+        }
+    }
+}
+
+// Frames that differ don't add up, whatever the count
+void test_changing_code() {
+    pairs.n = 0;
+
+    for (byte i = 0; i < 20; i++)
+        put_cyfral_frame(i % 2 ? 0x1234 : 0x4321);
+    CHECK_EQ(feed(cyfral_decode, 0), -1);
+
+    pairs.n = 0;
+    put_metacom_frame(0x03050609);
+    for (byte i = 0; i < 20; i++)
+        put_metacom_frame(i % 2 ? 0x03050609 : 0x0305060A);
+    CHECK_EQ(feed(metacom_decode, 0), -1);
+}
+
+int main() {
+    srand(1);
+
+    test_cyfral();
+    test_metacom();
+    test_noise();
+    test_resync();
+    test_changing_code();
+
+    return test_result("frame_decode");
+}
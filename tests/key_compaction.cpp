@@ -0,0 +1,176 @@
+/*
+ * Compaction of the key table: a hole left by a deleted key gets
+ * closed a step at a time, and every key has to read the same after
+ * each step as before the move, without reading moving it on, also
+ * across a reset in the middle or with the battery going flat there.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o key_compaction key_compaction.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+#define N_KEYS 6
+
+struct Stored {
+    byte type;
+    uint64_t key;
+    const char *name;
+};
+
+// Short keys between long ones, so a hole is smaller than the record moved into it
+const Stored keys[N_KEYS] = {
+    {KEY_TYPE_DS1990, 0x3D0000A2B3C4D501ULL, "Front door"},
+    {KEY_TYPE_CYFRAL, 0x7E11, "G"},
+    {KEY_TYPE_DS1990, 0x0F00060504030201ULL, "Flat 12, back entrance"},
+    {KEY_TYPE_METACOM, 0x0A0B0C0D, "Gate"},
+    {KEY_TYPE_DS1990, 0xE600F7E6D5C4B301ULL, "Garage"},
+    {KEY_TYPE_CYFRAL, 0x1234, "Bike shed"},
+};
+
+bool present[N_KEYS];
+
+void reset_table() {
+    memset(eeprom_image, 0xFF, E2END + 1);
+    compaction_active = false;
+    init_key_table(display.getBuffer());
+
+    for (byte i = 0; i < N_KEYS; i++) {
+        global_key = (struct Key){keys[i].key, -1, keys[i].type};
+        strcpy(buffer, keys[i].name);
+        CHECK(save_key(true));
+        present[i] = true;
+    }
+}
+
+void delete_stored(byte n) {
+    int index = 0;
+
+    for (byte i = 0; i < n; i++)
+        index += present[i];
+
+    delete_key(index);
+    present[n] = false;
+}
+
+// Every key left reads back whole, by index as the UI gets it
+void check_keys(int line) {
+    int index = 0, n_keys = 0;
+    char name[KEY_NAME_LEN + 1];
+
+    for (byte i = 0; i < N_KEYS; i++)
+        n_keys += present[i];
+
+    CHECK_EQ(EEPROM.readInt(KEY_COUNT_OFFSET), n_keys);
+
+    for (byte i = 0; i < N_KEYS; i++) {
+        if (!present[i])
+            continue;
+
+        Key key = get_key_by_index(index);
+        read_key_name(get_key_offset(index), name);
+
+        if (key.key_type != keys[i].type || key.cur_key != keys[i].key || strcmp(name, keys[i].name)) {
+            printf("%s:%d: key %d reads as %d %llx \"%s\"\n", __FILE__, line, index, key.key_type,
+                   (unsigned long long)key.cur_key, name);
+            failures++;
+        }
+
+        index++;
+    }
+}
+
+// Removes two keys and compacts a step at a time, rebooting after reset_after steps
+void test_compaction(byte first, byte second, int reset_after) {
+    reset_table();
+    delete_stored(first);
+    delete_stored(second);
+
+    int table_end = EEPROM.readInt(KEY_TABLE_END_OFFSET), steps = 0;
+
+    check_keys(__LINE__);
+
+    while (compact_key_table_step()) {
+        byte done = EEPROM.readByte(KEY_COMPACT_DONE_OFFSET);
+        bool active = compaction_active;
+
+        // Reading doesn't move anything on
+        check_keys(__LINE__);
+        CHECK(compaction_active == active && EEPROM.readByte(KEY_COMPACT_DONE_OFFSET) == done);
+
+        if (++steps == reset_after) {
+            compaction_active = false;
+            init_key_table(display.getBuffer());
+            check_keys(__LINE__);
+        }
+
+        if (steps > 200) {
+            printf("%s:%d: compaction doesn't end\n", __FILE__, __LINE__);
+            failures++;
+            break;
+        }
+    }
+
+    CHECK(!compaction_active);
+    check_keys(__LINE__);
+
+    // No holes left, the records end at table_end
+    int offset = KEY_TABLE_OFFSET;
+
+    for (; offset < EEPROM.readInt(KEY_TABLE_END_OFFSET); offset += key_record_size(offset))
+        CHECK(!(EEPROM.readByte(offset + KEY_TYPE_OFFSET) & KEY_FREE));
+
+    CHECK_EQ(offset, EEPROM.readInt(KEY_TABLE_END_OFFSET));
+    CHECK(offset <= table_end);
+}
+
+// Down to a critical cell halfway through a move: nothing gets written, nothing hangs, and it all still reads
+void test_low_battery(bool filtered) {
+    reset_table();
+    delete_stored(1);
+
+    while (compact_key_table_step() && EEPROM.readByte(KEY_COMPACT_DONE_OFFSET) < 2);
+    CHECK(compaction_active);
+
+    int table_end = EEPROM.readInt(KEY_TABLE_END_OFFSET);
+    byte done = EEPROM.readByte(KEY_COMPACT_DONE_OFFSET);
+
+    ADC = BANDGAP_MV_X1024 / (BATTERY_CRITICAL_MV - 100);
+    if (filtered)
+        power_level = POWER_CRITICAL;
+
+    CHECK(!compact_key_table_step());
+    CHECK(!finish_key_compaction());
+
+    global_key = (struct Key){0x1122, -1, KEY_TYPE_CYFRAL};
+    strcpy(buffer, "New");
+    CHECK(!save_key(true));
+    delete_key(0);
+    CHECK(!set_quick_key(0, false));
+
+    CHECK(compaction_active);
+    CHECK_EQ(EEPROM.readByte(KEY_COMPACT_DONE_OFFSET), done);
+    CHECK_EQ(EEPROM.readInt(KEY_TABLE_END_OFFSET), table_end);
+    CHECK_EQ(EEPROM.readByte(KEY_QUICK_OFFSET), QUICK_KEY_NONE);
+
+    check_keys(__LINE__);
+
+    ADC = BANDGAP_MV_X1024 / BATTERY_FULL_MV;
+    power_level = POWER_NORMAL;
+
+    CHECK(finish_key_compaction());
+    check_keys(__LINE__);
+}
+
+int main() {
+    for (byte first = 0; first < N_KEYS - 1; first++) {
+        for (byte second = first + 1; second < N_KEYS; second++) {
+            test_compaction(first, second, -1);
+            test_compaction(first, second, 3);
+        }
+    }
+
+    test_low_battery(false);
+    test_low_battery(true);
+
+    return test_result("key_compaction");
+}
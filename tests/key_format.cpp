@@ -0,0 +1,133 @@
+/*
+ * Key table format on boot: the table of the original firmware gets
+ * migrated with every key kept, even a full one with the longest
+ * names, and a committed journal gets replayed only when its CRC over
+ * the entries as laid out in EEPROM matches.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o key_format key_format.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+#define OLD_SLOTS ((E2END + 1 - OLD_KEY_TABLE_OFFSET) / OLD_KEY_SIZE)
+
+uint64_t old_key(byte n) {
+    return 0x0100000000000001ULL | ((uint64_t)n << 8);
+}
+
+void old_name(byte n, char *name) {
+    memset(name, 'A' + n % 26, KEY_NAME_LEN);
+    name[KEY_NAME_LEN] = '\0';
+}
+
+// Slots written the way the original firmware did, a free run if free_len
+void old_table(byte n_keys, byte free_at, byte free_len) {
+    char name[KEY_NAME_LEN + 1];
+
+    memset(eeprom_image, 0xFF, E2END + 1);
+    eeprom_image[KEY_COUNT_OFFSET] = n_keys;
+    eeprom_image[KEY_COUNT_OFFSET + 1] = 0;
+
+    for (byte i = 0, slot = 0; i < n_keys; i++, slot++) {
+        if (free_len && slot == free_at) {
+            eeprom_image[OLD_KEY_TABLE_OFFSET + slot * OLD_KEY_SIZE] = KEY_FREE | free_len;
+            eeprom_image[OLD_KEY_TABLE_OFFSET + (slot + free_len - 1) * OLD_KEY_SIZE] = KEY_FREE | free_len;
+            slot += free_len;
+        }
+
+        uint8_t *slot_key = eeprom_image + OLD_KEY_TABLE_OFFSET + slot * OLD_KEY_SIZE;
+        uint64_t key = old_key(i);
+
+        old_name(i, name);
+        slot_key[KEY_TYPE_OFFSET] = 1;
+        memcpy(slot_key + OLD_KEY_NAME_OFFSET, name, KEY_NAME_LEN);
+        memcpy(slot_key + OLD_KEY_OFFSET, &key, 8);
+    }
+}
+
+// All keys are there in order, names whole or cut, never anything else
+void check_migrated(byte n_keys, bool whole_names) {
+    char name[KEY_NAME_LEN + 1], old[KEY_NAME_LEN + 1];
+
+    CHECK_EQ(EEPROM.readByte(KEY_MAGIC_OFFSET), KEY_MAGIC);
+    CHECK_EQ(EEPROM.readByte(KEY_VERSION_OFFSET), KEY_FORMAT_VERSION);
+    CHECK_EQ(EEPROM.readInt(KEY_COUNT_OFFSET), n_keys);
+    CHECK(EEPROM.readInt(KEY_TABLE_END_OFFSET) <= KEY_TABLE_LIMIT);
+
+    for (byte i = 0; i < n_keys; i++) {
+        Key key = get_key_by_index(i);
+        byte len = read_key_name(get_key_offset(i), name);
+
+        old_name(i, old);
+        CHECK_EQ(key.key_type, KEY_TYPE_DS1990);
+        CHECK(key.cur_key == old_key(i));
+        CHECK(!strncmp(name, old, len));
+        if (whole_names)
+            CHECK_EQ(len, KEY_NAME_LEN);
+    }
+}
+
+void test_migration() {
+    // Full table with the longest names: too much to keep whole, but all keys stay
+    old_table(OLD_SLOTS, 0, 0);
+    init_key_table(display.getBuffer());
+    check_migrated(OLD_SLOTS, false);
+
+    // A few keys around a free run come over whole
+    old_table(4, 2, 3);
+    init_key_table(display.getBuffer());
+    check_migrated(4, true);
+
+    // Blank EEPROM is an empty table
+    memset(eeprom_image, 0xFF, E2END + 1);
+    init_key_table(display.getBuffer());
+    CHECK_EQ(EEPROM.readInt(KEY_COUNT_OFFSET), 0);
+
+    // A current table is left as it is
+    global_key = (struct Key){old_key(7), -1, KEY_TYPE_DS1990};
+    strcpy(buffer, "Kept");
+    CHECK(save_key(true));
+    init_key_table(display.getBuffer());
+    CHECK_EQ(EEPROM.readInt(KEY_COUNT_OFFSET), 1);
+    CHECK(get_key_by_index(0).cur_key == old_key(7));
+}
+
+// A commit torn after the journal got written: entries as three bytes each
+void torn_commit(int address, byte value, byte crc_delta) {
+    uint8_t entry[JOURNAL_ENTRY_SIZE] = {(uint8_t)(address & 0xFF), (uint8_t)(address >> 8), value};
+
+    memcpy(eeprom_image + JOURNAL_OFFSET + JOURNAL_ENTRIES_OFFSET, entry, JOURNAL_ENTRY_SIZE);
+    eeprom_image[JOURNAL_OFFSET + JOURNAL_LEN_OFFSET] = 1;
+    eeprom_image[JOURNAL_OFFSET + JOURNAL_CRC_OFFSET] = ibutton.crc8(entry, JOURNAL_ENTRY_SIZE) + crc_delta;
+    eeprom_image[JOURNAL_OFFSET + JOURNAL_STATE_OFFSET] = JOURNAL_COMMITTED;
+}
+
+void test_journal() {
+    memset(eeprom_image, 0xFF, E2END + 1);
+    init_key_table(display.getBuffer());
+
+    torn_commit(KEY_QUICK_OFFSET, 0, 0);
+    init_key_table(display.getBuffer());
+    CHECK_EQ(EEPROM.readByte(KEY_QUICK_OFFSET), 0);
+    CHECK(EEPROM.readByte(JOURNAL_OFFSET + JOURNAL_STATE_OFFSET) != JOURNAL_COMMITTED);
+
+    torn_commit(KEY_QUICK_OFFSET, 1, 1);
+    init_key_table(display.getBuffer());
+    CHECK_EQ(EEPROM.readByte(KEY_QUICK_OFFSET), 0);
+
+    // The CRC doesn't depend on how JournalEntry is laid out in memory
+    journal[0] = (struct JournalEntry){KEY_QUICK_OFFSET, 0};
+    journal[1] = (struct JournalEntry){0x3FE, 0xA5};
+    journal_len = 2;
+
+    uint8_t entries[] = {KEY_QUICK_OFFSET & 0xFF, KEY_QUICK_OFFSET >> 8, 0, 0xFE, 0x03, 0xA5};
+    CHECK_EQ(journal_crc(), ibutton.crc8(entries, sizeof(entries)));
+    journal_len = 0;
+}
+
+int main() {
+    test_migration();
+    test_journal();
+
+    return test_result("key_format");
+}
@@ -0,0 +1,237 @@
+/*
+ * Runs tools/keyctl against the firmware's own serial handling: loop()
+ * talks to a pseudo-terminal through the Serial stand-in, with a 64
+ * byte RX buffer which drops what overflows it like the UART, and
+ * keyctl opens the other end. KEYCTL names the keyctl binary, run.sh
+ * builds it.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o keyctl_serial keyctl_serial.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <string>
+
+#define KEYCTL_TIMEOUT_S 30
+
+const char *keyctl;
+char dir[] = "/tmp/keyctl_serialXXXXXX";
+int pty;
+
+std::string path(const char *name) {
+    return std::string(dir) + "/" + name;
+}
+
+void write_file(const char *name, const char *text) {
+    FILE *file = fopen(path(name).c_str(), "w");
+
+    fputs(text, file);
+    fclose(file);
+}
+
+std::string read_file(const char *name) {
+    FILE *file = fopen(path(name).c_str(), "r");
+    std::string text;
+    char chunk[256];
+    size_t n;
+
+    while (file && (n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        text.append(chunk, n);
+
+    if (file)
+        fclose(file);
+
+    return text;
+}
+
+// Runs keyctl with up to two arguments, serving it with loop() until it exits, returns its exit status
+int run(const char *command, const char *arg = NULL, const char *arg2 = NULL) {
+    std::string out = path("out.txt");
+    time_t start = time(NULL);
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+
+    if (pid == 0) {
+        freopen(out.c_str(), "w", stdout);
+        freopen(path("err.txt").c_str(), "w", stderr);
+        execl(keyctl, keyctl, "-p", ptsname(pty), "-s", "0", command, arg, arg2, (char *)NULL);
+        _exit(127);
+    }
+
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (time(NULL) - start > KEYCTL_TIMEOUT_S) {
+            printf("keyctl %s: timed out\n", command);
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            failures++;
+            return -1;
+        }
+
+        loop();
+        usleep(100);
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// What keyctl printed has to be expected
+void check_output(const char *expected, int line) {
+    std::string output = read_file("out.txt");
+
+    if (output != expected) {
+        printf("%s:%d: keyctl printed\n%s", __FILE__, line, output.c_str());
+        failures++;
+    }
+}
+
+int key_count() {
+    return EEPROM.readInt(KEY_COUNT_OFFSET);
+}
+
+const char keys_csv[] =
+    "name,type,key\n"
+    "Home,0,01A2B3C4D5E6F7\n"
+    "\"Flat 12, back\",0,01020304050607\n"
+    "Gate,2,7E11\n"
+    "Office,3,0A0B0C0D\n"
+    "Car,4,1122334455\n";
+
+// As listed back, with the CRC of the DS1990 keys
+const char keys_listed[] =
+    "name,type,key\n"
+    "Home,0,01A2B3C4D5E6F73D\n"
+    "\"Flat 12, back\",0,010203040506070F\n"
+    "Gate,2,7E11\n"
+    "Office,3,0A0B0C0D\n"
+    "Car,4,1122334455\n";
+
+void test_push_and_list() {
+    write_file("keys.csv", keys_csv);
+
+    CHECK_EQ(run("push", path("keys.csv").c_str()), 0);
+    CHECK_EQ(key_count(), 5);
+
+    CHECK_EQ(run("list", "--csv"), 0);
+    check_output(keys_listed, __LINE__);
+
+    // Nothing left to write the second time
+    CHECK_EQ(run("push", path("keys.csv").c_str()), 0);
+    check_output("up to date\n", __LINE__);
+}
+
+void test_pull_json() {
+    CHECK_EQ(run("pull", path("keys.json").c_str()), 0);
+    CHECK(read_file("keys.json").find("{\"name\": \"Flat 12, back\", \"type\": 0, \"key\": \"010203040506070F\"}") !=
+          std::string::npos);
+
+    CHECK_EQ(run("wipe"), 0);
+    CHECK_EQ(key_count(), 0);
+
+    CHECK_EQ(run("push", path("keys.json").c_str()), 0);
+    CHECK_EQ(run("list", "--csv"), 0);
+    check_output(keys_listed, __LINE__);
+}
+
+void test_delete() {
+    CHECK_EQ(run("delete", "1"), 0);
+    CHECK_EQ(key_count(), 4);
+
+    CHECK_EQ(run("list", "--csv"), 0);
+    CHECK(read_file("out.txt").find("Flat 12") == std::string::npos);
+    CHECK(read_file("out.txt").find("Office") != std::string::npos);
+
+    CHECK(run("delete", "9") != 0);
+    CHECK_EQ(key_count(), 4);
+}
+
+// A wrong CRC stops the push before anything gets sent
+void test_bad_crc() {
+    int before = key_count();
+
+    write_file("bad.csv", "name,type,key\nBad,0,01A2B3C4D5E6F700\n");
+    CHECK(run("push", path("bad.csv").c_str()) != 0);
+    CHECK_EQ(key_count(), before);
+}
+
+// A DS1992 goes as its length byte, the ROM with its CRC and the memory image
+void test_memory_key() {
+    uint8_t rom[8] = {0x08, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    std::string line = "Locker room,5,88";
+    char hex[3];
+
+    rom[7] = OneWire::crc8(rom, 7);
+    for (byte i = 0; i < 8 + MEMORY_IMAGE_SIZE; i++) {
+        sprintf(hex, "%02X", i < 8 ? rom[i] : (i - 8) * 7 & 0xFF);
+        line += hex;
+    }
+
+    write_file("memory.csv", ("name,type,key\n" + line + "\n").c_str());
+    CHECK_EQ(run("push", path("memory.csv").c_str()), 0);
+
+    CHECK_EQ(run("list", "--csv"), 0);
+    CHECK(read_file("out.txt").find(line + "\n") != std::string::npos);
+}
+
+// Enough keys to keep the window full the whole time, without overrunning the RX buffer
+void test_many() {
+    std::string csv = "name,type,key\n";
+    char line[64];
+
+    for (int i = 0; i < 40; i++) {
+        sprintf(line, "Key %d,0,01%02X%02X%02X%02X%02X%02X\n", i, i, i * 7 & 0xFF, i * 13 & 0xFF, 0x5A, 0xC3, i * 29 & 0xFF);
+        csv += line;
+    }
+
+    write_file("many.csv", csv.c_str());
+    CHECK_EQ(run("wipe"), 0);
+    CHECK_EQ(run("push", path("many.csv").c_str()), 0);
+    check_output("40 of 40 keys written, 0 differ\n", __LINE__);
+    CHECK_EQ(key_count(), 40);
+    CHECK_EQ(Serial.overruns, 0);
+}
+
+int main() {
+    struct termios tio;
+
+    keyctl = getenv("KEYCTL");
+    if (!keyctl) {
+        printf("keyctl_serial: KEYCTL has to name the keyctl binary\n");
+        return 1;
+    }
+
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+
+    pty = posix_openpt(O_RDWR | O_NOCTTY);
+    grantpt(pty);
+    unlockpt(pty);
+    tcgetattr(pty, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(pty, TCSANOW, &tio);
+
+    memset(eeprom_image, 0xFF, E2END + 1);
+    setup();
+    Serial.fd = pty;
+
+    test_push_and_list();
+    test_pull_json();
+    test_delete();
+    test_bad_crc();
+    test_memory_key();
+    test_many();
+
+    std::string rm = std::string("rm -rf ") + dir;
+    system(rm.c_str());
+
+    return test_result("keyctl_serial");
+}
@@ -0,0 +1,302 @@
+/*
+ * The 1-Wire slave answering a simulated bus master: the master is a
+ * list of lows it pulls and times it samples at, the slave runs from
+ * ow_slave_poll on the key pin and Timer1 stand-ins, with a cycle
+ * counter moved on by _delay_us and by every read of the pin, which
+ * is one turn of ow_wait_fall. Each master timing gets swept on its
+ * own with the rest nominal, every value from a few phases against
+ * the slave's loop. The whole spec range has to pass; how far past it
+ * things still work gets printed. Real loop timings differ a little,
+ * tools/onewire_bench measures them on hardware.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o onewire_slave onewire_slave.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+#define CYCLES_PER_US (F_CPU / 1000000L)
+#define MAX_LOWS 400
+#define PHASES 8
+
+struct Timing {
+    float reset_us;
+    float write1_us;        // low time of a 1 slot
+    float write0_us;        // low time of a 0 slot
+    float read_low_us;
+    float sample_us;        // from the start of a read slot
+    float slot_us;
+    float recovery_us;
+    float presence_sample_us;
+    float reset_high_us;
+};
+
+const Timing standard = {480, 6, 60, 3, 12, 65, 5, 70, 480};
+const Timing overdrive = {70, 1, 8, 1, 2, 10, 2, 8, 48};
+
+struct Sweep {
+    const char *name;
+    float Timing::*field;
+    float spec_min, spec_max;
+    float from, to, step;
+};
+
+const Sweep standard_sweeps[] = {
+    {"reset", &Timing::reset_us, 480, 960, 100, 1200, 10},
+    {"write 1 low", &Timing::write1_us, 1, 15, 1, 45, 1},
+    {"write 0 low", &Timing::write0_us, 60, 120, 10, 125, 1},
+    {"read low", &Timing::read_low_us, 1, 10, 1, 15, 1},
+    {"sample", &Timing::sample_us, 4, 15, 1, 45, 1},
+    {"recovery", &Timing::recovery_us, 1, 20, 0.25, 20, 0.25},
+};
+
+const Sweep overdrive_sweeps[] = {
+    {"reset", &Timing::reset_us, 48, 80, 10, 140, 2},
+    {"write 1 low", &Timing::write1_us, 1, 2, 0.25, 6, 0.25},
+    {"write 0 low", &Timing::write0_us, 6, 16, 1, 22, 0.5},
+    {"read low", &Timing::read_low_us, 1, 1, 0.25, 3, 0.25},
+    {"sample", &Timing::sample_us, 1.5, 2, 0.25, 6, 0.25},
+    {"recovery", &Timing::recovery_us, 1, 4, 0.25, 6, 0.25},
+};
+
+const uint8_t rom[8] = {0x01, 0xB5, 0xC4, 0xD3, 0xE2, 0x00, 0x00, 0x3D};
+
+uint32_t now;                       // CPU cycles
+uint32_t master_t;
+uint32_t master_lows[MAX_LOWS][2];
+int n_master_lows, master_next;
+uint32_t slave_lows[MAX_LOWS][2];
+int n_slave_lows;
+bool slave_pulling;
+uint32_t read_at[MAX_LOWS], presence_at[2];
+int n_reads, n_presences;
+
+uint32_t cycles(float us) {
+    return us * CYCLES_PER_US + 0.5;
+}
+
+#pragma region BUS
+
+uint8_t read_pin(uint8_t) {
+    now += OW_LOOP_CYCLES;
+
+    while (master_next < n_master_lows && master_lows[master_next][1] <= now)
+        master_next++;
+
+    bool master_low = master_next < n_master_lows && master_lows[master_next][0] <= now;
+    return master_low || slave_pulling ? 0 : _BV(KEY_PIN_BIT);
+}
+
+uint16_t read_timer(uint16_t) {
+    return now;
+}
+
+void ddr_written(uint8_t ddr) {
+    bool pulling = ddr & _BV(KEY_PIN_BIT);
+
+    if (pulling && !slave_pulling) {
+        slave_lows[n_slave_lows][0] = now;
+    } else if (!pulling && slave_pulling) {
+        slave_lows[n_slave_lows][1] = now;
+        if (n_slave_lows < MAX_LOWS - 1)
+            n_slave_lows++;
+    }
+
+    slave_pulling = pulling;
+}
+
+void pass_time(double us) {
+    now += us * CYCLES_PER_US;
+}
+
+// Only good once the slave is done, as the master can't see ahead
+bool bus_low_at(uint32_t t) {
+    for (int i = 0; i < n_master_lows; i++)
+        if (master_lows[i][0] <= t && t < master_lows[i][1])
+            return true;
+
+    for (int i = 0; i < n_slave_lows; i++)
+        if (slave_lows[i][0] <= t && t < slave_lows[i][1])
+            return true;
+
+    return false;
+}
+
+#pragma endregion
+
+#pragma region MASTER
+
+void master_begin(byte phase) {
+    master_t = cycles(100) + phase;
+    n_master_lows = master_next = n_slave_lows = n_reads = n_presences = 0;
+    slave_pulling = false;
+}
+
+void master_low(float us) {
+    master_lows[n_master_lows][0] = master_t;
+    master_lows[n_master_lows][1] = master_t + cycles(us);
+    n_master_lows++;
+}
+
+void master_reset(const Timing &t) {
+    master_low(t.reset_us);
+    presence_at[n_presences++] = master_t + cycles(t.reset_us + t.presence_sample_us);
+    master_t += cycles(t.reset_us + t.reset_high_us);
+}
+
+void master_write_bit(const Timing &t, bool bit) {
+    float low = bit ? t.write1_us : t.write0_us;
+
+    master_low(low);
+    master_t += cycles(max(low, t.slot_us) + t.recovery_us);
+}
+
+void master_write_byte(const Timing &t, uint8_t value) {
+    for (byte i = 0; i < 8; i++)
+        master_write_bit(t, (value >> i) & 1);
+}
+
+void master_read_bit(const Timing &t) {
+    master_low(t.read_low_us);
+    read_at[n_reads++] = master_t + cycles(t.sample_us);
+    master_t += cycles(max(max(t.read_low_us, t.sample_us), t.slot_us) + t.recovery_us);
+}
+
+// The slave answers the whole script, then waits out its idle time
+bool slave_answers() {
+    now = 0;
+    ow_speed = OW_STANDARD;
+    ow_slave_poll(rom, NULL, OW_LOOPS(1000));
+
+    if (now < master_t)
+        return false;
+
+    for (int i = 0; i < n_presences; i++)
+        if (!bus_low_at(presence_at[i]))
+            return false;
+
+    return true;
+}
+
+bool master_read(int i) {
+    return !bus_low_at(read_at[i]);
+}
+
+#pragma endregion
+
+bool read_rom(const Timing &t, byte phase) {
+    master_begin(phase);
+    master_reset(t);
+    master_write_byte(t, 0x33);
+    for (byte i = 0; i < 64; i++)
+        master_read_bit(t);
+
+    if (!slave_answers())
+        return false;
+
+    for (byte i = 0; i < 64; i++)
+        if (master_read(i) != ((rom[i / 8] >> (i % 8)) & 1))
+            return false;
+
+    return true;
+}
+
+// The only key on the bus: every bit comes with its complement, the master takes it
+bool search_rom(const Timing &t, byte phase) {
+    master_begin(phase);
+    master_reset(t);
+    master_write_byte(t, 0xF0);
+    for (byte i = 0; i < 64; i++) {
+        master_read_bit(t);
+        master_read_bit(t);
+        master_write_bit(t, (rom[i / 8] >> (i % 8)) & 1);
+    }
+
+    if (!slave_answers())
+        return false;
+
+    for (byte i = 0; i < 64; i++) {
+        bool bit = (rom[i / 8] >> (i % 8)) & 1;
+        if (master_read(i * 2) != bit || master_read(i * 2 + 1) == bit)
+            return false;
+    }
+
+    return true;
+}
+
+// Overdrive Match ROM at standard speed, then Read ROM with an overdrive reset
+bool overdrive_read_rom(const Timing &t, byte phase) {
+    master_begin(phase);
+    master_reset(standard);
+    master_write_byte(standard, 0x69);
+    for (byte i = 0; i < 8; i++)
+        master_write_byte(t, rom[i]);
+    master_reset(t);
+    master_write_byte(t, 0x33);
+    for (byte i = 0; i < 64; i++)
+        master_read_bit(t);
+
+    if (!slave_answers())
+        return false;
+
+    for (byte i = 0; i < 64; i++)
+        if (master_read(i) != ((rom[i / 8] >> (i % 8)) & 1))
+            return false;
+
+    return true;
+}
+
+bool passes(const Timing &t, bool is_overdrive) {
+    for (byte phase = 0; phase < PHASES; phase++) {
+        if (is_overdrive ? !overdrive_read_rom(t, phase) : !read_rom(t, phase) || !search_rom(t, phase))
+            return false;
+    }
+
+    return true;
+}
+
+void sweep(const char *speed, const Timing &nominal, const Sweep *sweeps, byte n_sweeps) {
+    bool is_overdrive = &nominal == &overdrive;
+
+    CHECK(passes(nominal, is_overdrive));
+
+    for (byte i = 0; i < n_sweeps; i++) {
+        const Sweep &s = sweeps[i];
+        float lowest = -1, highest = -1;
+        Timing t = nominal;
+
+        for (float value = s.from; value <= s.to; value += s.step) {
+            t.*s.field = value;
+            bool ok = passes(t, is_overdrive);
+
+            if (value >= s.spec_min && value <= s.spec_max && !ok) {
+                printf("%s:%d: %s %s fails at %g us\n", __FILE__, __LINE__, speed, s.name, value);
+                failures++;
+            }
+
+            if (ok && lowest < 0)
+                lowest = value;
+            if (ok)
+                highest = value;
+        }
+
+        printf("onewire_slave: %s %s passes %g..%g us (spec %g..%g, swept %g..%g)\n",
+               speed, s.name, lowest, highest, s.spec_min, s.spec_max, s.from, s.to);
+    }
+}
+
+int main() {
+    PINC.on_read = read_pin;
+    DDRC.on_written = ddr_written;
+    TCNT1.on_read = read_timer;
+    fake_delay_us = pass_time;
+
+    sweep("standard", standard, standard_sweeps, sizeof(standard_sweeps) / sizeof(standard_sweeps[0]));
+    sweep("overdrive", overdrive, overdrive_sweeps, sizeof(overdrive_sweeps) / sizeof(overdrive_sweeps[0]));
+
+    // A low too short for a reset gets no answer
+    Timing t = standard;
+    t.reset_us = 100;
+    CHECK(!read_rom(t, 0));
+
+    return test_result("onewire_slave");
+}
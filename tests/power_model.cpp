@@ -0,0 +1,92 @@
+/*
+ * Duty-cycle model of the idle sleep. setup() and loop() run on the fake
+ * clock for a simulated day in which something wakes the device every
+ * WAKE_INTERVAL_S; how long it stays awake each time comes from the
+ * firmware itself, and every sleep jumps to the next wake-up. The
+ * currents are typical datasheet figures for a 3.3 V 8 MHz Pro Mini
+ * with its power LED removed, so the results are estimates, not
+ * measurements.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o power_model power_model.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+#define MODEL_HOURS 24
+#define WAKE_INTERVAL_S 3600
+#define LOOP_US 100             // one pass through an idle loop(), the fake clock only moves with delay
+
+#define MCU_ACTIVE_UA 3500      // ATmega328P at 8 MHz and 3.3 V, delay() spins
+#define MCU_POWER_DOWN_UA 1     // watchdog and BOD off
+#define DISPLAY_ON_UA 8000      // SSD1306 with a menu lit, about a quarter of the pixels
+#define DISPLAY_OFF_UA 10       // SSD1306 display off, its sleep current
+#define REGULATOR_UA 80         // MIC5205 ground current at a light load
+
+unsigned long long slept_us = 0;
+unsigned long sleeps = 0, awake_since_us = 0;
+unsigned long shortest_awake_us = ~0UL, longest_awake_us = 0;
+
+unsigned long long now_us() {
+    return micros() + slept_us;
+}
+
+// millis stops in power-down, so only the wall clock moves on
+void sleep_until_next_wake() {
+    unsigned long awake = micros() - awake_since_us;
+    unsigned long long next = (now_us() / (WAKE_INTERVAL_S * 1000000ULL) + 1) * WAKE_INTERVAL_S * 1000000ULL;
+
+    CHECK(!display.on);
+
+    if (awake < shortest_awake_us)
+        shortest_awake_us = awake;
+
+    if (awake > longest_awake_us)
+        longest_awake_us = awake;
+
+    slept_us += next - now_us();
+    sleeps++;
+}
+
+// Commands go out as transfers starting with a 0x00 control byte
+void display_transfer(uint8_t address, uint8_t *data, uint8_t len) {
+    for (uint8_t i = 1; data[0] == 0x00 && i < len; i++)
+        display.ssd1306_command(data[i]);
+}
+
+int main() {
+    unsigned long long total_us = MODEL_HOURS * 3600000000ULL;
+
+    fake_sleep = sleep_until_next_wake;
+    fake_twi = display_transfer;
+    setup();
+
+    while (now_us() < total_us) {
+        unsigned long before = sleeps;
+
+        loop();
+        delayMicroseconds(LOOP_US);
+
+        if (sleeps != before) {
+            CHECK(display.on);
+            awake_since_us = micros();
+        }
+    }
+
+    double awake = (double)micros() / total_us;
+    double awake_ua = MCU_ACTIVE_UA + DISPLAY_ON_UA + REGULATOR_UA;
+    double asleep_ua = MCU_POWER_DOWN_UA + DISPLAY_OFF_UA + REGULATOR_UA;
+    double average_ua = awake * awake_ua + (1 - awake) * asleep_ua;
+
+    printf("power_model: awake %.2f%% of the time, %lu sleeps, %.0f uA on average "
+           "(%.0f uA awake, %.0f uA asleep, %.0f times less than never sleeping)\n",
+           awake * 100, sleeps, average_ua, awake_ua, asleep_ua, awake_ua / average_ua);
+
+    // Sleeps once per wake-up, and only after IDLE_SLEEP_MS without input
+    CHECK_EQ(sleeps, MODEL_HOURS * 3600 / WAKE_INTERVAL_S);
+    CHECK(shortest_awake_us >= IDLE_SLEEP_MS * 1000UL);
+    CHECK(longest_awake_us <= (IDLE_SLEEP_MS + 1000) * 1000UL);
+    CHECK(awake_ua / asleep_ua > 100);
+    CHECK(awake_ua / average_ua > 10);
+
+    return test_result("power_model");
+}
@@ -0,0 +1,204 @@
+/*
+ * Round trips of raw traces through raw_trace_put, raw_trace_flush
+ * and raw_trace_next, checking the codes written along the way.
+ *
+ * Build: g++ -std=gnu++11 -fpermissive -Wall -Wno-unknown-pragmas -no-pie -Iarduino -o raw_trace raw_trace.cpp arduino/arduino.cpp
+ */
+#include "../main.cpp"
+#include "test.h"
+
+bool flushed;
+
+// Packs intervals into raw_trace like read_raw, returns how many went in
+int encode(const uint16_t *intervals, int n) {
+    RawWriter writer = {0, 0, {0, 0}};
+    int i;
+
+    raw_trace[0] = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!raw_trace_put(&writer, intervals[i]))
+            break;
+    }
+
+    flushed = raw_trace_flush(&writer);
+    return i;
+}
+
+int decode(uint16_t *intervals, int max_n) {
+    RawReader reader = {1, 0, {0, 0}};
+    int n = 0;
+    uint16_t interval;
+
+    while (n < max_n && (interval = raw_trace_next(&reader)))
+        intervals[n++] = interval;
+
+    return n;
+}
+
+// What should come back: intervals within RAW_JITTER of the one two back become that one
+void fold_jitter(const uint16_t *intervals, uint16_t *expected, int n) {
+    for (int i = 0; i < n; i++) {
+        expected[i] = intervals[i];
+
+        if (i >= 2 && abs((int)intervals[i] - (int)expected[i - 2]) <= RAW_JITTER)
+            expected[i] = expected[i - 2];
+    }
+}
+
+void check_round_trip(const uint16_t *intervals, int n) {
+    static uint16_t expected[1024], decoded[1024];
+    int n_put = encode(intervals, n);
+
+    CHECK(raw_trace[0] < RAW_TRACE_SIZE);
+    fold_jitter(intervals, expected, n_put);
+
+    // Repeats still pending when the trace filled up get lost, what's left is a prefix
+    int n_decoded = decode(decoded, 1024);
+    if (flushed)
+        CHECK_EQ(n_decoded, n_put);
+    else
+        CHECK(n_decoded < n_put && raw_trace[0] >= RAW_TRACE_SIZE - 2);
+
+    for (int i = 0; i < n_decoded; i++) {
+        if (decoded[i] != expected[i]) {
+            printf("interval %d of %d: %u, not %u\n", i, n_decoded, decoded[i], expected[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+void check_codes(const uint8_t *codes, byte n) {
+    CHECK_EQ(raw_trace[0], n);
+
+    for (byte i = 0; i < n && i < raw_trace[0]; i++)
+        CHECK_EQ(raw_trace[1 + i], codes[i]);
+}
+
+void test_literals() {
+    const uint16_t intervals[] = {5, 100, 40, 127, 1};
+    const uint8_t codes[] = {5, 100, 40, 127, 1};
+
+    CHECK_EQ(encode(intervals, 5), 5);
+    check_codes(codes, 5);
+    check_round_trip(intervals, 5);
+}
+
+void test_repeats() {
+    uint16_t intervals[2 + RAW_MAX_REPEAT * 4 + 2];
+
+    for (int i = 0; i < (int)(sizeof(intervals) / sizeof(intervals[0])); i++)
+        intervals[i] = i % 2 ? 30 : 60;
+
+    // Exactly RAW_MAX_REPEAT pairs after the first one fit in one code
+    const uint8_t one[] = {60, 30, RAW_CODE_REPEAT | (RAW_MAX_REPEAT - 1)};
+    CHECK_EQ(encode(intervals, 2 + RAW_MAX_REPEAT * 2), 2 + RAW_MAX_REPEAT * 2);
+    check_codes(one, 3);
+    check_round_trip(intervals, 2 + RAW_MAX_REPEAT * 2);
+
+    // A pair more takes a second one
+    const uint8_t two[] = {60, 30, RAW_CODE_REPEAT | (RAW_MAX_REPEAT - 1), RAW_CODE_REPEAT};
+    CHECK_EQ(encode(intervals, 2 + RAW_MAX_REPEAT * 2 + 2), 2 + RAW_MAX_REPEAT * 2 + 2);
+    check_codes(two, 4);
+    check_round_trip(intervals, 2 + RAW_MAX_REPEAT * 2 + 2);
+
+    check_round_trip(intervals, sizeof(intervals) / sizeof(intervals[0]));
+}
+
+void test_odd_runs() {
+    // A lone repeat can't make a pair, it's written as a zero delta
+    const uint16_t lone[] = {60, 30, 60};
+    const uint8_t lone_codes[] = {60, 30, RAW_CODE_DELTA};
+    encode(lone, 3);
+    check_codes(lone_codes, 3);
+    check_round_trip(lone, 3);
+
+    // Three pairs and a half, then something else
+    const uint16_t odd[] = {60, 30, 60, 30, 60, 30, 60, 90};
+    const uint8_t odd_codes[] = {60, 30, RAW_CODE_REPEAT | 1, RAW_CODE_DELTA, 90};
+    encode(odd, 8);
+    check_codes(odd_codes, 5);
+    check_round_trip(odd, 8);
+
+    // Jitter folds into the run
+    const uint16_t jitter[] = {60, 30, 61, 29, 59, 31, 60};
+    check_round_trip(jitter, 7);
+}
+
+void test_deltas() {
+    // Deltas are from the interval two back, -16..15
+    const uint16_t intervals[] = {50, 60, 65, 44, 81, 27, 97};
+    const uint8_t codes[] = {50, 60, RAW_CODE_DELTA | 15, RAW_CODE_DELTA | (-16 & 0x1F), 16 + 65, 27};
+
+    encode(intervals, 6);
+    check_codes(codes, 6);
+    check_round_trip(intervals, 7);
+}
+
+void test_long() {
+    const uint16_t intervals[] = {300, RAW_MAX_INTERVAL, 310, 128, 4};
+    const uint8_t codes[] = {RAW_CODE_LONG | 1, 300 & 0xFF, RAW_CODE_LONG | 0x0F, 0xFF, RAW_CODE_DELTA | 10, RAW_CODE_LONG, 128, 4};
+
+    encode(intervals, 5);
+    check_codes(codes, 8);
+    check_round_trip(intervals, 5);
+}
+
+void test_full() {
+    uint16_t intervals[RAW_TRACE_SIZE * 2];
+
+    // Nothing repeats, so the trace fills up and takes a prefix
+    for (byte i = 0; i < RAW_TRACE_SIZE * 2; i++)
+        intervals[i] = 20 + (i * 37) % 100 + (i % 2) * 300;
+
+    int n_put = encode(intervals, RAW_TRACE_SIZE * 2);
+    CHECK(n_put > 0 && n_put < RAW_TRACE_SIZE * 2);
+    check_round_trip(intervals, RAW_TRACE_SIZE * 2);
+
+    // A long code that doesn't fit in whole isn't started
+    for (byte i = 0; i < RAW_TRACE_SIZE * 2; i++)
+        intervals[i] = 200 + i * 40;
+
+    encode(intervals, RAW_TRACE_SIZE * 2);
+    CHECK_EQ(raw_trace[0], (RAW_TRACE_SIZE - 1) / 2 * 2);
+    check_round_trip(intervals, RAW_TRACE_SIZE * 2);
+}
+
+void test_random() {
+    uint16_t intervals[600];
+
+    srand(1);
+
+    for (int run = 0; run < 2000; run++) {
+        int n = 1 + rand() % 600;
+        byte period = 1 + rand() % 6;
+
+        // A code sent over and over with some jitter and the odd glitch, like a key on the pad
+        for (int i = 0; i < n; i++) {
+            if (i < period || rand() % 50 == 0)
+                intervals[i] = 1 + rand() % (rand() % 4 ? 120 : RAW_MAX_INTERVAL);
+            else
+                intervals[i] = constrain((int)intervals[i - period] + rand() % 3 - 1, 1, RAW_MAX_INTERVAL);
+        }
+
+        check_round_trip(intervals, n);
+
+        if (failures) {
+            printf("run %d\n", run);
+            break;
+        }
+    }
+}
+
+int main() {
+    test_literals();
+    test_repeats();
+    test_odd_runs();
+    test_deltas();
+    test_long();
+    test_full();
+    test_random();
+
+    return test_result("raw_trace");
+}
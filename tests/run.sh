@@ -0,0 +1,30 @@
+#!/bin/sh
+# Builds and runs every test: tests/run.sh
+cd "$(dirname "$0")" || exit 1
+out=$(mktemp -d) || exit 1
+status=0
+
+# keyctl_serial drives the host tool against the firmware
+g++ -std=c++11 -O2 -Wall -Wextra -o "$out/keyctl" ../tools/keyctl.cpp || status=1
+export KEYCTL="$out/keyctl"
+
+# The screen and function tables of main.cpp keep addresses in ints,
+# which takes -fpermissive on a 64-bit host (-no-pie keeps them below
+# 4 GB). GCC can't turn just those diagnostics off, so they are dropped
+# from the output and anything else gets shown.
+build() {
+    g++ -std=gnu++11 -fpermissive -fdiagnostics-plain-output -Wall -Wno-unknown-pragmas -no-pie -Iarduino "$@" 2>"$out/log"
+    built=$?
+    grep -v "to 'int' loses precision \[-fpermissive\]" "$out/log" >"$out/shown"
+    grep -q ": \(warning\|error\|note\):" "$out/shown" && cat "$out/shown" >&2
+    return $built
+}
+
+for test in *.cpp; do
+    name=${test%.cpp}
+    build -o "$out/$name" "$test" arduino/arduino.cpp &&
+        "$out/$name" || status=1
+done
+
+rm -rf "$out"
+exit $status
@@ -0,0 +1,30 @@
+/*
+ * The tests include main.cpp whole, built against the stand-ins in
+ * arduino/, and call its functions directly. Each one is a program
+ * which prints what failed and exits with 1 if anything did.
+ */
+#pragma once
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) do { \
+        long long _a = (a), _b = (b); \
+        if (_a != _b) { \
+            printf("%s:%d: %s is %lld, not %lld\n", __FILE__, __LINE__, #a, _a, _b); \
+            failures++; \
+        } \
+    } while (0)
+
+static int test_result(const char *name) {
+    printf("%s: %s\n", name, failures ? "FAILED" : "OK");
+    return failures != 0;
+}
@@ -0,0 +1,1276 @@
+/*
+ * keyctl - manages the keys kept by the emulator over its serial port.
+ *
+ * Build: g++ -std=c++11 -O2 -Wall -Wextra -o keyctl keyctl.cpp
+ *
+ *   keyctl [options] list [--csv | --json]    print the stored keys
+ *   keyctl [options] pull FILE                save the stored keys to FILE
+ *   keyctl [options] push FILE                write the keys from FILE and check them
+ *   keyctl [options] delete INDEX
+ *   keyctl [options] wipe
+ *   keyctl [options] default INDEX [always]   key emulated from power-on with the
+ *                                             middle button held, or always
+ *   keyctl [options] default none
+ *   keyctl [options] timing                   bus gaps of the last DS1990 emulation
+ *   keyctl [options] events                   the event log, oldest first
+ *   keyctl [options] sniff FILE               capture the 1-Wire traffic on the pad
+ *                                             until Ctrl-C or a button press, save it
+ *                                             to FILE and print it
+ *   keyctl decode FILE                        print a saved capture
+ *
+ * Options:
+ *   -p PORT    serial port, /dev/ttyUSB0 by default
+ *   -b BAUD    9600 by default
+ *   -s MS      time to wait after opening the port, as the Pro Mini resets
+ *              on DTR, 2000 by default (0 for a pseudo-terminal)
+ *   -w BYTES   bytes of commands kept in flight, 48 by default
+ *   -v         show everything the device prints
+ *
+ * FILE is CSV or JSON, picked by its extension:
+ *
+ *   name,type,key
+ *   Home,0,01A2B3C4D5E6F7
+ *
+ *   [{"name": "Home", "type": 0, "key": "01A2B3C4D5E6F7"}]
+ *
+ * key holds the payload in hex, for DS1990 the CRC byte may be left
+ * out: it gets computed here and, when present, checked. A memory
+ * iButton (type 5) is listed as its length byte 88, the ROM with its
+ * CRC and the 128 byte memory image, and gets written the same way. Every command
+ * is answered with a line starting with OK or ERR, so commands go out
+ * back to back while the ones not yet answered fit in the window,
+ * which has to stay below the 64 byte RX buffer of the device.
+ *
+ * Both push and pull only move the keys which differ: the device
+ * hashes every key with its name (H), and the sum of the hashes tells
+ * in one line whether there's anything to do. After a push the hashes
+ * get checked again, and the keys listed back only if one is missing.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define KEY_NAME_LEN 32
+#define RX_BUFFER_SIZE 64
+#define ACK_TIMEOUT_MS 5000
+#define KEY_TYPE_DS1990 0
+#define KEY_TYPE_RAW 1
+#define KEY_TYPE_DS1992 5
+#define RAW_TRACE_SIZE 48
+#define N_KEY_TYPES 6
+#define MEMORY_IMAGE_OFFSET 9
+#define MEMORY_PAYLOAD_LEN (MEMORY_IMAGE_OFFSET + 128)
+#define MEMORY_WRITE_CHUNK 8
+#define SNIFF_END 0
+#define SNIFF_RESET 1
+#define SNIFF_PRESENCE 2
+#define SNIFF_BYTE 3
+#define SNIFF_BITS 4
+#define SNIFF_LATE 5
+#define SNIFF_DROPPED 6
+#define SNIFF_START 7
+#define N_SNIFF_TAGS 8
+#define SNIFF_TIMEOUT_MS 2000
+
+// Payload bytes for every key type, 0 for the variable length ones starting with their length
+static const int key_payload_lens[N_KEY_TYPES] = {8, 0, 2, 4, 5, 0};
+
+struct Key {
+    std::string name;
+    int type;
+    std::vector<unsigned char> payload;
+};
+
+static int port = -1;
+static bool verbose = false;
+static size_t window = 48;
+static std::string pending;     // read from the port but not yet taken
+static volatile sig_atomic_t interrupted = 0;
+
+static void die(const char *fmt, const char *arg = "") {
+    fprintf(stderr, "keyctl: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Dallas/Maxim CRC8, the same as OneWire::crc8
+static unsigned char crc8(const unsigned char *data, size_t len) {
+    unsigned char crc = 0;
+
+    while (len--) {
+        unsigned char in = *data++;
+
+        for (int i = 0; i < 8; i++) {
+            unsigned char mix = (crc ^ in) & 0x01;
+            crc >>= 1;
+            if (mix)
+                crc ^= 0x8C;
+            in >>= 1;
+        }
+    }
+
+    return crc;
+}
+
+// CRC16 the way OneWire::crc16 computes it, without the final inversion
+static unsigned short crc16(const unsigned char *data, size_t len, unsigned short crc = 0) {
+    while (len--) {
+        crc ^= *data++;
+
+        for (int i = 0; i < 8; i++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+static speed_t baud_constant(int baud) {
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+    }
+
+    die("unsupported baud rate");
+    return B0;
+}
+
+static void open_port(const char *path, int baud, int settle_ms) {
+    port = open(path, O_RDWR | O_NOCTTY);
+    if (port < 0)
+        die("can't open %s", path);
+
+    struct termios tio;
+    if (tcgetattr(port, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, baud_constant(baud));
+        cfsetospeed(&tio, baud_constant(baud));
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(port, TCSANOW, &tio);
+    }
+
+    if (settle_ms)
+        usleep(settle_ms * 1000L);
+
+    // Wakes the device up if it sleeps, the byte itself gets lost
+    if (write(port, "\n", 1) != 1)
+        die("can't write to %s", path);
+    usleep(20000);
+    tcflush(port, TCIFLUSH);
+}
+
+static void send(const std::string &command) {
+    size_t sent = 0;
+
+    while (sent < command.size()) {
+        ssize_t n = write(port, command.data() + sent, command.size() - sent);
+
+        if (n < 0 && errno != EINTR && errno != EAGAIN)
+            die("write failed");
+        if (n > 0)
+            sent += n;
+    }
+}
+
+// Returns the next line the device prints, without the line ending
+static std::string read_line() {
+    long deadline = now_ms() + ACK_TIMEOUT_MS;
+
+    for (;;) {
+        size_t end = pending.find('\n');
+
+        if (end != std::string::npos) {
+            std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            if (verbose)
+                fprintf(stderr, "< %s\n", line.c_str());
+
+            return line;
+        }
+
+        long left = deadline - now_ms();
+        if (left <= 0)
+            die("no answer from the device");
+
+        struct pollfd pfd = {port, POLLIN, 0};
+        if (poll(&pfd, 1, (int)left) <= 0)
+            continue;
+
+        char chunk[128];
+        ssize_t n = read(port, chunk, sizeof(chunk));
+
+        if (n > 0)
+            pending.append(chunk, n);
+        else if (n < 0 && errno != EINTR && errno != EAGAIN)
+            die("read failed");
+    }
+}
+
+static bool is_ack(const std::string &line) {
+    return line.compare(0, 2, "OK") == 0 || line.compare(0, 3, "ERR") == 0;
+}
+
+/*
+ * Sends commands keeping at most window bytes of them unanswered and
+ * collects the acks in order. Lines which aren't acks go to body.
+ */
+static std::vector<std::string> run(const std::vector<std::string> &commands,
+                                    std::vector<std::string> *body = NULL) {
+    std::vector<std::string> acks;
+    std::deque<size_t> in_flight;
+    size_t in_flight_bytes = 0, next = 0;
+
+    while (acks.size() < commands.size()) {
+        while (next < commands.size() &&
+               (in_flight.empty() || in_flight_bytes + commands[next].size() <= window)) {
+            if (verbose)
+                fprintf(stderr, "> %s\n", commands[next].c_str());
+
+            send(commands[next]);
+            in_flight.push_back(commands[next].size());
+            in_flight_bytes += commands[next].size();
+            next++;
+        }
+
+        std::string line = read_line();
+
+        if (!is_ack(line)) {
+            if (body)
+                body->push_back(line);
+            continue;
+        }
+
+        acks.push_back(line);
+        in_flight_bytes -= in_flight.front();
+        in_flight.pop_front();
+    }
+
+    return acks;
+}
+
+static std::string to_hex(const std::vector<unsigned char> &bytes) {
+    std::string hex;
+    char digits[3];
+
+    for (size_t i = 0; i < bytes.size(); i++) {
+        snprintf(digits, sizeof(digits), "%02X", bytes[i]);
+        hex += digits;
+    }
+
+    return hex;
+}
+
+static bool from_hex(const std::string &text, std::vector<unsigned char> *bytes) {
+    std::string hex;
+
+    for (size_t i = 0; i < text.size(); i++) {
+        if (isxdigit((unsigned char)text[i]))
+            hex += text[i];
+        else if (text[i] != ' ' && text[i] != ':')
+            return false;
+    }
+
+    if (hex.size() % 2)
+        return false;
+
+    bytes->clear();
+    for (size_t i = 0; i < hex.size(); i += 2)
+        bytes->push_back((unsigned char)strtol(hex.substr(i, 2).c_str(), NULL, 16));
+
+    return true;
+}
+
+// Brings a key from a file to what the device stores, false with a reason in error
+static bool check_key(Key *key, std::string *error) {
+    if (key->name.empty() || key->name.size() > KEY_NAME_LEN ||
+            key->name.find_first_of("\"[]") != std::string::npos) {
+        *error = "bad name";
+        return false;
+    }
+
+    if (key->type < 0 || key->type >= N_KEY_TYPES || key->type == KEY_TYPE_RAW) {
+        *error = "type can't be written over serial";
+        return false;
+    }
+
+    if (key->type == KEY_TYPE_DS1992) {
+        const std::vector<unsigned char> &p = key->payload;
+
+        if (p.size() != MEMORY_PAYLOAD_LEN || p[0] != MEMORY_PAYLOAD_LEN - 1) {
+            *error = "wrong key length";
+            return false;
+        }
+
+        if (crc8(p.data() + 1, 7) != p[8]) {
+            *error = "wrong CRC";
+            return false;
+        }
+
+        return true;
+    }
+
+    size_t len = key_payload_lens[key->type];
+
+    if (key->type == KEY_TYPE_DS1990 && key->payload.size() == len - 1)
+        key->payload.push_back(crc8(key->payload.data(), len - 1));
+
+    if (key->payload.size() != len) {
+        *error = "wrong key length";
+        return false;
+    }
+
+    if (key->type == KEY_TYPE_DS1990 && crc8(key->payload.data(), len - 1) != key->payload[len - 1]) {
+        *error = "wrong CRC";
+        return false;
+    }
+
+    return true;
+}
+
+// A W command, memory keys get their image after it with M commands
+static void write_commands(const Key &key, std::vector<std::string> *commands) {
+    std::ostringstream command;
+
+    command << "[W ";
+    if (key.name.find(' ') != std::string::npos)
+        command << '"' << key.name << '"';
+    else
+        command << key.name;
+    command << ' ' << key.type;
+
+    // The device adds the CRC itself
+    size_t first = key.type == KEY_TYPE_DS1992 ? 1 : 0;
+    size_t len = key.type == KEY_TYPE_DS1990 || key.type == KEY_TYPE_DS1992 ? first + 7 : key.payload.size();
+    char digits[16];
+    for (size_t i = first; i < len; i++) {
+        snprintf(digits, sizeof(digits), " %02X", key.payload[i]);
+        command << digits;
+    }
+    command << ']';
+    commands->push_back(command.str());
+
+    if (key.type != KEY_TYPE_DS1992)
+        return;
+
+    for (size_t i = MEMORY_IMAGE_OFFSET; i < key.payload.size(); i += MEMORY_WRITE_CHUNK) {
+        std::ostringstream chunk;
+        chunk << "[M " << i - MEMORY_IMAGE_OFFSET;
+
+        for (size_t j = i; j < i + MEMORY_WRITE_CHUNK && j < key.payload.size(); j++) {
+            snprintf(digits, sizeof(digits), " %02X", key.payload[j]);
+            chunk << digits;
+        }
+
+        chunk << ']';
+        commands->push_back(chunk.str());
+    }
+}
+
+/*
+ * A listing line is "index name type payload", where the name may have
+ * spaces. It gets split from the end: the type is the last token which
+ * is followed by exactly as many payload bytes as the type has, a raw
+ * trace or a memory key starts with its own length.
+ */
+static bool parse_listing(const std::string &line, Key *key) {
+    std::istringstream in(line);
+    std::vector<std::string> tokens;
+    std::string token;
+
+    while (in >> token)
+        tokens.push_back(token);
+
+    if (tokens.size() < 3 || !isdigit((unsigned char)tokens[0][0]))
+        return false;
+
+    for (size_t p = tokens.size() - 1; p >= 2; p--) {
+        char *end;
+        long type = strtol(tokens[p].c_str(), &end, 10);
+
+        // Payload bytes always have two digits, the type never has a leading zero
+        if (*end || type < 0 || type >= N_KEY_TYPES || tokens[p] != std::to_string(type))
+            continue;
+
+        size_t n_bytes = tokens.size() - p - 1;
+        size_t want = key_payload_lens[type];
+        if (key_payload_lens[type] == 0)
+            want = n_bytes ? strtol(tokens[p + 1].c_str(), NULL, 16) + 1 : 1;
+
+        if (n_bytes != want)
+            continue;
+
+        std::vector<unsigned char> payload, byte;
+        bool hex = true;
+        for (size_t i = p + 1; i < tokens.size() && hex; i++) {
+            hex = tokens[i].size() == 2 && from_hex(tokens[i], &byte);
+            if (hex)
+                payload.push_back(byte[0]);
+        }
+
+        if (!hex)
+            continue;
+
+        key->name.clear();
+        for (size_t i = 1; i < p; i++)
+            key->name += (i > 1 ? " " : "") + tokens[i];
+
+        key->type = (int)type;
+        key->payload = payload;
+
+        return true;
+    }
+
+    return false;
+}
+
+static std::vector<Key> list_keys() {
+    std::vector<std::string> body;
+    std::vector<std::string> acks = run(std::vector<std::string>(1, "[L]"), &body);
+
+    if (acks[0].compare(0, 2, "OK"))
+        die("listing failed: %s", acks[0].c_str());
+
+    std::vector<Key> keys;
+    for (size_t i = 0; i < body.size(); i++) {
+        Key key;
+
+        if (parse_listing(body[i], &key))
+            keys.push_back(key);
+    }
+
+    if (keys.size() != (size_t)atoi(acks[0].c_str() + 2))
+        die("listing doesn't match the key count");
+
+    return keys;
+}
+
+// Same as key_record_hash of the firmware: CRC16 of the type, the payload and the name
+static unsigned short record_hash(const Key &key) {
+    unsigned char type = (unsigned char)key.type;
+    unsigned short crc = crc16(&type, 1);
+
+    crc = crc16(key.payload.data(), key.payload.size(), crc);
+    return crc16((const unsigned char *)key.name.data(), key.name.size(), crc);
+}
+
+// The digest H answers with, the sum of the key hashes
+static unsigned short table_digest(const std::vector<Key> &keys) {
+    unsigned short digest = 0;
+
+    for (size_t i = 0; i < keys.size(); i++)
+        digest += record_hash(keys[i]);
+
+    return digest;
+}
+
+// Compares the key count and digest of the device with keys in one command
+static bool same_table(const std::vector<Key> &keys) {
+    std::string ack = run(std::vector<std::string>(1, "[H]"))[0];
+    unsigned int n_keys, digest;
+
+    if (sscanf(ack.c_str(), "OK %u %x", &n_keys, &digest) != 2)
+        die("reading the digest failed: %s", ack.c_str());
+
+    return n_keys == keys.size() && digest == table_digest(keys);
+}
+
+static std::vector<unsigned short> key_hashes() {
+    std::vector<std::string> body;
+    std::string ack = run(std::vector<std::string>(1, "[H 0]"), &body)[0];
+
+    if (ack.compare(0, 2, "OK"))
+        die("reading the key hashes failed: %s", ack.c_str());
+
+    std::vector<unsigned short> hashes;
+    for (size_t i = 0; i < body.size(); i++) {
+        std::istringstream in(body[i]);
+        std::string token;
+
+        while (in >> token)
+            hashes.push_back((unsigned short)strtoul(token.c_str(), NULL, 16));
+    }
+
+    if (hashes.size() != (size_t)atoi(ack.c_str() + 2))
+        die("key hashes don't match the key count");
+
+    return hashes;
+}
+
+static std::string csv_field(const std::string &text) {
+    if (text.find_first_of(",\"\n") == std::string::npos)
+        return text;
+
+    std::string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"')
+            quoted += '"';
+        quoted += text[i];
+    }
+
+    return quoted + '"';
+}
+
+static std::vector<std::string> split_csv(const std::string &line) {
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+
+        if (quoted && c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+            fields.back() += '"';
+            i++;
+        } else if (c == '"') {
+            quoted = !quoted;
+        } else if (c == ',' && !quoted) {
+            fields.push_back("");
+        } else if (c != '\r') {
+            fields.back() += c;
+        }
+    }
+
+    return fields;
+}
+
+static std::string json_string(const std::string &text) {
+    std::string escaped = "\"";
+
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\')
+            escaped += '\\';
+        escaped += text[i];
+    }
+
+    return escaped + '"';
+}
+
+static void write_keys(FILE *out, const std::vector<Key> &keys, bool json) {
+    if (json)
+        fprintf(out, "[\n");
+    else
+        fprintf(out, "name,type,key\n");
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        const Key &key = keys[i];
+
+        if (json)
+            fprintf(out, "  {\"name\": %s, \"type\": %d, \"key\": \"%s\"}%s\n", json_string(key.name).c_str(),
+                    key.type, to_hex(key.payload).c_str(), i + 1 < keys.size() ? "," : "");
+        else
+            fprintf(out, "%s,%d,%s\n", csv_field(key.name).c_str(), key.type, to_hex(key.payload).c_str());
+    }
+
+    if (json)
+        fprintf(out, "]\n");
+}
+
+/*
+ * Just enough JSON for a key set: an array of flat objects with string
+ * and number values, anything else is an error.
+ */
+struct JsonReader {
+    const std::string &text;
+    size_t pos;
+
+    explicit JsonReader(const std::string &t) : text(t), pos(0) {}
+
+    void skip() {
+        while (pos < text.size() && isspace((unsigned char)text[pos]))
+            pos++;
+    }
+
+    bool eat(char c) {
+        skip();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool string(std::string *out) {
+        if (!eat('"'))
+            return false;
+
+        out->clear();
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] == '\\' && pos + 1 < text.size())
+                pos++;
+            *out += text[pos++];
+        }
+
+        return eat('"');
+    }
+
+    bool value(std::string *out) {
+        skip();
+        if (pos < text.size() && text[pos] == '"')
+            return string(out);
+
+        size_t start = pos;
+        while (pos < text.size() && (isalnum((unsigned char)text[pos]) || text[pos] == '-' || text[pos] == '.'))
+            pos++;
+        *out = text.substr(start, pos - start);
+
+        return pos > start;
+    }
+};
+
+static std::vector<Key> read_json(const std::string &text) {
+    JsonReader json(text);
+    std::vector<Key> keys;
+
+    if (!json.eat('['))
+        die("JSON key set has to be an array");
+
+    if (json.eat(']'))
+        return keys;
+
+    do {
+        Key key;
+        key.type = -1;
+        std::string field, value;
+
+        if (!json.eat('{'))
+            die("JSON keys have to be objects");
+
+        do {
+            if (!json.string(&field) || !json.eat(':') || !json.value(&value))
+                die("broken JSON near byte %s", std::to_string(json.pos).c_str());
+
+            if (field == "name")
+                key.name = value;
+            else if (field == "type")
+                key.type = atoi(value.c_str());
+            else if (field == "key" && !from_hex(value, &key.payload))
+                die("bad key \"%s\"", value.c_str());
+        } while (json.eat(','));
+
+        if (!json.eat('}'))
+            die("broken JSON near byte %s", std::to_string(json.pos).c_str());
+
+        keys.push_back(key);
+    } while (json.eat(','));
+
+    if (!json.eat(']'))
+        die("broken JSON near byte %s", std::to_string(json.pos).c_str());
+
+    return keys;
+}
+
+static std::vector<Key> read_csv(std::istream &in) {
+    std::vector<Key> keys;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        std::vector<std::string> fields = split_csv(line);
+
+        if (fields.size() == 1 && fields[0].empty())
+            continue;
+        if (fields.size() != 3)
+            die("CSV lines need name, type and key: %s", line.c_str());
+        if (fields[0] == "name" && fields[1] == "type")
+            continue;
+
+        Key key;
+        key.name = fields[0];
+        key.type = atoi(fields[1].c_str());
+
+        if (!from_hex(fields[2], &key.payload))
+            die("bad key \"%s\"", fields[2].c_str());
+
+        keys.push_back(key);
+    }
+
+    return keys;
+}
+
+static bool is_json(const std::string &path) {
+    return path.size() > 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+}
+
+static std::vector<Key> load_keys(const std::string &path) {
+    std::ifstream in(path.c_str());
+    if (!in)
+        die("can't open %s", path.c_str());
+
+    if (!is_json(path))
+        return read_csv(in);
+
+    std::stringstream text;
+    text << in.rdbuf();
+
+    return read_json(text.str());
+}
+
+static bool has_hash(const std::vector<unsigned short> &hashes, const Key &key) {
+    return std::find(hashes.begin(), hashes.end(), record_hash(key)) != hashes.end();
+}
+
+/*
+ * Only keys the device doesn't have yet under the same name get
+ * written: a single H tells whether anything has to be done at all,
+ * otherwise the key hashes show which keys are missing.
+ */
+static int push(const std::string &path) {
+    std::vector<Key> keys = load_keys(path);
+    std::vector<std::string> commands;
+    std::vector<size_t> owners;     // key of every command
+    size_t n_written = 0;
+    int failed = 0;
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        std::string error;
+
+        if (!check_key(&keys[i], &error))
+            die("%s", (keys[i].name + ": " + error).c_str());
+    }
+
+    if (same_table(keys)) {
+        printf("up to date\n");
+        return 0;
+    }
+
+    std::vector<unsigned short> hashes = key_hashes();
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (has_hash(hashes, keys[i]))
+            continue;
+
+        write_commands(keys[i], &commands);
+        owners.resize(commands.size(), i);
+        n_written++;
+    }
+
+    std::vector<std::string> acks = run(commands);
+
+    for (size_t i = 0; i < acks.size(); i++) {
+        if (acks[i].compare(0, 2, "OK")) {
+            fprintf(stderr, "%s: %s\n", keys[owners[i]].name.c_str(), acks[i].c_str());
+            failed++;
+        }
+    }
+
+    // Read back: every key of the file has to be there under its name, the listing is only needed if one isn't
+    hashes = key_hashes();
+
+    bool complete = true;
+    for (size_t i = 0; i < keys.size() && complete; i++)
+        complete = has_hash(hashes, keys[i]);
+
+    if (complete) {
+        printf("%zu of %zu keys written, %d differ\n", n_written, keys.size(), failed);
+        return failed ? 1 : 0;
+    }
+
+    std::vector<Key> stored = list_keys();
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        const Key *found = NULL;
+
+        for (size_t j = 0; j < stored.size() && !found; j++) {
+            if (stored[j].type == keys[i].type && stored[j].payload == keys[i].payload)
+                found = &stored[j];
+        }
+
+        if (!found) {
+            printf("- %s,%d,%s\n", csv_field(keys[i].name).c_str(), keys[i].type, to_hex(keys[i].payload).c_str());
+            failed++;
+        } else if (found->name != keys[i].name) {
+            printf("~ %s -> %s\n", keys[i].name.c_str(), found->name.c_str());
+            failed++;
+        }
+    }
+
+    printf("%zu of %zu keys written, %d differ\n", n_written, keys.size(), failed);
+
+    return failed ? 1 : 0;
+}
+
+/*
+ * Same as key_fingerprint of the firmware: crc8 of the type and up to
+ * 7 fixed payload bytes, the ROM of a memory key without its CRC, or
+ * the summary of a raw trace (length, crc8 and first 6 trace bytes).
+ */
+static unsigned char fingerprint(const Key &key) {
+    const std::vector<unsigned char> &payload = key.payload;
+    std::vector<unsigned char> data;
+
+    data.reserve(9);
+    data.push_back((unsigned char)key.type);
+
+    if (key.type == KEY_TYPE_RAW && !payload.empty()) {
+        size_t len = std::min(std::min((size_t)payload[0], (size_t)RAW_TRACE_SIZE - 1), payload.size() - 1);
+
+        data.push_back((unsigned char)len);
+        data.push_back(crc8(payload.data() + 1, len));
+        for (size_t i = 0; i < 6; i++)
+            data.push_back(i < len ? payload[i + 1] : 0);
+    } else {
+        size_t first = key.type == KEY_TYPE_DS1992 ? 1 : 0;
+        size_t len = key_payload_lens[key.type] ? std::min(key_payload_lens[key.type], 7) : 7;
+
+        for (size_t i = first; i < first + len && i < payload.size(); i++)
+            data.push_back(payload[i]);
+    }
+
+    return crc8(data.data(), data.size());
+}
+
+static const char *const type_names[N_KEY_TYPES] = {"DS1990", "raw", "Cyfral", "Metacom", "EM4100", "DS1992"};
+
+static std::string describe_event(int type, unsigned long arg, const std::vector<Key> &keys) {
+    static const char *const reads[] = {"read", "no key", "not an iButton", "CRC error"};
+    static const char *const copies[] = {"copied", "no blank", "copy failed", "battery too low to copy"};
+    static const char *const levels[] = {"normal", "low", "critical"};
+    static const char *const resets[] = {"power-on", "external", "brown-out", "watchdog"};
+    std::string text;
+
+    switch (type) {
+        case 0:
+            text = "boot:";
+            for (int i = 0; i < 4; i++)
+                if (arg & (1 << i))
+                    text += std::string(" ") + resets[i];
+            return text;
+        case 1:
+            if ((arg >> 2) >= N_KEY_TYPES)
+                break;
+            return std::string(type_names[arg >> 2]) + " " + reads[arg & 3];
+        case 2:
+            text = "emulate";
+            for (size_t i = 0; i < keys.size(); i++)
+                if (fingerprint(keys[i]) == arg)
+                    text += " " + keys[i].name + ",";
+            if (text[text.size() - 1] == ',')
+                text.erase(text.size() - 1);
+            else
+                text += " a key not stored any more";
+            return text;
+        case 3:
+            if (arg > 3)
+                break;
+            return copies[arg];
+        case 4:
+            if (arg > 2)
+                break;
+            return std::string("battery ") + levels[arg];
+    }
+
+    return "event " + std::to_string(type) + " " + std::to_string(arg);
+}
+
+/*
+ * The log is the raw ring: a type byte, then the seconds since the
+ * previous event and an argument as base 127 varints. Times restart
+ * at every boot and don't count power-down sleep.
+ */
+static int events() {
+    std::vector<std::string> body;
+    std::string ack = run(std::vector<std::string>(1, "[E]"), &body)[0];
+
+    if (ack.compare(0, 2, "OK"))
+        die("reading the log failed: %s", ack.c_str());
+
+    std::vector<unsigned char> ring, line;
+    for (size_t i = 0; i < body.size(); i++) {
+        if (!from_hex(body[i], &line))
+            die("bad log line: %s", body[i].c_str());
+        ring.insert(ring.end(), line.begin(), line.end());
+    }
+
+    std::vector<Key> keys = list_keys();
+    unsigned long seconds = 0;
+    size_t pos = 0;
+
+    while (pos < ring.size()) {
+        int type = ring[pos++];
+        unsigned long values[2];
+
+        for (int i = 0; i < 2; i++) {
+            unsigned long value = 0, scale = 1;
+
+            while (pos < ring.size()) {
+                unsigned char digit = ring[pos++];
+                value += (digit & 0x7F) * scale;
+                scale *= 127;
+                if (!(digit & 0x80))
+                    break;
+            }
+
+            values[i] = value;
+        }
+
+        seconds = type == 0 ? 0 : seconds + values[0];
+        printf("%8lus  %s\n", seconds, describe_event(type, values[1], keys).c_str());
+    }
+
+    return 0;
+}
+
+/*
+ * An existing FILE is taken as the last pull: only keys whose hash
+ * isn't in it get fetched with R, and when the digest matches the
+ * file is left alone.
+ */
+static int pull(const std::string &path) {
+    std::vector<Key> keys;
+
+    if (access(path.c_str(), F_OK) == 0) {
+        std::vector<Key> known = load_keys(path);
+
+        if (same_table(known)) {
+            printf("up to date\n");
+            return 0;
+        }
+
+        std::vector<unsigned short> hashes = key_hashes();
+        std::vector<std::string> commands;
+
+        keys.resize(hashes.size());
+        for (size_t i = 0; i < hashes.size(); i++) {
+            bool found = false;
+
+            for (size_t j = 0; j < known.size() && !found; j++) {
+                found = record_hash(known[j]) == hashes[i];
+                if (found)
+                    keys[i] = known[j];
+            }
+
+            if (!found)
+                commands.push_back("[R " + std::to_string(i) + "]");
+        }
+
+        std::vector<std::string> body;
+        std::vector<std::string> acks = run(commands, &body);
+        size_t line = 0;
+
+        for (size_t i = 0; i < acks.size(); i++) {
+            Key key;
+
+            if (acks[i].compare(0, 2, "OK") || line >= body.size() || !parse_listing(body[line++], &key))
+                die("fetching a key failed: %s", acks[i].c_str());
+
+            keys[atoi(commands[i].c_str() + 3)] = key;
+        }
+
+        printf("%zu keys, %zu fetched\n", keys.size(), commands.size());
+    } else {
+        keys = list_keys();
+        printf("%zu keys\n", keys.size());
+    }
+
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+        die("can't create %s", path.c_str());
+
+    write_keys(out, keys, is_json(path));
+    fclose(out);
+
+    return 0;
+}
+
+// Record lengths with the tag, by tag
+static const size_t sniff_record_lens[N_SNIFF_TAGS] = {1, 5, 5, 2, 3, 3, 3, 2};
+
+static unsigned sniff_word(const std::vector<unsigned char> &trace, size_t pos) {
+    return trace[pos] | trace[pos + 1] << 8;
+}
+
+static const char *rom_command_name(int command) {
+    switch (command) {
+        case 0x33: return "Read ROM";
+        case 0x55: return "Match ROM";
+        case 0xCC: return "Skip ROM";
+        case 0xF0: return "Search ROM";
+        case 0xEC: return "Alarm Search";
+        case 0x3C: return "Overdrive Skip ROM";
+        case 0x69: return "Overdrive Match ROM";
+        default: return "";
+    }
+}
+
+/*
+ * Prints a capture: every reset starts a transaction, its first byte
+ * is the ROM command and the rest get dumped eight to a line. Times
+ * come in timer ticks, the start record tells how many make a us.
+ */
+static int decode(const std::vector<unsigned char> &trace) {
+    if (trace.size() < 2 || trace[0] != SNIFF_START || !trace[1])
+        die("not a capture");
+
+    unsigned ticks_per_us = trace[1];
+    size_t pos = 2, column = 0;     // bytes on the current data line
+    bool ended = false, first_reset = true, in_transaction = false;
+
+    while (pos < trace.size() && !ended) {
+        int tag = trace[pos];
+
+        if (tag >= N_SNIFF_TAGS || tag == SNIFF_START || pos + sniff_record_lens[tag] > trace.size())
+            break;
+
+        if (column && (tag != SNIFF_BYTE || column == 8)) {
+            printf("\n");
+            column = 0;
+        }
+
+        switch (tag) {
+            case SNIFF_END:
+                ended = true;
+                break;
+            case SNIFF_RESET: {
+                unsigned long overflows = sniff_word(trace, pos + 1);
+                printf("reset, %u us low", sniff_word(trace, pos + 3) / ticks_per_us);
+
+                // The timer wraps every 65536 ticks, the count saturates
+                if (overflows < 0xFFFF)
+                    printf(", %lu ms after the %s", overflows * 65536 / ticks_per_us / 1000,
+                           first_reset ? "start" : "last");
+                printf("\n");
+
+                first_reset = false;
+                in_transaction = false;
+                break;
+            }
+            case SNIFF_PRESENCE:
+                printf("  presence after %u us, %u us low\n",
+                       sniff_word(trace, pos + 1) / ticks_per_us, sniff_word(trace, pos + 3) / ticks_per_us);
+                break;
+            case SNIFF_BYTE:
+                if (!in_transaction) {
+                    printf("  %02X %s\n", trace[pos + 1], rom_command_name(trace[pos + 1]));
+                    in_transaction = true;
+                } else {
+                    printf("%s%02X", column ? " " : "  ", trace[pos + 1]);
+                    column++;
+                }
+                break;
+            case SNIFF_BITS:
+                printf("  %u bits %02X\n", trace[pos + 1], trace[pos + 2]);
+                break;
+            case SNIFF_LATE:
+                printf("  %u slots too short to time, taken as 1\n", sniff_word(trace, pos + 1));
+                break;
+            case SNIFF_DROPPED:
+                printf("  %u records dropped\n", sniff_word(trace, pos + 1));
+                break;
+        }
+
+        pos += sniff_record_lens[tag];
+    }
+
+    if (column)
+        printf("\n");
+
+    if (!ended) {
+        fprintf(stderr, "keyctl: capture cut short\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void on_interrupt(int) {
+    interrupted = 1;
+}
+
+/*
+ * The device answers S with OK and then streams binary records until
+ * a byte arrives or a button gets pressed, ending with SNIFF_END.
+ */
+static int sniff(const std::string &path) {
+    std::string ack = run(std::vector<std::string>(1, "[S]"))[0];
+
+    if (ack.compare(0, 2, "OK"))
+        die("sniffing failed: %s", ack.c_str());
+
+    signal(SIGINT, on_interrupt);
+    fprintf(stderr, "sniffing, Ctrl-C or a button press stops\n");
+
+    std::vector<unsigned char> trace(pending.begin(), pending.end());
+    pending.clear();
+
+    size_t pos = 2;
+    bool stopping = false, ended = false;
+    long deadline = 0;
+
+    while (!ended) {
+        // Walks the complete records, a 0 byte inside one isn't the end
+        while (trace.size() > pos && trace[pos] < N_SNIFF_TAGS && pos + sniff_record_lens[trace[pos]] <= trace.size()) {
+            ended = trace[pos] == SNIFF_END;
+            pos += sniff_record_lens[trace[pos]];
+            if (ended)
+                break;
+        }
+
+        if (ended)
+            break;
+        if (trace.size() > pos && trace[pos] >= N_SNIFF_TAGS)
+            die("garbled capture");
+
+        if (interrupted && !stopping) {
+            send("x");
+            stopping = true;
+            deadline = now_ms() + SNIFF_TIMEOUT_MS;
+        }
+
+        if (stopping && now_ms() > deadline)
+            die("the device didn't stop");
+
+        struct pollfd pfd = {port, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        unsigned char chunk[128];
+        ssize_t n = read(port, chunk, sizeof(chunk));
+
+        if (n > 0)
+            trace.insert(trace.end(), chunk, chunk + n);
+        else if (n < 0 && errno != EINTR && errno != EAGAIN)
+            die("read failed");
+    }
+
+    signal(SIGINT, SIG_DFL);
+    trace.resize(pos);
+
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out)
+        die("can't create %s", path.c_str());
+
+    fwrite(trace.data(), 1, trace.size(), out);
+    fclose(out);
+
+    return decode(trace);
+}
+
+static int simple(const std::string &command) {
+    std::string ack = run(std::vector<std::string>(1, command))[0];
+
+    if (ack.compare(0, 2, "OK")) {
+        fprintf(stderr, "keyctl: %s\n", ack.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: keyctl [-p port] [-b baud] [-s settle_ms] [-w window] [-v] command\n"
+            "  list [--csv|--json]   pull FILE   push FILE   delete INDEX   wipe   timing   events\n"
+            "  default INDEX [always] | none   sniff FILE   decode FILE\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *path = "/dev/ttyUSB0";
+    int baud = 9600, settle_ms = 2000, opt;
+
+    while ((opt = getopt(argc, argv, "+p:b:s:w:v")) != -1) {
+        switch (opt) {
+            case 'p': path = optarg; break;
+            case 'b': baud = atoi(optarg); break;
+            case 's': settle_ms = atoi(optarg); break;
+            case 'w': window = strtoul(optarg, NULL, 10); break;
+            case 'v': verbose = true; break;
+            default: usage();
+        }
+    }
+
+    if (optind >= argc)
+        usage();
+
+    if (window >= RX_BUFFER_SIZE)
+        die("the window has to be below the device RX buffer");
+
+    std::string command = argv[optind];
+    std::string arg = optind + 1 < argc ? argv[optind + 1] : "";
+
+    // A saved capture needs no device
+    if (command == "decode" && !arg.empty()) {
+        std::ifstream in(arg.c_str(), std::ios::binary);
+        if (!in)
+            die("can't open %s", arg.c_str());
+
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return decode(std::vector<unsigned char>(data.begin(), data.end()));
+    }
+
+    open_port(path, baud, settle_ms);
+
+    if (command == "list") {
+        std::vector<Key> keys = list_keys();
+
+        if (arg.empty()) {
+            for (size_t i = 0; i < keys.size(); i++)
+                printf("%3zu  %-32s %d %s\n", i, keys[i].name.c_str(), keys[i].type, to_hex(keys[i].payload).c_str());
+        } else {
+            write_keys(stdout, keys, arg == "--json");
+        }
+    } else if (command == "pull" && !arg.empty()) {
+        return pull(arg);
+    } else if (command == "push" && !arg.empty()) {
+        return push(arg);
+    } else if (command == "delete" && !arg.empty()) {
+        return simple("[D " + arg + "]");
+    } else if (command == "default" && !arg.empty()) {
+        std::string mode = optind + 2 < argc ? argv[optind + 2] : "";
+
+        if (!mode.empty() && mode != "always")
+            usage();
+
+        return simple("[Q " + (arg == "none" ? std::string("-1") : arg) + (mode.empty() ? "" : " 1") + "]");
+    } else if (command == "wipe") {
+        return simple("[K 0]");
+    } else if (command == "events") {
+        return events();
+    } else if (command == "sniff" && !arg.empty()) {
+        return sniff(arg);
+    } else if (command == "timing") {
+        std::vector<std::string> body;
+        run(std::vector<std::string>(1, "[T]"), &body);
+
+        bool failed = false;
+        for (size_t i = 0; i < body.size(); i++) {
+            printf("%s\n", body[i].c_str());
+            failed |= body[i].find("fail") != std::string::npos;
+        }
+
+        return failed ? 1 : 0;
+    } else {
+        usage();
+    }
+
+    return 0;
+}
+
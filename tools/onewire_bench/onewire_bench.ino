@@ -0,0 +1,361 @@
+/*
+ * 1-Wire timing bench for the emulator.
+ *
+ * Runs on a second 8 MHz Pro Mini acting as the bus master: D10
+ * goes to the emulator's contact pad with a 2.2k pull-up to VCC, the
+ * grounds get tied together. Start emulating a DS1990 key on the
+ * emulator, open this board's serial port at 9600 and send anything.
+ *
+ * First the ROM gets read with nominal timing, then every timing a
+ * reader may use is swept on its own over the range real readers use,
+ * with the rest kept nominal. Every setting is tried RUNS times with a
+ * random pause before each try, so the transactions land anywhere in
+ * the emulator's loop, display flushes and button polls included. A
+ * try passes if the presence pulse is within spec and the ROM reads
+ * back the same. Presence latency and the time zero bits are held low
+ * get reported as distributions. Afterwards the T serial command of
+ * the emulator shows how long its bus went unwatched.
+ */
+
+#define BUS_DDR DDRB
+#define BUS_PORT PORTB
+#define BUS_PIN_REG PINB
+#define BUS_BIT PB2             // D10
+
+#define RUNS 100
+#define MAX_PAUSE_MS 20
+#define TICKS_PER_US (F_CPU / 1000000L)     // Timer1 runs at the CPU clock
+#define HIST_BUCKETS 8
+#define HIST_STEP_US 8
+
+#define PRESENCE_WAIT_MIN 15
+#define PRESENCE_WAIT_MAX 60
+#define PRESENCE_MIN 60
+#define PRESENCE_MAX 240
+#define NO_EDGE 0xFFFF
+
+struct Timing {
+    uint16_t reset_us;
+    uint8_t write1_us;      // low time of a 1 slot
+    uint8_t write0_us;      // low time of a 0 slot
+    uint8_t read_low_us;
+    uint8_t sample_us;      // from the start of a read slot
+    uint8_t recovery_us;
+};
+
+const Timing nominal = {480, 6, 60, 3, 12, 5};
+
+struct Stats {
+    uint16_t min, max;
+    uint32_t sum;
+    uint16_t n;
+    uint16_t hist[HIST_BUCKETS];
+};
+
+uint8_t reference_rom[8];
+Stats presence_stats, hold_stats;
+
+#pragma region BUS
+
+inline void bus_low() {
+    BUS_DDR |= _BV(BUS_BIT);
+}
+
+inline void bus_release() {
+    BUS_DDR &= ~_BV(BUS_BIT);
+}
+
+inline bool bus_high() {
+    return BUS_PIN_REG & _BV(BUS_BIT);
+}
+
+inline uint16_t elapsed_us(uint16_t since) {
+    return (uint16_t)(TCNT1 - since) / TICKS_PER_US;
+}
+
+inline void wait_until(uint16_t since, uint16_t us) {
+    while (elapsed_us(since) < us);
+}
+
+// Waits for the bus to reach level, returns microseconds from since or NO_EDGE after timeout_us
+uint16_t wait_level(bool level, uint16_t since, uint16_t timeout_us) {
+    for (;;) {
+        uint16_t t = elapsed_us(since);
+
+        if (bus_high() == level)
+            return t;
+        if (t > timeout_us)
+            return NO_EDGE;
+    }
+}
+
+/*
+ * Reset and presence. Returns the time from releasing the bus to the
+ * presence pulse and its width, NO_EDGE when there was none.
+ */
+void reset_pulse(uint16_t reset_us, uint16_t *wait, uint16_t *width) {
+    cli();
+    uint16_t start = TCNT1;
+    bus_low();
+    wait_until(start, reset_us);
+
+    bus_release();
+    uint16_t released = TCNT1;
+
+    // The slave may already hold the bus, so the rise doesn't have to be seen
+    wait_level(true, released, 5);
+    *wait = wait_level(false, released, 300);
+    *width = NO_EDGE;
+
+    if (*wait != NO_EDGE) {
+        uint16_t fell = TCNT1;
+        *width = wait_level(true, fell, 500);
+    }
+
+    wait_until(released, 480);
+    sei();
+}
+
+void write_bit(const Timing &t, bool bit) {
+    cli();
+    uint16_t start = TCNT1;
+    bus_low();
+    wait_until(start, bit ? t.write1_us : t.write0_us);
+    bus_release();
+    wait_until(start, max(65, t.write0_us + t.recovery_us));
+    sei();
+}
+
+// Reads a bit, hold gets how long the slave kept the bus low from the start of the slot
+bool read_bit(const Timing &t, uint16_t *hold) {
+    cli();
+    uint16_t start = TCNT1;
+    bus_low();
+    wait_until(start, t.read_low_us);
+    bus_release();
+    wait_until(start, t.sample_us);
+
+    bool bit = bus_high();
+    *hold = bit ? 0 : wait_level(true, start, 120);
+
+    wait_until(start, 65 + t.recovery_us);
+    sei();
+
+    return bit;
+}
+
+#pragma endregion
+
+#pragma region STATS
+
+void stats_clear(Stats *s) {
+    memset(s, 0, sizeof(Stats));
+    s->min = NO_EDGE;
+}
+
+void stats_add(Stats *s, uint16_t value) {
+    s->n++;
+    s->sum += value;
+    s->min = min(s->min, value);
+    s->max = max(s->max, value);
+    s->hist[min(value / HIST_STEP_US, HIST_BUCKETS - 1)]++;
+}
+
+void stats_print(const __FlashStringHelper *name, const Stats *s) {
+    Serial.print(F("    "));
+    Serial.print(name);
+
+    if (!s->n) {
+        Serial.println(F(": none"));
+        return;
+    }
+
+    Serial.print(F(": min "));
+    Serial.print(s->min);
+    Serial.print(F(" avg "));
+    Serial.print(s->sum / s->n);
+    Serial.print(F(" max "));
+    Serial.print(s->max);
+    Serial.print(F(" us |"));
+
+    for (byte i = 0; i < HIST_BUCKETS; i++) {
+        Serial.print(' ');
+        Serial.print(s->hist[i]);
+    }
+
+    Serial.println(F(" | per 8 us"));
+}
+
+#pragma endregion
+
+#pragma region BENCH
+
+uint8_t crc8(const uint8_t *data, byte len) {
+    uint8_t crc = 0;
+
+    while (len--) {
+        uint8_t in = *data++;
+
+        for (byte i = 0; i < 8; i++) {
+            uint8_t mix = (crc ^ in) & 0x01;
+            crc >>= 1;
+            if (mix)
+                crc ^= 0x8C;
+            in >>= 1;
+        }
+    }
+
+    return crc;
+}
+
+// One Read ROM transaction, true when the presence pulse was in spec and the ROM has a valid CRC
+bool read_rom(const Timing &t, uint8_t *rom) {
+    uint16_t wait, width;
+    reset_pulse(t.reset_us, &wait, &width);
+
+    if (wait == NO_EDGE || width == NO_EDGE)
+        return false;
+
+    stats_add(&presence_stats, wait);
+
+    if (wait < PRESENCE_WAIT_MIN || wait > PRESENCE_WAIT_MAX || width < PRESENCE_MIN || width > PRESENCE_MAX)
+        return false;
+
+    for (byte i = 0; i < 8; i++)
+        write_bit(t, (0x33 >> i) & 1);
+
+    for (byte i = 0; i < 64; i++) {
+        uint16_t hold;
+
+        if (i % 8 == 0)
+            rom[i / 8] = 0;
+
+        if (read_bit(t, &hold))
+            rom[i / 8] |= 1 << (i % 8);
+        else if (hold != NO_EDGE)
+            stats_add(&hold_stats, hold);
+    }
+
+    return crc8(rom, 7) == rom[7];
+}
+
+void run_setting(const __FlashStringHelper *name, uint16_t value, const Timing &t) {
+    stats_clear(&presence_stats);
+    stats_clear(&hold_stats);
+    uint16_t passed = 0;
+
+    for (uint16_t i = 0; i < RUNS; i++) {
+        uint8_t rom[8];
+
+        delay(random(MAX_PAUSE_MS));
+        if (read_rom(t, rom) && !memcmp(rom, reference_rom, 8))
+            passed++;
+    }
+
+    Serial.print(name);
+    Serial.print(' ');
+    Serial.print(value);
+    Serial.print(F(" us: "));
+    Serial.print(passed);
+    Serial.print('/');
+    Serial.print(RUNS);
+    Serial.println(passed == RUNS ? F(" pass") : F(" FAIL"));
+
+    stats_print(F("presence after"), &presence_stats);
+    stats_print(F("zero held"), &hold_stats);
+}
+
+void run_bench() {
+    bool found = false;
+
+    for (byte i = 0; i < 10 && !found; i++) {
+        found = read_rom(nominal, reference_rom);
+        delay(50);
+    }
+
+    if (!found) {
+        Serial.println(F("No key answers with nominal timing"));
+        return;
+    }
+
+    Serial.print(F("ROM"));
+    for (byte i = 0; i < 8; i++) {
+        Serial.print(' ');
+        if (reference_rom[i] < 16)
+            Serial.print(0);
+        Serial.print(reference_rom[i], HEX);
+    }
+    Serial.println();
+
+    static const uint16_t resets[] PROGMEM = {480, 560, 640, 720, 800, 960};
+    static const uint8_t write1s[] PROGMEM = {1, 5, 10, 15};
+    static const uint8_t write0s[] PROGMEM = {60, 90, 120};
+    static const uint8_t read_lows[] PROGMEM = {1, 3, 5};
+    static const uint8_t samples[] PROGMEM = {8, 10, 13, 15};
+    static const uint8_t recoveries[] PROGMEM = {1, 5, 10};
+
+    Timing t;
+
+    for (byte i = 0; i < sizeof(resets) / sizeof(resets[0]); i++) {
+        t = nominal;
+        t.reset_us = pgm_read_word_near(&resets[i]);
+        run_setting(F("reset"), t.reset_us, t);
+    }
+
+    for (byte i = 0; i < sizeof(write1s); i++) {
+        t = nominal;
+        t.write1_us = pgm_read_byte_near(&write1s[i]);
+        run_setting(F("write 1 low"), t.write1_us, t);
+    }
+
+    for (byte i = 0; i < sizeof(write0s); i++) {
+        t = nominal;
+        t.write0_us = pgm_read_byte_near(&write0s[i]);
+        run_setting(F("write 0 low"), t.write0_us, t);
+    }
+
+    for (byte i = 0; i < sizeof(read_lows); i++) {
+        t = nominal;
+        t.read_low_us = pgm_read_byte_near(&read_lows[i]);
+        run_setting(F("read low"), t.read_low_us, t);
+    }
+
+    for (byte i = 0; i < sizeof(samples); i++) {
+        t = nominal;
+        t.sample_us = pgm_read_byte_near(&samples[i]);
+        run_setting(F("read sample at"), t.sample_us, t);
+    }
+
+    for (byte i = 0; i < sizeof(recoveries); i++) {
+        t = nominal;
+        t.recovery_us = pgm_read_byte_near(&recoveries[i]);
+        run_setting(F("recovery"), t.recovery_us, t);
+    }
+
+    Serial.println(F("Done, send [T] to the emulator for its poll gaps"));
+}
+
+#pragma endregion
+
+void setup() {
+    Serial.begin(9600);
+
+    bus_release();
+    BUS_PORT &= ~_BV(BUS_BIT);      // low when driven, the pull-up does the rest
+
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+    randomSeed(analogRead(A0));
+
+    Serial.println(F("1-Wire bench, send anything to start"));
+}
+
+void loop() {
+    if (!Serial.available())
+        return;
+
+    while (Serial.available())
+        Serial.read();
+
+    run_bench();
+}